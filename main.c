@@ -3,10 +3,24 @@
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include "mesh_format.h"
+
 // Validation layers
 const uint32_t validation_layer_count = 1;
 const char *validation_layers[] = { "VK_LAYER_KHRONOS_validation" };
@@ -21,8 +35,705 @@ const char *device_extensions[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
     const bool enable_validation_layers = true;
 #endif
 
+// Number of frame readbacks that may be queued or written at once
+#define READBACK_RING_SIZE 3
+
+// GPU frame times kept for the end of run summary
+#define PROFILER_MAX_SAMPLES 4096
+#define PROFILER_MAX_COUNTERS 32
+
+// Pipeline statistics gathered per query scope, see query_statistics_flags
+#define QUERY_STATISTIC_COUNT 5
+
+// Frames between window title overlay updates
+#define QUERY_OVERLAY_INTERVAL 30
+
+// Frames between heap usage samples
+#define MEMORY_BUDGET_INTERVAL 8
+
+// Render targets standing in for swap chain images when running headless
+#define HEADLESS_IMAGE_COUNT 2
+
+// Texture data the streamer may copy per frame, also the size of its staging buffer
+#define TEXTURE_STAGING_SIZE (4 * 1024 * 1024)
+#define TEXTURE_MAX_LEVELS 16
+#define TEXTURE_MAX_COUNT 16
+
+// Host memory: per-frame scratch, fixed capacity object arrays and the driver allocator's size classes
+#define FRAME_ARENA_SIZE (1024 * 1024)
+#define MAX_SWAP_CHAIN_IMAGES 8
+#define MAX_OUTPUTS 4             // Windows besides the main one
+#define MAX_PHYSICAL_DEVICES 16
+#define MAX_QUEUE_FAMILIES 16
+#define HOST_POOL_CLASS_COUNT 5
+#define HOST_POOL_ALIGNMENT 64
+
+// Pipeline permutations: hash table slots (a power of two), specialization constants per key, compile workers
+#define PIPELINE_CACHE_CAPACITY 256
+#define PIPELINE_MAX_SPEC_CONSTANTS 4
+#define PIPELINE_MAX_SHADERS 4
+#define PIPELINE_COMPILE_THREADS 2
+
+// Particles: compute workgroup size, seconds a particle lives at most and bytes per particle
+#define PARTICLE_GROUP_SIZE 256
+#define PARTICLE_LIFETIME 4.0f
+#define PARTICLE_SIZE 32
+
+// Draw lists: multi-draw commands per swap chain image, threads sorting long lists, and what counts as long
+#define DRAW_LIST_MAX_INDIRECT 1024
+#define TASK_THREAD_COUNT 4
+#define DRAW_SORT_PARALLEL_MIN 4096
+
+// Meshes: largest --mesh-grid, and how far past the threshold an LOD's error has to get before it switches
+#define MESH_GRID_MAX 32
+#define MESH_MAX_INSTANCES (MESH_GRID_MAX * MESH_GRID_MAX)
+#define LOD_HYSTERESIS 0.25f
+
 // Structs
 
+typedef enum CaptureFormat
+{
+    CAPTURE_FORMAT_PPM,
+    CAPTURE_FORMAT_PNG,
+    CAPTURE_FORMAT_RAW,
+    CAPTURE_FORMAT_Y4M,  // 4:2:0 formats are converted on the GPU before the readback
+    CAPTURE_FORMAT_NV12,
+    CAPTURE_FORMAT_I420,
+} CaptureFormat;
+
+typedef enum DepthMode
+{
+    DEPTH_MODE_LESS,    // Regular depth tested and written color pass
+    DEPTH_MODE_PREPASS, // Depth only, no fragment shader
+    DEPTH_MODE_EQUAL,   // Color pass over a laid down depth buffer
+    DEPTH_MODE_TEST,    // Tested against the scene's depth but not written, for blended effects
+    DEPTH_MODE_COUNT,
+} DepthMode;
+
+typedef enum BlendMode
+{
+    BLEND_MODE_OPAQUE,
+    BLEND_MODE_ALPHA,
+    BLEND_MODE_ADDITIVE,
+} BlendMode;
+
+// Values of the fragment shader's SHADING specialization constant
+typedef enum ShadingMode
+{
+    SHADING_MODE_MODULATE,     // Vertex color times texture
+    SHADING_MODE_VERTEX_COLOR,
+    SHADING_MODE_TEXTURE,
+    SHADING_MODE_COUNT,
+} ShadingMode;
+
+typedef enum ReadbackState
+{
+    READBACK_FREE,      // Available for the next frame
+    READBACK_IN_FLIGHT, // Copy recorded and submitted, GPU may still write it
+    READBACK_QUEUED,    // Copy complete, waiting for or being handled by the writer
+} ReadbackState;
+
+// A finished frame handed to the readback callback. pixels points straight
+// into the mapped readback buffer and is only valid during the callback.
+typedef struct ReadbackFrame
+{
+    const uint8_t *pixels;
+    size_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t row_pitch;    // Of the luma plane for 4:2:0 formats, the chroma planes follow it
+    VkFormat format;
+    uint64_t frame_number;
+} ReadbackFrame;
+
+typedef void (*ReadbackCallback)(void *user, const ReadbackFrame *frame);
+
+typedef struct ReadbackSlot
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    void *mapped;
+    ReadbackState state;
+    uint64_t frame_number;
+    VkCommandBuffer command_buffer; // Re-recorded for each copy, it depends on the image index
+    VkDescriptorSet yuv_set;        // Converts into this slot
+} ReadbackSlot;
+
+typedef struct YuvParams
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t bgra;
+    uint32_t nv12;
+} YuvParams;
+
+typedef struct Readback
+{
+    bool enabled;
+    ReadbackSlot slots[READBACK_RING_SIZE];
+    VkDeviceSize size;
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    bool coherent;
+    int current_slot; // Slot the frame being recorded copies into, -1 for none
+
+    // 4:2:0 conversion, the image is copied to rgba and a compute pass writes the planes into the slot
+    bool yuv;
+    VkBuffer rgba;
+    VkDeviceMemory rgba_memory;
+    VkDescriptorSetLayout yuv_set_layout;
+    VkDescriptorPool yuv_pool;
+    VkPipelineLayout yuv_layout;
+    VkPipeline yuv_pipeline;
+
+    FILE *stream;       // --capture-stream, only touched by the writer once opened
+    bool stream_header; // Y4M header has been written to the stream
+
+    // Writer thread, owns QUEUED slots and hands them back as FREE
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t queue[READBACK_RING_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    bool stop;
+
+    ReadbackCallback callback;
+    void *callback_user;
+
+    uint64_t written;
+    uint64_t dropped;
+} Readback;
+
+// Named value sampled by some subsystem, reported with the frame times
+typedef struct ProfilerCounter
+{
+    char name[32];
+    double value;
+    double peak;
+} ProfilerCounter;
+
+typedef struct Profiler
+{
+    bool enabled;
+    VkQueryPool timestamp_pool; // Two timestamps per swap chain image
+    double timestamp_period;    // Nanoseconds per tick
+    uint64_t timestamp_mask;
+    int pending_image;          // Image whose timestamps are still to be read, -1 for none
+    double last_gpu_ms;
+    double samples_ms[PROFILER_MAX_SAMPLES];
+    uint32_t sample_count;
+    ProfilerCounter counters[PROFILER_MAX_COUNTERS];
+    uint32_t counter_count;
+} Profiler;
+
+// Named regions of the frame that get their own pipeline statistics and occlusion query
+typedef enum QueryScope
+{
+    QUERY_SCOPE_DEPTH_PREPASS,
+    QUERY_SCOPE_MAIN,
+    QUERY_SCOPE_PARTICLES,
+    QUERY_SCOPE_MESH,
+    QUERY_SCOPE_COUNT,
+} QueryScope;
+
+static const char *query_scope_names[QUERY_SCOPE_COUNT] = { "depth_prepass", "main", "particles", "mesh" };
+
+// Top bits of a draw's sort key, passes record in this order
+typedef enum DrawPass
+{
+    DRAW_PASS_DEPTH_PREPASS,
+    DRAW_PASS_MAIN,
+    DRAW_PASS_COUNT,
+} DrawPass;
+
+static const QueryScope draw_pass_scopes[DRAW_PASS_COUNT] = { QUERY_SCOPE_DEPTH_PREPASS, QUERY_SCOPE_MAIN };
+
+// Totals over every frame read back so far
+typedef struct QueryScopeTotals
+{
+    uint64_t frames;
+    uint64_t pixels;                 // Render area, for overdraw
+    uint64_t samples;                // Render area times sample count, for occlusion
+    uint64_t input_primitives;
+    uint64_t vertex_invocations;
+    uint64_t clipping_invocations;
+    uint64_t clipping_primitives;
+    uint64_t fragment_invocations;
+    uint64_t samples_passed;
+} QueryScopeTotals;
+
+typedef struct QueryStats
+{
+    bool enabled;
+    bool precise;                    // occlusionQueryPrecise, otherwise samples_passed is only zero or not
+    VkQueryPool statistics_pool;     // QUERY_SCOPE_COUNT queries per swap chain image
+    VkQueryPool occlusion_pool;      // Same layout
+    uint32_t recorded_scopes[MAX_SWAP_CHAIN_IMAGES]; // Scope bits each image's command buffer begins
+    VkExtent2D recorded_extent[MAX_SWAP_CHAIN_IMAGES];
+    bool pending[MAX_SWAP_CHAIN_IMAGES];            // Submitted and not read back yet
+    QueryScopeTotals totals[QUERY_SCOPE_COUNT];
+    QueryScopeTotals overlay_base[QUERY_SCOPE_COUNT]; // Totals at the last overlay update
+} QueryStats;
+
+// Deterministic content for headless and regression runs
+typedef struct Scene
+{
+    const char *name;
+    float clear_color[4];
+    uint32_t instance_count;
+    uint32_t material_count; // Instances cycle through this many shading modes
+} Scene;
+
+static const Scene scenes[] = {
+    { "triangle",  { 0.0f, 0.0f, 0.0f, 1.0f }, 1, 1 },
+    { "clear",     { 0.2f, 0.3f, 0.4f, 1.0f }, 1, 1 },
+    { "overlap",   { 0.0f, 0.0f, 0.0f, 1.0f }, 16, 1 },
+    { "materials", { 0.0f, 0.0f, 0.0f, 1.0f }, 16, 3 },
+};
+static const uint32_t scene_count = sizeof(scenes) / sizeof(scenes[0]);
+
+typedef struct DynamicResolution
+{
+    bool enabled;
+    float scale;          // Current per-axis scale of the render target
+    float min_scale;
+    float max_scale;
+    double target_ms;     // GPU frame time the controller steers towards
+    VkExtent2D max_extent;
+    VkImage image;        // Offscreen target sized for max_scale, rendered into partially
+    VkDeviceMemory memory;
+    VkImageView view;
+    VkFilter filter;      // Upscale filter, LINEAR when the format supports it
+} DynamicResolution;
+
+// Command buffers are recorded once per swap chain image and resubmitted
+// until something they depend on changes and bumps the version
+typedef struct CommandCache
+{
+    VkCommandBuffer buffers[MAX_SWAP_CHAIN_IMAGES];  // One per swap chain image
+    uint64_t recorded_version[MAX_SWAP_CHAIN_IMAGES]; // Version each buffer was recorded at, 0 for never
+    uint64_t version;
+    uint64_t hits;
+    uint64_t misses;
+} CommandCache;
+
+// An extra window sharing the device, pipelines and render targets of the main one. Its command
+// buffers record into draw slots past the main output's, see output_slot.
+typedef struct Output
+{
+    GLFWwindow *window;
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swap_chain;
+    VkImage images[MAX_SWAP_CHAIN_IMAGES];
+    VkImageView image_views[MAX_SWAP_CHAIN_IMAGES];
+    VkFramebuffer framebuffers[MAX_SWAP_CHAIN_IMAGES];
+    uint32_t image_count;
+    VkExtent2D extent;        // At most the main output's target_extent, the attachments are shared
+    VkSemaphore image_available;
+    uint32_t image_index;     // Acquired this frame
+    uint32_t scene;
+    VkCommandBuffer command_buffers[MAX_SWAP_CHAIN_IMAGES];
+    uint64_t recorded_version[MAX_SWAP_CHAIN_IMAGES]; // Against command_cache.version
+} Output;
+
+// Linear allocator, everything is released at once by moving used back
+typedef struct Arena
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+} Arena;
+
+// Fixed size blocks threaded on a free list
+typedef struct Pool
+{
+    uint8_t *base;
+    size_t block_size;
+    uint32_t block_count;
+    void *free_list;
+    uint32_t used;
+    uint32_t peak;
+} Pool;
+
+// Backs the VkAllocationCallbacks handed to the driver
+typedef struct HostMemory
+{
+    VkAllocationCallbacks callbacks;   // Passed to every Vulkan call that takes an allocator
+    pthread_mutex_t mutex;             // Drivers may allocate from any thread
+    Pool pools[HOST_POOL_CLASS_COUNT];
+    uint64_t allocations;
+    uint64_t reallocations;
+    uint64_t frees;
+    uint64_t heap_allocations;         // Too large, too aligned or the size class was full
+    uint64_t scope_allocations[5];     // Per VkSystemAllocationScope
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t internal_bytes;             // Reported through the internal allocation notifications
+    atomic_bool in_frame;              // Set while drawing a steady state frame
+    uint64_t frame_allocations;        // Allocations made while in_frame was set
+} HostMemory;
+
+// Heap usage and budget as reported by VK_EXT_memory_budget
+typedef struct MemoryBudget
+{
+    bool instance_support;  // VK_KHR_get_physical_device_properties2 is enabled on the instance
+    bool supported;         // VK_EXT_memory_budget is enabled on the device
+    PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_memory_properties2;
+    uint32_t heap_count;
+    VkMemoryHeapFlags heap_flags[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize usage[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize budget[VK_MAX_MEMORY_HEAPS];
+    float pressure;         // Fraction of a device local heap's budget past which textures are evicted
+    uint64_t evictions;
+    VkDeviceSize evicted_bytes;
+} MemoryBudget;
+
+typedef struct TextureFormatInfo
+{
+    VkFormat format;
+    uint32_t block_width;  // Texels per block, 1 for uncompressed formats
+    uint32_t block_height;
+    uint32_t block_size;   // Bytes per block
+} TextureFormatInfo;
+
+typedef struct TextureLevel
+{
+    const uint8_t *data;   // Tightly packed block rows, points into the mapped file
+    VkDeviceSize size;
+} TextureLevel;
+
+typedef struct Texture
+{
+    VkImage image;
+    VkDeviceMemory memory;
+    VkDeviceSize memory_size;
+    VkImageView view;            // Covers the resident levels only, VK_NULL_HANDLE until the first one lands
+    const TextureFormatInfo *format;
+    uint32_t width;              // Size of image level 0
+    uint32_t height;
+    uint32_t level_count;
+    TextureLevel levels[TEXTURE_MAX_LEVELS]; // Source data per image level, only level 0 when generating mips
+    bool generate_mips;          // Single source level, the others are blitted from it on the GPU
+    bool evicted;                // Image released under memory pressure, streamed again when bound
+    uint64_t last_used;          // Frame the texture was last sampled in, for LRU eviction
+    bool initialized;            // All levels transitioned for transfer
+    bool streaming;
+    uint32_t resident_level;     // Finest level that can be sampled, level_count while none is
+    uint32_t streaming_level;    // Level being copied, coarsest first
+    uint32_t streaming_row;      // Next block row of streaming_level
+    void *file;                  // Mapping of the source file, kept to stream again after an eviction
+    size_t file_size;
+} Texture;
+
+typedef struct TextureStreamer
+{
+    Texture textures[TEXTURE_MAX_COUNT]; // Texture 0 is a white texel, sampled until the bound one is resident
+    uint32_t texture_count;
+    uint32_t bound;                      // Texture the scene samples
+    VkImageView bound_view;              // View the descriptor set currently points at
+    VkBuffer staging;
+    VkDeviceMemory staging_memory;
+    uint8_t *staging_mapped;
+    VkCommandBuffer command_buffer;      // Re-recorded every frame that has something to upload
+    VkSampler sampler;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_set;
+    bool compression_bc;                 // textureCompressionBC is enabled on the device
+    VkDeviceSize budget;
+    VkDeviceSize used;
+    VkDeviceSize uploaded;
+    bool cycle_requested;                // T was pressed, the next texture is bound after the fence
+} TextureStreamer;
+
+// Everything a pipeline permutation depends on besides the layout, render pass and sample
+// count, which are fixed for a run. Only uint32_t members, so there is no padding to hash.
+typedef struct PipelineKey
+{
+    uint32_t shader;       // Index into pipeline_shaders
+    uint32_t depth_mode;   // DepthMode
+    uint32_t cull_mode;    // VkCullModeFlags
+    uint32_t front_face;   // VkFrontFace
+    uint32_t blend_mode;   // BlendMode
+    uint32_t spec_count;
+    uint32_t spec[PIPELINE_MAX_SPEC_CONSTANTS]; // Fragment shader constant_id i, unused ones stay 0
+} PipelineKey;
+
+typedef enum PipelineState
+{
+    PIPELINE_QUEUED,    // Waiting for a compile worker
+    PIPELINE_COMPILING,
+    PIPELINE_READY,
+    PIPELINE_FAILED,    // Draws keep using the fallback
+} PipelineState;
+
+typedef struct PipelineEntry
+{
+    _Atomic uint64_t hash; // 0 while the slot is free, published after key
+    atomic_uint state;     // PipelineState, pipeline is valid once it reads READY
+    PipelineKey key;
+    VkPipeline pipeline;
+} PipelineEntry;
+
+typedef enum PipelineShaderId
+{
+    PIPELINE_SHADER_SCENE,
+    PIPELINE_SHADER_PARTICLES, // Only loaded when particles are enabled
+    PIPELINE_SHADER_MESH,      // Only loaded when there is a mesh
+} PipelineShaderId;
+
+typedef struct PipelineShader
+{
+    const char *vert_path;
+    const char *frag_path;
+    bool mesh_vertices;        // Reads MeshVertex from binding 0, the others have no vertex input
+} PipelineShader;
+
+static const PipelineShader pipeline_shaders[] = {
+    { "shaders/vert.spv", "shaders/frag.spv", false },
+    { "shaders/particle_vert.spv", "shaders/particle_frag.spv", false },
+    { "shaders/mesh_vert.spv", "shaders/frag.spv", true },
+};
+static const uint32_t pipeline_shader_count = sizeof(pipeline_shaders) / sizeof(pipeline_shaders[0]);
+
+// Open addressed table of every permutation requested so far, read without locks at draw time
+typedef struct PipelineCache
+{
+    PipelineEntry entries[PIPELINE_CACHE_CAPACITY];
+    uint32_t entry_count;
+    bool full_reported;
+    VkPipelineCache cache;                       // Driver cache, loaded from and saved to config.pipeline_cache_path
+    VkShaderModule vert_modules[PIPELINE_MAX_SHADERS];
+    VkShaderModule frag_modules[PIPELINE_MAX_SHADERS];
+    VkPipeline fallback[DEPTH_MODE_COUNT];       // Drawn with while a permutation compiles
+
+    // Compile workers, they take entry indices off the queue
+    pthread_t threads[PIPELINE_COMPILE_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                         // Work queued or stop set
+    pthread_cond_t idle;                         // Queue drained and no compile running
+    uint32_t queue[PIPELINE_CACHE_CAPACITY];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t active;
+    bool stop;
+    atomic_uint completed;                       // Compiles finished by the workers
+    uint32_t seen_completed;                     // completed when the render thread last looked
+    bool fallback_recorded;                      // A cached command buffer draws with a fallback
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fallback_draws;
+    uint64_t compiles;                           // Under mutex, like the times below
+    uint64_t failures;
+    double compile_ms;
+    double compile_max_ms;
+    size_t loaded_bytes;
+} PipelineCache;
+
+typedef enum ParticleKernel
+{
+    PARTICLE_KERNEL_INIT,
+    PARTICLE_KERNEL_PREPARE,
+    PARTICLE_KERNEL_EMIT,
+    PARTICLE_KERNEL_INTEGRATE,
+    PARTICLE_KERNEL_COUNT,
+} ParticleKernel;
+
+// Params in particle.comp, std140
+typedef struct ParticleParams
+{
+    float emitter[4];      // xyz position, w spread of the initial velocity
+    float gravity[4];      // xyz acceleration, w lifetime
+    float dt;
+    uint32_t frame;
+    uint32_t emit_count;
+    uint32_t capacity;
+} ParticleParams;
+
+// State in particle.comp, the GPU writes both indirect commands itself
+typedef struct ParticleState
+{
+    VkDrawIndirectCommand draw;      // instanceCount is the number of live particles
+    VkDispatchIndirectCommand emit;
+    uint32_t dead_count;             // Entries on the free list
+    uint32_t emit_base;
+    uint32_t emitted;
+} ParticleState;
+
+typedef struct ParticleSystem
+{
+    bool enabled;
+    uint32_t capacity;
+    VkBuffer particles;              // PARTICLE_SIZE bytes each, device local
+    VkDeviceMemory particles_memory;
+    VkBuffer dead_list;              // Free particle indices
+    VkDeviceMemory dead_list_memory;
+    VkBuffer draw_list;              // Live particle indices, compacted every frame
+    VkDeviceMemory draw_list_memory;
+    VkBuffer state;
+    VkDeviceMemory state_memory;
+    VkBuffer params;
+    VkDeviceMemory params_memory;
+    ParticleParams *params_mapped;
+    VkDescriptorSetLayout compute_set_layout;
+    VkDescriptorSetLayout draw_set_layout; // Set 1 of the graphics pipeline layout
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet compute_set;
+    VkDescriptorSet draw_set;
+    VkPipelineLayout compute_layout;
+    VkPipeline kernels[PARTICLE_KERNEL_COUNT];
+    float emit_rate;                 // Particles per second
+    float emit_accumulator;
+    double last_update_ms;
+    uint64_t emitted;
+} ParticleSystem;
+
+// Push constants of mesh.vert, turn quantized positions into clip space
+typedef struct MeshTransform
+{
+    float scale[4];
+    float offset[4];
+} MeshTransform;
+
+// A mapped mesh file and the device copy of its vertex and index sections
+typedef struct Mesh
+{
+    bool loaded;
+    void *file;                      // Mapped for the whole run, meshlets are read from it
+    size_t file_size;
+    const MeshHeader *header;
+    const MeshMeshlet *meshlets;
+    const MeshLod *lods;
+    VkBuffer buffer;                 // Vertices, then indices at index_offset
+    VkDeviceMemory memory;
+    VkDeviceSize index_offset;
+    VkIndexType index_type;
+    MeshTransform transform;         // Fits the mesh to the view, copies are scaled down from it
+    uint32_t instance_count;
+    // Level each copy was last recorded at per output, see slot_output. UINT8_MAX before the first.
+    uint8_t instance_lods[1 + MAX_OUTPUTS][MESH_MAX_INSTANCES];
+    double load_ms;
+    uint64_t meshlets_drawn;
+    uint64_t meshlets_culled;
+    uint64_t lod_switches;
+} Mesh;
+
+typedef void (*TaskFunction)(void *user, uint32_t index);
+
+// Threads that split short, CPU bound jobs with the thread that runs them
+typedef struct TaskPool
+{
+    pthread_t threads[TASK_THREAD_COUNT - 1]; // The caller of task_pool_run is the last one
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    TaskFunction function;
+    void *user;
+    uint32_t count;
+    atomic_uint next;          // Next index to hand out
+    uint32_t finished;
+    uint32_t active;           // Workers inside the current run
+    uint64_t generation;       // Bumped for every run
+    bool open;                 // Workers may still join the current run
+    bool stop;
+} TaskPool;
+
+typedef struct DrawItem
+{
+    uint64_t key;              // See draw_sort_key
+    VkPipeline pipeline;
+    VkDescriptorSet material;  // Set 0
+    uint32_t vertex_count;
+    uint32_t first_vertex;
+    uint32_t instance_count;
+    uint32_t first_instance;
+} DrawItem;
+
+typedef struct DrawList
+{
+    DrawItem *items;           // Frame arena
+    uint32_t count;
+    uint32_t capacity;
+} DrawList;
+
+typedef struct DrawSortEntry
+{
+    uint64_t key;
+    uint32_t index;            // Into DrawList.items
+} DrawSortEntry;
+
+typedef struct RadixSortJob
+{
+    DrawSortEntry *src;
+    DrawSortEntry *dst;
+    uint32_t count;
+    uint32_t chunk_count;
+    uint32_t chunk_size;
+    uint32_t shift;            // Digit sorted by this pass
+    uint32_t (*histograms)[256]; // Per chunk, turned into scatter offsets in place
+} RadixSortJob;
+
+typedef struct DrawBatcher
+{
+    bool multi_draw;           // multiDrawIndirect and drawIndirectFirstInstance are enabled
+    VkBuffer indirect;         // DRAW_LIST_MAX_INDIRECT commands per recording slot
+    VkDeviceMemory indirect_memory;
+    VkDrawIndirectCommand *indirect_mapped;
+    TaskPool tasks;
+    uint64_t draws;            // Items recorded
+    uint64_t calls;            // Draw commands they turned into
+    uint64_t pipeline_binds;
+    uint64_t set_binds;
+    uint64_t skipped_binds;
+    uint64_t sorts;
+    uint64_t parallel_sorts;
+} DrawBatcher;
+
+typedef struct Config
+{
+    const char *capture_prefix;
+    const char *capture_stream; // File or named pipe every captured frame is appended to
+    CaptureFormat capture_format;
+    int64_t capture_frame; // Only capture this frame, -1 for every frame
+    bool headless;
+    uint32_t width;
+    uint32_t height;
+    uint32_t scene;
+    uint64_t frame_limit;  // 0 runs until the window is closed
+    uint32_t msaa_samples; // Requested sample count, clamped to what the device supports
+    bool depth_prepass;
+    bool dynamic_resolution;
+    float dynres_min_scale;
+    float dynres_max_scale;
+    double target_ms;
+    bool on_demand;        // Only render when something invalidated the image
+    double heartbeat_ms;   // Longest time between frames in on demand mode, 0 for none
+    const char *texture_paths[TEXTURE_MAX_COUNT - 1]; // Texture 0 is the white texel
+    uint32_t texture_path_count;
+    uint32_t texture_cycle;  // Frames between binding the next texture, 0 to only switch on T
+    uint32_t texture_width;  // Size of a raw RGBA texture, KTX2 files carry their own
+    uint32_t texture_height;
+    uint32_t texture_budget_mb;
+    uint32_t memory_pressure; // Percent of a heap's budget at which eviction starts
+    bool query_stats;
+    const char *query_json;   // Written on exit, implies query_stats
+    uint32_t shading;         // ShadingMode, M cycles it at runtime
+    const char *pipeline_cache_path;
+    const char *pipeline_list; // Permutations compiled before the first frame
+    uint32_t particle_count;   // Particle capacity, 0 disables them
+    const char *mesh_path;
+    uint32_t mesh_grid;        // Copies of the mesh per side
+    float lod_pixels;          // Screen-space error an LOD may have
+    uint32_t triangle_budget;  // Mesh triangles per recording, 0 for no limit
+    bool sort_check;           // Compare the draw sort against qsort at startup
+    uint32_t output_scenes[MAX_OUTPUTS]; // Scene of each extra window
+    uint32_t output_count;
+} Config;
+
 typedef struct App
 {
     GLFWwindow *window;
@@ -33,20 +744,49 @@ typedef struct App
     VkQueue present_queue;
     VkSurfaceKHR surface;
     VkSwapchainKHR swap_chain;
-    VkImage *swap_chain_images;
+    VkImage swap_chain_images[MAX_SWAP_CHAIN_IMAGES];
     VkFormat swap_chain_image_format;
     VkExtent2D swap_chain_extent;
-    VkImageView *swap_chain_image_views;
+    VkImageView swap_chain_image_views[MAX_SWAP_CHAIN_IMAGES];
     uint32_t swap_chain_image_count;
     VkRenderPass render_pass;
     VkPipelineLayout pipeline_layout;
-    VkPipeline graphics_pipeline;
-    VkFramebuffer *swapchain_framebuffers;
+    VkFramebuffer swapchain_framebuffers[MAX_SWAP_CHAIN_IMAGES];
     VkCommandPool commandPool;
-    VkCommandBuffer commandBuffer;
+    CommandCache command_cache;
     VkSemaphore imageAvailableSemaphore;
     VkSemaphore renderFinishedSemaphore;
     VkFence inFlightFence;
+    Config config;
+    Readback readback;
+    Profiler profiler;
+    uint64_t frame_number;
+    VkImageLayout present_layout; // Layout the render pass leaves the output image in
+    VkDeviceMemory headless_memory[HEADLESS_IMAGE_COUNT];
+    VkSampleCountFlagBits msaa_samples;
+    VkImage color_image; // Multisampled target, resolved into the output image
+    VkDeviceMemory color_image_memory;
+    VkImageView color_image_view;
+    VkFormat depth_format;
+    VkImage depth_image;
+    VkDeviceMemory depth_image_memory;
+    VkImageView depth_image_view;
+    DynamicResolution dynres;
+    VkExtent2D target_extent; // Size of the render pass attachments
+    VkExtent2D render_extent; // Area rendered this frame, at most target_extent
+    atomic_bool dirty;        // Set by request_redraw, possibly from other threads
+    atomic_uint animating;    // Active animations, frames render continuously while non-zero
+    uint64_t idle_wakeups;    // On demand wakeups that didn't need a frame
+    TextureStreamer textures;
+    HostMemory host_memory;
+    Arena frame_arena;        // Reset at the start of every frame, init code uses it as scratch before that
+    MemoryBudget memory_budget;
+    QueryStats query_stats;
+    PipelineCache pipelines;
+    ParticleSystem particles;
+    DrawBatcher batcher;
+    Mesh mesh;
+    Output outputs[MAX_OUTPUTS]; // config.output_count of them
 } App;
 
 typedef struct QueueFamilyIndices
@@ -81,40 +821,204 @@ void create_surface(App *app);
 
 /* Vulkan functions */
 void create_vulkan_instance(App *app);
-bool check_validation_layer_support();
+bool check_validation_layer_support(Arena *scratch);
 void pick_physical_device(App *app);
 void create_logical_device(App *app);
 QueueFamilyIndices find_queue_families(VkPhysicalDevice device, VkSurfaceKHR surface);
-SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR surface);
+SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR surface, Arena *scratch);
 VkSurfaceFormatKHR choose_swap_surface_format(const VkSurfaceFormatKHR *available_formats, uint32_t format_count);
 VkPresentModeKHR choose_swap_present_mode(const VkPresentModeKHR *available_present_modes, uint32_t present_count);
 VkExtent2D choose_swap_extent(GLFWwindow *window, const VkSurfaceCapabilitiesKHR capabilities);
 uint32_t clamp_u32(uint32_t n, uint32_t min, uint32_t max);
-bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface);
+bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface, Arena *scratch);
 void init_vulkan(App *app);
-bool device_has_extension_support(VkPhysicalDevice device);
+bool device_has_extension_support(VkPhysicalDevice device, Arena *scratch);
+bool has_extension(const VkExtensionProperties *extensions, uint32_t count, const char *name);
 void create_swap_chain(App *app);
 void create_image_views(App *app);
 void create_graphics_pipeline(App *app);
+VkPipeline create_pipeline_permutation(App *app, const PipelineKey *key);
 VkShaderModule create_shader_module(App *app, ShaderFile *shaderfile);
 void create_render_pass(App *app);
 void create_framebuffers(App *app);
+VkSampleCountFlagBits choose_msaa_samples(App *app);
+void create_color_resources(App *app);
+void destroy_color_resources(App *app);
+VkFormat find_supported_format(App *app, const VkFormat *candidates, uint32_t candidate_count, VkImageTiling tiling, VkFormatFeatureFlags features);
+void create_depth_resources(App *app);
+void destroy_depth_resources(App *app);
 void createCommandPool(App *app);
 void create_command_buffer(App *app); 
 void recordCommandBuffer(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+void record_scene_pass(App *app, VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, VkExtent2D extent,
+                       uint32_t scene_index, uint32_t slot);
+VkCommandBuffer get_command_buffer(App *app, uint32_t imageIndex);
+void invalidate_command_buffers(App *app);
+void set_scene(App *app, uint32_t scene);
 void create_sync_objects(App *app);
+uint32_t find_memory_type(App *app, uint32_t type_filter, VkMemoryPropertyFlags properties);
+void create_buffer(App *app, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags preferred,
+                   VkMemoryPropertyFlags required, VkBuffer *buffer, VkDeviceMemory *memory, VkMemoryPropertyFlags *actual);
+void create_image(App *app, uint32_t width, uint32_t height, uint32_t mip_levels, VkSampleCountFlagBits samples,
+                  VkFormat format, VkImageUsageFlags usage, VkMemoryPropertyFlags preferred, VkMemoryPropertyFlags required,
+                  VkImage *image, VkDeviceMemory *memory);
+VkImageView create_image_view(App *app, VkImage image, VkFormat format, VkImageAspectFlags aspect, uint32_t mip_levels);
+
+/* Dynamic resolution */
+void create_dynamic_resolution(App *app);
+void destroy_dynamic_resolution(App *app);
+void update_dynamic_resolution(App *app);
+void record_upscale(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+
+/* Host memory */
+void create_host_memory(App *app);
+void destroy_host_memory(App *app);
+void arena_init(Arena *arena, size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_release(Arena *arena, size_t mark);
+void arena_destroy(Arena *arena);
+void pool_init(Pool *pool, size_t block_size, uint32_t block_count);
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *block);
+bool pool_owns(const Pool *pool, const void *pointer);
+void pool_destroy(Pool *pool);
+
+/* Textures */
+void create_texture_streamer(App *app);
+void destroy_texture_streamer(App *app);
+uint32_t load_texture(App *app, const char *path, uint32_t raw_width, uint32_t raw_height);
+uint32_t create_texture(App *app, const TextureFormatInfo *format, uint32_t width, uint32_t height,
+                        uint32_t source_levels, const TextureLevel *levels, void *file, size_t file_size);
+void bind_texture(App *app, uint32_t index);
+void update_texture_cycle(App *app);
+void texture_allocate(App *app, uint32_t index);
+void texture_evict(App *app, uint32_t index);
+VkCommandBuffer texture_stream_update(App *app);
+
+/* Headless */
+void create_headless_targets(App *app);
+void destroy_headless_targets(App *app);
+
+/* Profiler */
+void create_profiler(App *app);
+void destroy_profiler(App *app);
+void profiler_begin(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+void profiler_end(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+void profiler_collect(App *app);
+void profiler_report(App *app);
+void profiler_set_counter(App *app, const char *name, double value);
+
+/* Pipeline statistics and occlusion queries */
+void create_query_stats(App *app);
+void destroy_query_stats(App *app);
+void query_stats_reset(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+void query_scope_begin(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex, QueryScope scope);
+void query_scope_end(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex, QueryScope scope);
+void query_stats_collect(App *app);
+void query_stats_overlay(App *app);
+void query_stats_report(App *app);
+void write_query_json(App *app, const char *path);
+
+/* Pipeline permutations */
+void create_pipeline_cache(App *app);
+void destroy_pipeline_cache(App *app);
+PipelineKey pipeline_default_key(App *app, DepthMode depth_mode);
+VkPipeline pipeline_get(App *app, const PipelineKey *key);
+uint32_t pipeline_sort_id(const PipelineKey *key);
+VkPipeline pipeline_compile_now(App *app, const PipelineKey *key);
+void pipeline_cache_update(App *app);
+void precompile_pipelines(App *app, const char *path);
+void *pipeline_compile_worker(void *arg);
+
+/* Particles */
+void create_particle_system(App *app);
+void create_particle_pipelines(App *app);
+void destroy_particle_system(App *app);
+PipelineKey particle_pipeline_key(void);
+void update_particles(App *app);
+void record_particle_simulation(App *app, VkCommandBuffer commandBuffer);
+void record_particle_draw(App *app, VkCommandBuffer commandBuffer, uint32_t slot);
+
+/* Meshes */
+void load_mesh(App *app, const char *path);
+void destroy_mesh(App *app);
+PipelineKey mesh_pipeline_key(App *app);
+float mesh_instance_transform(App *app, uint32_t instance, MeshTransform *transform);
+uint32_t select_mesh_lods(App *app, const uint8_t *current, const float *pixel_scale, float threshold, uint8_t *lods);
+void record_mesh_draw(App *app, VkCommandBuffer commandBuffer, VkExtent2D extent, uint32_t slot);
+
+/* Draw lists */
+void create_draw_batcher(App *app);
+void destroy_draw_batcher(App *app);
+void task_pool_init(TaskPool *pool);
+void task_pool_destroy(TaskPool *pool);
+void task_pool_run(TaskPool *pool, TaskFunction function, void *user, uint32_t count);
+void *task_worker(void *arg);
+uint64_t draw_sort_key(DrawPass pass, uint32_t pipeline_id, uint32_t material_id, float depth, bool back_to_front);
+void draw_list_begin(App *app, DrawList *list, uint32_t capacity);
+void draw_list_add(DrawList *list, const DrawItem *item);
+void radix_sort_draws(App *app, DrawSortEntry *entries, uint32_t count);
+void check_draw_sort(App *app);
+void draw_list_record(App *app, const DrawList *list, VkCommandBuffer commandBuffer, uint32_t slot);
+
+/* Memory budget */
+void create_memory_budget(App *app);
+void sample_memory_budget(App *app);
+void update_memory_budget(App *app);
+bool memory_under_pressure(App *app);
+
+/* Readback */
+void create_readback(App *app);
+void create_yuv_converter(App *app);
+void destroy_readback(App *app);
+void readback_set_callback(App *app, ReadbackCallback callback, void *user);
+void readback_begin_frame(App *app);
+void readback_collect(App *app);
+void record_readback(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex);
+void record_yuv_conversion(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                           const VkBufferImageCopy *region, const VkImageMemoryBarrier *to_present);
+VkCommandBuffer record_readback_commands(App *app, uint32_t imageIndex);
+void *readback_writer(void *arg);
+void write_capture_file(void *user, const ReadbackFrame *frame);
+void write_ppm(FILE *file, const ReadbackFrame *frame);
+void write_png(FILE *file, const ReadbackFrame *frame);
+void write_raw(FILE *file, const ReadbackFrame *frame);
+void write_y4m_header(FILE *file, const ReadbackFrame *frame);
+void write_y4m(FILE *file, const ReadbackFrame *frame);
+
+/* Outputs */
+void create_outputs(App *app);
+void destroy_outputs(App *app);
+uint32_t output_slot(App *app, uint32_t output, uint32_t image);
+uint32_t slot_output(App *app, uint32_t slot);
+VkCommandBuffer get_output_command_buffer(App *app, uint32_t output);
+void record_output_commands(App *app, uint32_t output, VkCommandBuffer commandBuffer);
+bool windows_should_close(App *app);
 
 /* Draw functions */
 void draw_frame(App *app);
 
+/* Render on demand */
+void request_redraw(App *app);
+void begin_animation(App *app);
+void end_animation(App *app);
+void install_input_callbacks(App *app);
+void on_key(GLFWwindow *window, int key, int scancode, int action, int mods);
+void on_cursor_pos(GLFWwindow *window, double x, double y);
+void on_mouse_button(GLFWwindow *window, int button, int action, int mods);
+void on_scroll(GLFWwindow *window, double x, double y);
+void on_window_refresh(GLFWwindow *window);
+void on_window_focus(GLFWwindow *window, int focused);
+
 
 /* main and closing functions */
 void main_loop(App *app);
 void clean_up(App *app);
-void read_file(const char* filename, ShaderFile *shaderfile);
+void read_file(const char* filename, ShaderFile *shaderfile, Arena *arena);
+void parse_args(App *app, int argc, char **argv);
 
 // Definitions
-void read_file(const char* filename, ShaderFile *shaderfile)
+void read_file(const char* filename, ShaderFile *shaderfile, Arena *arena)
 {
     FILE *file;
 
@@ -132,39 +1036,307 @@ void read_file(const char* filename, ShaderFile *shaderfile)
     fseek(file, 0L, SEEK_SET);
     printf("%s size = %ld\n", filename, size);
     //char *buff[4096];
-    shaderfile->content = (char*)malloc(sizeof(char) * shaderfile->file_size);
+    shaderfile->content = (char*)arena_alloc(arena, sizeof(char) * shaderfile->file_size);
     fread(shaderfile->content, size, sizeof(char), file);
     fclose(file);
 
     //return *buff;
 }
 
+void parse_args(App *app, int argc, char **argv)
+{
+    app->config.capture_frame = -1;
+    app->config.target_ms = 16.0;
+    app->config.heartbeat_ms = 1000.0;
+    app->config.texture_budget_mb = 256;
+    app->config.memory_pressure = 90;
+    app->config.mesh_grid = 1;
+    app->config.lod_pixels = 1.0f;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            app->config.capture_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture-stream") == 0 && i + 1 < argc)
+        {
+            app->config.capture_stream = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc)
+        {
+            const char *format = argv[++i];
+
+            if (strcmp(format, "ppm") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_PPM;
+            else if (strcmp(format, "png") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_PNG;
+            else if (strcmp(format, "raw") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_RAW;
+            else if (strcmp(format, "y4m") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_Y4M;
+            else if (strcmp(format, "nv12") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_NV12;
+            else if (strcmp(format, "i420") == 0)
+                app->config.capture_format = CAPTURE_FORMAT_I420;
+            else
+            {
+                printf("Unknown capture format: %s\n", format);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--capture-frame") == 0 && i + 1 < argc)
+        {
+            app->config.capture_frame = strtoll(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+        {
+            app->config.headless = true;
+
+            if (sscanf(argv[++i], "%ux%u", &app->config.width, &app->config.height) != 2 ||
+                app->config.width == 0 || app->config.height == 0)
+            {
+                printf("Invalid headless size: %s\n", argv[i]);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            uint32_t index = 0;
+
+            while (index < scene_count && strcmp(scenes[index].name, name) != 0)
+                index++;
+
+            if (index == scene_count)
+            {
+                printf("Unknown scene: %s\n", name);
+                exit(21);
+            }
+            app->config.scene = index;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            app->config.frame_limit = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc)
+        {
+            app->config.msaa_samples = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+        {
+            app->config.depth_prepass = true;
+        }
+        else if (strcmp(argv[i], "--dynres") == 0 && i + 1 < argc)
+        {
+            app->config.dynamic_resolution = true;
+
+            if (sscanf(argv[++i], "%f,%f", &app->config.dynres_min_scale, &app->config.dynres_max_scale) != 2 ||
+                app->config.dynres_min_scale <= 0.0f || app->config.dynres_min_scale > app->config.dynres_max_scale)
+            {
+                printf("Invalid dynamic resolution bounds: %s\n", argv[i]);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc)
+        {
+            app->config.target_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--on-demand") == 0)
+        {
+            app->config.on_demand = true;
+        }
+        else if (strcmp(argv[i], "--heartbeat-ms") == 0 && i + 1 < argc)
+        {
+            app->config.heartbeat_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc)
+        {
+            if (app->config.texture_path_count == TEXTURE_MAX_COUNT - 1)
+            {
+                printf("At most %u textures\n", TEXTURE_MAX_COUNT - 1);
+                exit(21);
+            }
+            app->config.texture_paths[app->config.texture_path_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--texture-cycle") == 0 && i + 1 < argc)
+        {
+            app->config.texture_cycle = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--texture-size") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%ux%u", &app->config.texture_width, &app->config.texture_height) != 2)
+            {
+                printf("Invalid texture size: %s\n", argv[i]);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--texture-budget-mb") == 0 && i + 1 < argc)
+        {
+            app->config.texture_budget_mb = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--memory-pressure") == 0 && i + 1 < argc)
+        {
+            app->config.memory_pressure = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--query-stats") == 0)
+        {
+            app->config.query_stats = true;
+        }
+        else if (strcmp(argv[i], "--query-json") == 0 && i + 1 < argc)
+        {
+            app->config.query_stats = true;
+            app->config.query_json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--shading") == 0 && i + 1 < argc)
+        {
+            app->config.shading = (uint32_t)strtoul(argv[++i], NULL, 10);
+
+            if (app->config.shading >= SHADING_MODE_COUNT)
+            {
+                printf("Invalid shading mode: %s\n", argv[i]);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--pipeline-cache") == 0 && i + 1 < argc)
+        {
+            app->config.pipeline_cache_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pipeline-list") == 0 && i + 1 < argc)
+        {
+            app->config.pipeline_list = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sort-check") == 0)
+        {
+            app->config.sort_check = true;
+        }
+        else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc)
+        {
+            app->config.particle_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc)
+        {
+            app->config.mesh_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--mesh-grid") == 0 && i + 1 < argc)
+        {
+            app->config.mesh_grid = (uint32_t)strtoul(argv[++i], NULL, 10);
+
+            if (app->config.mesh_grid == 0 || app->config.mesh_grid > MESH_GRID_MAX)
+            {
+                printf("--mesh-grid takes 1 to %u\n", MESH_GRID_MAX);
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--lod-pixels") == 0 && i + 1 < argc)
+        {
+            app->config.lod_pixels = strtof(argv[++i], NULL);
+
+            if (!(app->config.lod_pixels > 0.0f))
+            {
+                printf("--lod-pixels has to be positive\n");
+                exit(21);
+            }
+        }
+        else if (strcmp(argv[i], "--triangle-budget") == 0 && i + 1 < argc)
+        {
+            app->config.triangle_budget = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            uint32_t index = 0;
+
+            while (index < scene_count && strcmp(scenes[index].name, name) != 0)
+                index++;
+
+            if (index == scene_count || app->config.output_count == MAX_OUTPUTS)
+            {
+                printf("Unknown scene or more than %u extra windows: %s\n", MAX_OUTPUTS, name);
+                exit(21);
+            }
+            app->config.output_scenes[app->config.output_count++] = index;
+        }
+        else
+        {
+            printf("Usage: %s [--capture PREFIX] [--capture-stream FILE] [--capture-frame N]\n"
+                   "          [--capture-format ppm|png|raw|y4m|nv12|i420]\n"
+                   "          [--headless WxH] [--scene NAME] [--frames N] [--msaa 1|2|4|8]\n"
+                   "          [--depth-prepass] [--dynres MIN,MAX] [--target-ms MS]\n"
+                   "          [--on-demand] [--heartbeat-ms MS]\n"
+                   "          [--texture FILE]... [--texture-cycle N] [--texture-size WxH] [--texture-budget-mb N]\n"
+                   "          [--memory-pressure PERCENT] [--query-stats] [--query-json FILE]\n"
+                   "          [--shading 0|1|2] [--pipeline-cache FILE] [--pipeline-list FILE]\n"
+                   "          [--particles N] [--mesh FILE] [--mesh-grid N] [--lod-pixels PX]\n"
+                   "          [--triangle-budget N] [--window SCENE]... [--sort-check]\n", argv[0]);
+            exit(21);
+        }
+    }
+
+    // Extra windows share the main output's render targets, an offscreen target isn't presentable
+    if (app->config.output_count > 0 && (app->config.headless || app->config.dynamic_resolution))
+    {
+        printf("--window can't be combined with --headless or --dynres\n");
+        exit(21);
+    }
+}
+
 
 void init_window(App *app)
 {
+    if (app->config.headless)
+    {
+        return;
+    }
+
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
     app->window = glfwCreateWindow(800, 600, "test", NULL, NULL);
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        char title[64];
+        snprintf(title, sizeof(title), "test (%s)", scenes[app->config.output_scenes[i]].name);
+        app->outputs[i].window = glfwCreateWindow(800, 600, title, NULL, NULL);
+        app->outputs[i].scene = app->config.output_scenes[i];
+    }
+
+    install_input_callbacks(app);
 }
 
 void create_surface(App *app)
 {
-    if (glfwCreateWindowSurface(app->instance, app->window, NULL, &app->surface) != VK_SUCCESS)
+    if (app->config.headless)
+    {
+        return;
+    }
+
+    if (glfwCreateWindowSurface(app->instance, app->window, &app->host_memory.callbacks, &app->surface) != VK_SUCCESS)
     {
         printf("Failed to create window surface!\n");
         exit(6);
     }
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        if (glfwCreateWindowSurface(app->instance, app->outputs[i].window, &app->host_memory.callbacks, &app->outputs[i].surface) != VK_SUCCESS)
+        {
+            printf("Failed to create window surface!\n");
+            exit(6);
+        }
+    }
 }
 
-bool check_validation_layer_support()
+bool check_validation_layer_support(Arena *scratch)
 {
+    size_t scratch_mark = scratch->used;
     uint32_t layer_count;
     vkEnumerateInstanceLayerProperties(&layer_count, NULL);
 
-    VkLayerProperties available_layers[layer_count];
+    VkLayerProperties *available_layers = (VkLayerProperties*)arena_alloc(scratch, sizeof(VkLayerProperties) * layer_count);
     vkEnumerateInstanceLayerProperties(&layer_count, available_layers);
 
     uint32_t found_layers = 0;
@@ -183,15 +1355,17 @@ bool check_validation_layer_support()
 
         if (!layer_found)
         {
+            arena_release(scratch, scratch_mark);
             return false;
         }
     }
+    arena_release(scratch, scratch_mark);
     return true;
 }
 
 void create_vulkan_instance(App *app)
 {
-    if (enable_validation_layers && !check_validation_layer_support())
+    if (enable_validation_layers && !check_validation_layer_support(&app->frame_arena))
     {
         printf("Validation layers requested, but not available.\n");
         exit(1);
@@ -206,15 +1380,47 @@ void create_vulkan_instance(App *app)
         .apiVersion = VK_API_VERSION_1_0
     };
 
+    size_t scratch_mark = app->frame_arena.used;
+    uint32_t extensionCount = 0;
+    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, NULL);
+
+    VkExtensionProperties *extensions = (VkExtensionProperties*)arena_alloc(&app->frame_arena, sizeof(VkExtensionProperties) * extensionCount);
+    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, extensions);
+
+    printf("Extensions found: %d\n", extensionCount);
+
+    for (int i = 0; i < extensionCount; i++)
+    {
+        printf("Extension: %s\n", extensions[i].extensionName);
+    }
+
     uint32_t glfwExtensionCount = 0;
-    const char **glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    const char **glfwExtensions = NULL;
+
+    if (!app->config.headless)
+    {
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    }
+
+    // What GLFW needs, plus what VK_EXT_memory_budget needs on a 1.0 instance
+    const char **enabledExtensions = (const char**)arena_alloc(&app->frame_arena, sizeof(const char*) * (glfwExtensionCount + 1));
+    uint32_t enabledExtensionCount = glfwExtensionCount;
+    if (glfwExtensionCount > 0)
+    {
+        memcpy(enabledExtensions, glfwExtensions, sizeof(const char*) * glfwExtensionCount);
+    }
+
+    app->memory_budget.instance_support = has_extension(extensions, extensionCount, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    if (app->memory_budget.instance_support)
+    {
+        enabledExtensions[enabledExtensionCount++] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+    }
 
     VkInstanceCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
         .pApplicationInfo = &appInfo,
-        .enabledExtensionCount = glfwExtensionCount,
-        .ppEnabledExtensionNames = glfwExtensions,
+        .enabledExtensionCount = enabledExtensionCount,
+        .ppEnabledExtensionNames = enabledExtensions,
     };
 
     if(enable_validation_layers)
@@ -225,7 +1431,7 @@ void create_vulkan_instance(App *app)
     else
         createInfo.enabledLayerCount = 0;
 
-    VkResult result = vkCreateInstance(&createInfo, NULL, &app->instance);
+    VkResult result = vkCreateInstance(&createInfo, &app->host_memory.callbacks, &app->instance);
 
     if (result != VK_SUCCESS)
     {
@@ -233,18 +1439,20 @@ void create_vulkan_instance(App *app)
         exit(2);
     }
 
-    uint32_t extensionCount = 0;
-    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, NULL);
-
-    VkExtensionProperties extensions[extensionCount];
-    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, extensions);
-
-    printf("Extensions found: %d\n", extensionCount);
+    arena_release(&app->frame_arena, scratch_mark);
+}
 
-    for (int i = 0; i < extensionCount; i++)
+bool has_extension(const VkExtensionProperties *extensions, uint32_t count, const char *name)
+{
+    for (uint32_t i = 0; i < count; i++)
     {
-        printf("Extension: %s\n", extensions[i].extensionName);
+        if (strcmp(extensions[i].extensionName, name) == 0)
+        {
+            return true;
+        }
     }
+
+    return false;
 }
 
 uint32_t clamp_u32(uint32_t n, uint32_t min, uint32_t max)
@@ -284,12 +1492,14 @@ void pick_physical_device(App *app)
         exit(3);
     }
 
-    VkPhysicalDevice devices[device_count];
+    // Only the first MAX_PHYSICAL_DEVICES are considered, the call reports VK_INCOMPLETE beyond that
+    VkPhysicalDevice devices[MAX_PHYSICAL_DEVICES];
+    device_count = device_count < MAX_PHYSICAL_DEVICES ? device_count : MAX_PHYSICAL_DEVICES;
     vkEnumeratePhysicalDevices(app->instance, &device_count, devices);
 
     for (int i = 0; i < device_count; i++)
     {
-        if (is_device_suitable(devices[i], app->surface))
+        if (is_device_suitable(devices[i], app->surface, &app->frame_arena))
         {
             app->physical_device = devices[i];
             break;
@@ -311,12 +1521,10 @@ void pick_physical_device(App *app)
 
 QueueFamilyIndices find_queue_families(VkPhysicalDevice device, VkSurfaceKHR surface)
 {
-    QueueFamilyIndices indices;
+    QueueFamilyIndices indices = {0};
 
-    uint32_t queue_family_count = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
-
-    VkQueueFamilyProperties queue_families[queue_family_count];
+    uint32_t queue_family_count = MAX_QUEUE_FAMILIES;
+    VkQueueFamilyProperties queue_families[MAX_QUEUE_FAMILIES];
     vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, queue_families);
 
     VkBool32 has_present_support = false;
@@ -330,7 +1538,12 @@ QueueFamilyIndices find_queue_families(VkPhysicalDevice device, VkSurfaceKHR sur
         }
 
         has_present_support = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &has_present_support);
+
+        // Without a surface nothing is presented, the graphics queue stands in
+        if (surface == VK_NULL_HANDLE)
+            has_present_support = (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        else
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &has_present_support);
 
         if (has_present_support)
         {
@@ -369,7 +1582,8 @@ VkPresentModeKHR choose_swap_present_mode(const VkPresentModeKHR *available_pres
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR surface)
+// The format and present mode lists live in scratch until the caller releases it
+SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR surface, Arena *scratch)
 {
     SwapChainDetails details;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.capabilities);
@@ -377,8 +1591,7 @@ SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR
     uint32_t format_count;
     vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count, NULL);
     details.format_count = format_count;
-    VkSurfaceFormatKHR formats[format_count];
-    details.formats = formats;
+    details.formats = (VkSurfaceFormatKHR*)arena_alloc(scratch, sizeof(VkSurfaceFormatKHR) * format_count);
     if(format_count != 0)
     {
         vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &format_count, details.formats);
@@ -387,8 +1600,7 @@ SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR
     uint32_t present_mode_count;
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &present_mode_count, NULL);
     details.present_count = present_mode_count;
-    VkPresentModeKHR present_modes[present_mode_count];
-    details.present_modes = present_modes;
+    details.present_modes = (VkPresentModeKHR*)arena_alloc(scratch, sizeof(VkPresentModeKHR) * present_mode_count);
     if(present_mode_count != 0)
     {
         vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &present_mode_count, details.present_modes);
@@ -397,16 +1609,24 @@ SwapChainDetails query_swap_chain_support(VkPhysicalDevice device, VkSurfaceKHR
     return details;
 }
 
-bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface)
+bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface, Arena *scratch)
 {
     QueueFamilyIndices indices = find_queue_families(device, surface);
-    SwapChainDetails swap_chain_details = query_swap_chain_support(device, surface);
+
+    if (surface == VK_NULL_HANDLE)
+    {
+        return indices.has_graphics_family;
+    }
+
+    size_t scratch_mark = scratch->used;
+    SwapChainDetails swap_chain_details = query_swap_chain_support(device, surface, scratch);
+    arena_release(scratch, scratch_mark);
 
     bool swap_chain_adequate = swap_chain_details.format_count != 0
                          && swap_chain_details.present_count != 0;
 
     if (indices.has_graphics_family)
-        if (device_has_extension_support(device))
+        if (device_has_extension_support(device, scratch))
             if (swap_chain_adequate)
                 return true;
 
@@ -414,41 +1634,88 @@ bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface)
     return false;
 }
 
-bool device_has_extension_support(VkPhysicalDevice device)
+bool device_has_extension_support(VkPhysicalDevice device, Arena *scratch)
 {
-    uint32_t extension_count;
-    vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, NULL);
+    size_t scratch_mark = scratch->used;
+    uint32_t available_count;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &available_count, NULL);
 
-    VkExtensionProperties available_extensions[extension_count];
-    vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, available_extensions);
+    VkExtensionProperties *available_extensions = (VkExtensionProperties*)arena_alloc(scratch, sizeof(VkExtensionProperties) * available_count);
+    vkEnumerateDeviceExtensionProperties(device, NULL, &available_count, available_extensions);
 
     for(uint32_t i = 0; i < extension_count; i++)
     {
-        for(uint32_t j = 0; j < extension_count; j++)
+        bool found = false;
+
+        for(uint32_t j = 0; j < available_count; j++)
         {
             if(strcmp(device_extensions[i], available_extensions[j].extensionName) == 0)
             {
-                return true;
+                found = true;
+                break;
             }
         }
-    } 
 
-    return false;
+        if (!found)
+        {
+            arena_release(scratch, scratch_mark);
+            return false;
+        }
+    }
+
+    arena_release(scratch, scratch_mark);
+    return true;
 }
 
 void create_swap_chain(App *app)
 {
-    SwapChainDetails swap_chain_support = query_swap_chain_support(app->physical_device, app->surface);
+    app->present_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    if (app->config.headless)
+    {
+        create_headless_targets(app);
+        return;
+    }
+
+    size_t scratch_mark = app->frame_arena.used;
+    SwapChainDetails swap_chain_support = query_swap_chain_support(app->physical_device, app->surface, &app->frame_arena);
 
     VkSurfaceFormatKHR surface_format = choose_swap_surface_format(swap_chain_support.formats, swap_chain_support.format_count);
     VkExtent2D extent = choose_swap_extent(app->window, swap_chain_support.capabilities);
 
-    uint32_t image_count = swap_chain_support.capabilities.minImageCount + 1;
-    uint32_t max_img_count = swap_chain_support.capabilities.maxImageCount;
+    VkImageUsageFlags image_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 
-    if (max_img_count > 0 && image_count > max_img_count)
+    if (app->config.capture_prefix != NULL || app->config.capture_stream != NULL)
     {
-        image_count = max_img_count;
+        if (!(swap_chain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT))
+        {
+            printf("Swap chain images can't be copied from, capture is unavailable.\n");
+            exit(22);
+        }
+        image_usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+
+    if (app->config.dynamic_resolution)
+    {
+        if (!(swap_chain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+        {
+            printf("Swap chain images can't be blitted to, dynamic resolution is unavailable.\n");
+            exit(31);
+        }
+        image_usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    }
+
+    uint32_t image_count = swap_chain_support.capabilities.minImageCount + 1;
+    uint32_t max_img_count = swap_chain_support.capabilities.maxImageCount;
+
+    if (max_img_count > 0 && image_count > max_img_count)
+    {
+        image_count = max_img_count;
+    }
+
+    if (image_count > MAX_SWAP_CHAIN_IMAGES)
+    {
+        image_count = swap_chain_support.capabilities.minImageCount;
     }
 
     VkSwapchainCreateInfoKHR createInfo = {
@@ -459,7 +1726,7 @@ void create_swap_chain(App *app)
         .imageColorSpace = surface_format.colorSpace,
         .imageExtent = extent,
         .imageArrayLayers = 1,
-        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+        .imageUsage = image_usage
     };
 
     QueueFamilyIndices indices = find_queue_families(app->physical_device, app->surface);
@@ -484,26 +1751,31 @@ void create_swap_chain(App *app)
     createInfo.clipped = VK_TRUE;
     createInfo.oldSwapchain = VK_NULL_HANDLE;
 
-    if (vkCreateSwapchainKHR(app->device, &createInfo, NULL, &app->swap_chain) != VK_SUCCESS)
+    if (vkCreateSwapchainKHR(app->device, &createInfo, &app->host_memory.callbacks, &app->swap_chain) != VK_SUCCESS)
     {
         printf("Could not create swap chain...\n");
         exit(7);
     }
 
     vkGetSwapchainImagesKHR(app->device, app->swap_chain, &image_count, NULL);
-    app->swap_chain_images = (VkImage*)malloc(sizeof(VkImage) * image_count);
+
+    if (image_count > MAX_SWAP_CHAIN_IMAGES)
+    {
+        printf("Swap chain has %u images, at most %u are supported.\n", image_count, MAX_SWAP_CHAIN_IMAGES);
+        exit(36);
+    }
 
     vkGetSwapchainImagesKHR(app->device, app->swap_chain, &image_count, app->swap_chain_images);
     app->swap_chain_image_count = image_count;
 
     app->swap_chain_image_format = surface_format.format;
     app->swap_chain_extent = extent;
+
+    arena_release(&app->frame_arena, scratch_mark);
 }
 
 void create_image_views(App *app)
 {
-    app->swap_chain_image_views = (VkImageView*)malloc(sizeof(VkImageView) * app->swap_chain_image_count);
-
     printf("Image count: %d\n", app->swap_chain_image_count);
     for (uint32_t i = 0; i < app->swap_chain_image_count; i++)
     {
@@ -524,7 +1796,7 @@ void create_image_views(App *app)
         };
         printf("Image address: %p\n", app->swap_chain_images[i]);
 
-        if(vkCreateImageView(app->device, &create_info, NULL, &app->swap_chain_image_views[i]) != VK_SUCCESS)
+        if(vkCreateImageView(app->device, &create_info, &app->host_memory.callbacks, &app->swap_chain_image_views[i]) != VK_SUCCESS)
         {
             printf("Failed to create image view...\n");
             exit(8);
@@ -534,32 +1806,112 @@ void create_image_views(App *app)
 
 void create_graphics_pipeline(App *app)
 {
-    // Vertex and fragment creation
+    // Pipeline Layout
+
+    // Set 0 is the scene's texture, set 1 the particle buffers when there are particles
+    VkDescriptorSetLayout set_layouts[2] = { app->textures.set_layout, app->particles.draw_set_layout };
+
+    // Only the mesh shader reads them
+    VkPushConstantRange push_constant_range = {
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        .offset = 0,
+        .size = sizeof(MeshTransform),
+    };
+
+    //VkPipelineLayout pipelineLayout;
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = app->particles.enabled ? 2 : 1,
+        .pSetLayouts = set_layouts,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &push_constant_range,
+    };
+
+    if (vkCreatePipelineLayout(app->device, &pipelineLayoutInfo, &app->host_memory.callbacks, &app->pipeline_layout) != VK_SUCCESS)
+    {
+       printf("failed to create pipeline layout!\n");
+       exit(11);
+    }
+
+    // The permutations the first frame draws with, which double as the fallbacks later on
+    for (uint32_t mode = 0; mode < DEPTH_MODE_COUNT; mode++)
+    {
+        bool used = mode == DEPTH_MODE_LESS ||
+                    (mode == DEPTH_MODE_TEST ? app->particles.enabled : app->config.depth_prepass);
+
+        if (!used)
+        {
+            continue;
+        }
+
+        PipelineKey key = mode == DEPTH_MODE_TEST ? particle_pipeline_key() : pipeline_default_key(app, (DepthMode)mode);
+        app->pipelines.fallback[mode] = pipeline_compile_now(app, &key);
+
+        if (app->pipelines.fallback[mode] == VK_NULL_HANDLE)
+        {
+            printf("failed to create graphics pipeline!\n");
+            exit(13);
+        }
+    }
+
+    // The fallbacks have no vertex input, so the mesh's permutation has to exist before it draws
+    if (app->mesh.loaded)
+    {
+        PipelineKey key = mesh_pipeline_key(app);
+
+        if (pipeline_compile_now(app, &key) == VK_NULL_HANDLE)
+        {
+            printf("failed to create mesh pipeline!\n");
+            exit(13);
+        }
+    }
+
+    if (app->config.pipeline_list != NULL)
+    {
+        precompile_pipelines(app, app->config.pipeline_list);
+    }
+}
+
+// Compiles the permutation key describes, blocking. VK_NULL_HANDLE when the driver fails to.
+VkPipeline create_pipeline_permutation(App *app, const PipelineKey *key)
+{
+    const PipelineCache *pc = &app->pipelines;
+
+    // Fragment shader constant_id i is fed from spec[i]
+    VkSpecializationMapEntry spec_entries[PIPELINE_MAX_SPEC_CONSTANTS];
 
-    ShaderFile vert_file = {0};
-    ShaderFile frag_file = {0};
-    read_file("shaders/vert.spv", &vert_file);
-    read_file("shaders/frag.spv", &frag_file);
+    for (uint32_t i = 0; i < key->spec_count; i++)
+    {
+        spec_entries[i] = (VkSpecializationMapEntry){
+            .constantID = i,
+            .offset = i * sizeof(uint32_t),
+            .size = sizeof(uint32_t),
+        };
+    }
 
-    VkShaderModule vert_module = create_shader_module(app, &vert_file);
-    VkShaderModule frag_module = create_shader_module(app, &frag_file);
+    VkSpecializationInfo spec_info = {
+        .mapEntryCount = key->spec_count,
+        .pMapEntries = spec_entries,
+        .dataSize = key->spec_count * sizeof(uint32_t),
+        .pData = key->spec,
+    };
 
-    VkPipelineShaderStageCreateInfo vert_shader_stage_info = {
+    VkPipelineShaderStageCreateInfo shader_stages[] = {
+        {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
             .stage = VK_SHADER_STAGE_VERTEX_BIT,
-            .module = vert_module,
+            .module = pc->vert_modules[key->shader],
             .pName = "main",
-    };
-
-    VkPipelineShaderStageCreateInfo frag_shader_stage_info = {
+        },
+        {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
             .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-            .module = frag_module,
+            .module = pc->frag_modules[key->shader],
             .pName = "main",
+            .pSpecializationInfo = key->spec_count > 0 ? &spec_info : NULL,
+        },
     };
 
-    VkPipelineShaderStageCreateInfo shader_stages[] = {vert_shader_stage_info, frag_shader_stage_info};
-
     // Dynamic states creation
 
     VkDynamicState dynamic_states[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
@@ -573,12 +1925,28 @@ void create_graphics_pipeline(App *app)
 
     // Vertex input creation
 
+    VkVertexInputBindingDescription mesh_binding = {
+        .binding = 0,
+        .stride = sizeof(MeshVertex),
+        .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    };
+
+    // Quantized position and packed normal, unpacked in mesh.vert
+    VkVertexInputAttributeDescription mesh_attribute = {
+        .location = 0,
+        .binding = 0,
+        .format = VK_FORMAT_R16G16B16A16_UINT,
+        .offset = 0,
+    };
+
+    bool mesh_vertices = pipeline_shaders[key->shader].mesh_vertices;
+
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = 0,
-        .pVertexBindingDescriptions = NULL, // Optional
-        .vertexAttributeDescriptionCount = 0,
-        .pVertexAttributeDescriptions = NULL, // Optional
+        .vertexBindingDescriptionCount = mesh_vertices ? 1 : 0,
+        .pVertexBindingDescriptions = &mesh_binding,
+        .vertexAttributeDescriptionCount = mesh_vertices ? 1 : 0,
+        .pVertexAttributeDescriptions = &mesh_attribute,
     };
 
     // Input assembly
@@ -591,20 +1959,6 @@ void create_graphics_pipeline(App *app)
 
     // Viewports and scissors
 
-    VkViewport viewport = {
-        .x = 0.0f,
-        .y = 0.0f,
-        .width = (float)app->swap_chain_extent.width,
-        .height = (float)app->swap_chain_extent.height,
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f,
-    };
-
-    VkRect2D scissor = {
-        .offset = {0, 0},
-        .extent = app->swap_chain_extent,
-    };
-
     VkPipelineViewportStateCreateInfo viewportState = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
         .viewportCount = 1,
@@ -619,8 +1973,8 @@ void create_graphics_pipeline(App *app)
         .rasterizerDiscardEnable = VK_FALSE,
         .polygonMode = VK_POLYGON_MODE_FILL,
         .lineWidth = 1.0f,
-        .cullMode = VK_CULL_MODE_BACK_BIT,
-        .frontFace = VK_FRONT_FACE_CLOCKWISE,
+        .cullMode = key->cull_mode,
+        .frontFace = (VkFrontFace)key->front_face,
         .depthBiasEnable = VK_FALSE,
         .depthBiasConstantFactor = 0.0f, // Optional
         .depthBiasClamp = 0.0f, // Optional
@@ -630,13 +1984,30 @@ void create_graphics_pipeline(App *app)
     VkPipelineMultisampleStateCreateInfo multisampling = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
         .sampleShadingEnable = VK_FALSE,
-        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+        .rasterizationSamples = app->msaa_samples,
         .minSampleShading = 1.0f, // Optional
         .pSampleMask = NULL, // Optional
         .alphaToCoverageEnable = VK_FALSE, // Optional
         .alphaToOneEnable = VK_FALSE, // Optional
     };
 
+    // Depth testing
+    //
+    // The pre-pass writes depth only and has no fragment shader. The equal
+    // variant then shades exactly one fragment per sample, the visible one,
+    // and never writes depth, so early-Z rejects everything that is hidden.
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = key->depth_mode == DEPTH_MODE_LESS || key->depth_mode == DEPTH_MODE_PREPASS,
+        .depthCompareOp = key->depth_mode == DEPTH_MODE_EQUAL ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS,
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable = VK_FALSE,
+        .minDepthBounds = 0.0f, // Optional
+        .maxDepthBounds = 1.0f, // Optional
+    };
+
     // Color blending
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment = {
@@ -648,15 +2019,27 @@ void create_graphics_pipeline(App *app)
         .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE, // Optional
         .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO, // Optional
         .alphaBlendOp = VK_BLEND_OP_ADD, // Optional
-        .blendEnable = VK_TRUE,
-        .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-        .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-        .colorBlendOp = VK_BLEND_OP_ADD,
-        .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
-        .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
-        .alphaBlendOp = VK_BLEND_OP_ADD,
     };
 
+    if (key->blend_mode == BLEND_MODE_ALPHA)
+    {
+        colorBlendAttachment.blendEnable = VK_TRUE;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    }
+    else if (key->blend_mode == BLEND_MODE_ADDITIVE)
+    {
+        colorBlendAttachment.blendEnable = VK_TRUE;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    }
+
+    if (key->depth_mode == DEPTH_MODE_PREPASS)
+    {
+        colorBlendAttachment.colorWriteMask = 0;
+        colorBlendAttachment.blendEnable = VK_FALSE;
+    }
+
     VkPipelineColorBlendStateCreateInfo colorBlending = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
         .logicOpEnable = VK_FALSE,
@@ -669,33 +2052,16 @@ void create_graphics_pipeline(App *app)
         .blendConstants[3] = 0.0f, // Optional
     };
 
-    // Pipeline Layout
-
-    //VkPipelineLayout pipelineLayout;
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = 0, // Optional
-        .pSetLayouts = NULL, // Optional
-        .pushConstantRangeCount = 0, // Optional
-        .pPushConstantRanges = NULL, // Optional
-    };
-
-    if (vkCreatePipelineLayout(app->device, &pipelineLayoutInfo, NULL, &app->pipeline_layout) != VK_SUCCESS)
-    {
-       printf("failed to create pipeline layout!\n");
-       exit(11);
-    }
-
     VkGraphicsPipelineCreateInfo pipelineInfo = {
         .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .stageCount = 2,
+        .stageCount = key->depth_mode == DEPTH_MODE_PREPASS ? 1 : 2,
         .pStages = shader_stages,
         .pVertexInputState = &vertexInputInfo,
         .pInputAssemblyState = &inputAssembly,
         .pViewportState = &viewportState,
         .pRasterizationState = &rasterizer,
         .pMultisampleState = &multisampling,
-        .pDepthStencilState = NULL, // Optional
+        .pDepthStencilState = &depthStencil,
         .pColorBlendState = &colorBlending,
         .pDynamicState = &dynamic_state,
         .layout = app->pipeline_layout,
@@ -705,14 +2071,15 @@ void create_graphics_pipeline(App *app)
         .basePipelineIndex = -1, // Optional
     };
 
-    if (vkCreateGraphicsPipelines(app->device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &app->graphics_pipeline) != VK_SUCCESS)
+    VkPipeline pipeline;
+
+    // The driver synchronizes access to the pipeline cache itself
+    if (vkCreateGraphicsPipelines(app->device, pc->cache, 1, &pipelineInfo, &app->host_memory.callbacks, &pipeline) != VK_SUCCESS)
     {
-        printf("failed to create graphics pipeline!\n");
-        exit(13);
+        return VK_NULL_HANDLE;
     }
 
-    vkDestroyShaderModule(app->device, vert_module, NULL);
-    vkDestroyShaderModule(app->device, frag_module, NULL);
+    return pipeline;
 }
 
 VkShaderModule create_shader_module(App *app, ShaderFile *shaderfile)
@@ -727,7 +2094,7 @@ VkShaderModule create_shader_module(App *app, ShaderFile *shaderfile)
 
     VkShaderModule shader_module;
 
-    if(vkCreateShaderModule(app->device, &create_info, NULL, &shader_module) != VK_SUCCESS)
+    if(vkCreateShaderModule(app->device, &create_info, &app->host_memory.callbacks, &shader_module) != VK_SUCCESS)
     {
         printf("Failed to create shader module.\n");
         exit(10);
@@ -750,15 +2117,66 @@ void create_logical_device(App *app)
     float queue_priority = 1.0f;
     queue_create_info.pQueuePriorities = &queue_priority;
 
-    VkPhysicalDeviceFeatures device_features = {0};
+    VkPhysicalDeviceFeatures supported_features;
+    vkGetPhysicalDeviceFeatures(app->physical_device, &supported_features);
+
+    // Block compressed textures upload as they are stored instead of being decoded on the CPU
+    VkPhysicalDeviceFeatures device_features = {
+        .textureCompressionBC = supported_features.textureCompressionBC,
+    };
+    app->textures.compression_bc = supported_features.textureCompressionBC == VK_TRUE;
+
+    // Runs of draws that share state but aren't one instanced draw go out as one multi-draw
+    device_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+    device_features.drawIndirectFirstInstance = supported_features.drawIndirectFirstInstance;
+    app->batcher.multi_draw = supported_features.multiDrawIndirect == VK_TRUE &&
+                              supported_features.drawIndirectFirstInstance == VK_TRUE;
+
+    if (app->config.query_stats)
+    {
+        device_features.pipelineStatisticsQuery = supported_features.pipelineStatisticsQuery;
+        device_features.occlusionQueryPrecise = supported_features.occlusionQueryPrecise;
+        app->query_stats.enabled = supported_features.pipelineStatisticsQuery == VK_TRUE;
+        app->query_stats.precise = supported_features.occlusionQueryPrecise == VK_TRUE;
+
+        if (!app->query_stats.enabled)
+        {
+            printf("Device has no pipeline statistics queries, query stats disabled.\n");
+        }
+    }
+
+    size_t scratch_mark = app->frame_arena.used;
+    uint32_t available_count = 0;
+    vkEnumerateDeviceExtensionProperties(app->physical_device, NULL, &available_count, NULL);
+
+    VkExtensionProperties *available_extensions = (VkExtensionProperties*)arena_alloc(&app->frame_arena, sizeof(VkExtensionProperties) * available_count);
+    vkEnumerateDeviceExtensionProperties(app->physical_device, NULL, &available_count, available_extensions);
+
+    // Swap chain unless headless, memory budget whenever the driver has it
+    const char *enabled_extensions[2];
+    uint32_t enabled_extension_count = 0;
+
+    if (!app->config.headless)
+    {
+        enabled_extensions[enabled_extension_count++] = device_extensions[0];
+    }
+
+    app->memory_budget.supported = app->memory_budget.instance_support &&
+        has_extension(available_extensions, available_count, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    if (app->memory_budget.supported)
+    {
+        enabled_extensions[enabled_extension_count++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+    }
+
+    arena_release(&app->frame_arena, scratch_mark);
 
     VkDeviceCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pQueueCreateInfos = &queue_create_info,
         .queueCreateInfoCount = 1,
         .pEnabledFeatures = &device_features,
-        .enabledExtensionCount = extension_count,
-        .ppEnabledExtensionNames = device_extensions
+        .enabledExtensionCount = enabled_extension_count,
+        .ppEnabledExtensionNames = enabled_extensions
     };
 
     if (enable_validation_layers)
@@ -771,7 +2189,7 @@ void create_logical_device(App *app)
         create_info.enabledLayerCount = 0;
     }
 
-    if (vkCreateDevice(app->physical_device, &create_info, NULL, &app->device) != VK_SUCCESS)
+    if (vkCreateDevice(app->physical_device, &create_info, &app->host_memory.callbacks, &app->device) != VK_SUCCESS)
     {
         printf("Failed to create logical device!\n");
         exit(5);
@@ -783,13 +2201,24 @@ void create_logical_device(App *app)
 
 void create_render_pass(App *app)
 {
-    VkAttachmentDescription colorAttachment = {
+    bool multisampled = app->msaa_samples != VK_SAMPLE_COUNT_1_BIT;
+
+    // With dynamic resolution the pass renders offscreen and is blitted to the output afterwards
+    VkImageLayout output_layout = app->dynres.enabled ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : app->present_layout;
+
+    VkAttachmentDescription attachments[3];
+    uint32_t attachment_count = 0;
+
+    // With MSAA the multisampled image never leaves tile memory, only the resolve is stored
+    attachments[attachment_count++] = (VkAttachmentDescription){
         .format = app->swap_chain_image_format,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .samples = app->msaa_samples,
         .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE,
         .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
         .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = multisampled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : output_layout,
     };
 
     VkAttachmentReference colorAttachmentRef ={
@@ -797,16 +2226,54 @@ void create_render_pass(App *app)
         .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
     };
 
+    VkAttachmentReference resolveAttachmentRef = {
+        .attachment = attachment_count,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+
+    if (multisampled)
+    {
+        attachments[attachment_count++] = (VkAttachmentDescription){
+            .format = app->swap_chain_image_format,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = output_layout,
+        };
+    }
+
+    // Depth is only needed within the pass, nothing is stored
+    VkAttachmentReference depthAttachmentRef = {
+        .attachment = attachment_count,
+        .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
+    attachments[attachment_count++] = (VkAttachmentDescription){
+        .format = app->depth_format,
+        .samples = app->msaa_samples,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
     VkSubpassDescription subpass = {
         .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
         .colorAttachmentCount = 1,
         .pColorAttachments = &colorAttachmentRef,
+        .pResolveAttachments = multisampled ? &resolveAttachmentRef : NULL,
+        .pDepthStencilAttachment = &depthAttachmentRef,
     };
 
     VkRenderPassCreateInfo renderPassInfo = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = 1,
-        .pAttachments = &colorAttachment,
+        .attachmentCount = attachment_count,
+        .pAttachments = attachments,
         .subpassCount = 1,
         .pSubpasses = &subpass,
     };
@@ -814,15 +2281,15 @@ void create_render_pass(App *app)
     VkSubpassDependency dependency = {};
     dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
     dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
     renderPassInfo.dependencyCount = 1;
     renderPassInfo.pDependencies = &dependency;
 
-    if (vkCreateRenderPass(app->device, &renderPassInfo, NULL, &app->render_pass) != VK_SUCCESS)
+    if (vkCreateRenderPass(app->device, &renderPassInfo, &app->host_memory.callbacks, &app->render_pass) != VK_SUCCESS)
     {
         printf("failed to create render pass!\n");
         exit(12);
@@ -831,24 +2298,29 @@ void create_render_pass(App *app)
 
 void create_framebuffers(App *app)
 {
-    app->swapchain_framebuffers = (VkFramebuffer*)malloc(app->swap_chain_image_count * sizeof(VkFramebuffer));
-
     for(uint32_t i = 0; i < app->swap_chain_image_count; i++)
     {
-        VkImageView attachments[] = {
-            app->swap_chain_image_views[i]
-        };
+        // Same order as the render pass attachments
+        VkImageView attachments[3];
+        uint32_t attachment_count = 0;
+
+        if (app->msaa_samples != VK_SAMPLE_COUNT_1_BIT)
+        {
+            attachments[attachment_count++] = app->color_image_view;
+        }
+        attachments[attachment_count++] = app->dynres.enabled ? app->dynres.view : app->swap_chain_image_views[i];
+        attachments[attachment_count++] = app->depth_image_view;
 
         VkFramebufferCreateInfo framebufferInfo = {};
         framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
         framebufferInfo.renderPass = app->render_pass;
-        framebufferInfo.attachmentCount = 1;
+        framebufferInfo.attachmentCount = attachment_count;
         framebufferInfo.pAttachments = attachments;
-        framebufferInfo.width = app->swap_chain_extent.width;
-        framebufferInfo.height = app->swap_chain_extent.height;
+        framebufferInfo.width = app->target_extent.width;
+        framebufferInfo.height = app->target_extent.height;
         framebufferInfo.layers = 1;
 
-        if (vkCreateFramebuffer(app->device, &framebufferInfo, NULL, &app->swapchain_framebuffers[i]) != VK_SUCCESS) {
+        if (vkCreateFramebuffer(app->device, &framebufferInfo, &app->host_memory.callbacks, &app->swapchain_framebuffers[i]) != VK_SUCCESS) {
             printf("failed to create framebuffer!\n");
             exit(14);
         }
@@ -865,7 +2337,7 @@ void createCommandPool(App *app)
         .queueFamilyIndex = queueFamilyIndices.graphics_family,
     };
 
-    if (vkCreateCommandPool(app->device, &poolInfo, NULL, &app->commandPool) != VK_SUCCESS)
+    if (vkCreateCommandPool(app->device, &poolInfo, &app->host_memory.callbacks, &app->commandPool) != VK_SUCCESS)
     {
         printf("failed to create command pool!\n");
         exit(15);
@@ -874,19 +2346,60 @@ void createCommandPool(App *app)
 
 void create_command_buffer(App *app)
 {
+    CommandCache *cache = &app->command_cache;
+
+    cache->version = 1;
+
     VkCommandBufferAllocateInfo allocInfo = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
         .commandPool = app->commandPool,
         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
+        .commandBufferCount = app->swap_chain_image_count,
     };
 
-    if (vkAllocateCommandBuffers(app->device, &allocInfo, &app->commandBuffer) != VK_SUCCESS) {
+    if (vkAllocateCommandBuffers(app->device, &allocInfo, cache->buffers) != VK_SUCCESS) {
         printf("failed to allocate command buffers!\n");
         exit(16);
     }
 }
 
+// Returns the command buffer for imageIndex, re-recording it only when it is out of date.
+// Safe because the in-flight fence guarantees the previous submission has finished.
+VkCommandBuffer get_command_buffer(App *app, uint32_t imageIndex)
+{
+    CommandCache *cache = &app->command_cache;
+    VkCommandBuffer commandBuffer = cache->buffers[imageIndex];
+
+    if (cache->recorded_version[imageIndex] == cache->version)
+    {
+        cache->hits++;
+        return commandBuffer;
+    }
+
+    vkResetCommandBuffer(commandBuffer, 0);
+    recordCommandBuffer(app, commandBuffer, imageIndex);
+    cache->recorded_version[imageIndex] = cache->version;
+    cache->misses++;
+
+    return commandBuffer;
+}
+
+// Call whenever anything recordCommandBuffer reads changes: scene, pipelines, extents
+void invalidate_command_buffers(App *app)
+{
+    app->command_cache.version++;
+}
+
+void set_scene(App *app, uint32_t scene)
+{
+    if (scene < scene_count && scene != app->config.scene)
+    {
+        app->config.scene = scene;
+        invalidate_command_buffers(app);
+        request_redraw(app);
+    }
+}
+
 void recordCommandBuffer(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
 {
     VkCommandBufferBeginInfo beginInfo = {
@@ -900,27 +2413,56 @@ void recordCommandBuffer(App *app, VkCommandBuffer commandBuffer, uint32_t image
         exit(17);
     }
 
+    profiler_begin(app, commandBuffer, imageIndex);
+    query_stats_reset(app, commandBuffer, imageIndex);
+    record_particle_simulation(app, commandBuffer);
+
+    record_scene_pass(app, commandBuffer, app->swapchain_framebuffers[imageIndex], app->render_extent, app->config.scene, imageIndex);
+
+    record_upscale(app, commandBuffer, imageIndex);
+
+    profiler_end(app, commandBuffer, imageIndex);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    {
+        printf("failed to record command buffer!\n");
+        exit(18);
+    }
+}
+
+// The render pass with scene_index's draws. slot picks the per-recording resources: the main
+// output's swap chain image index, or output_slot for the extra windows.
+void record_scene_pass(App *app, VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, VkExtent2D extent,
+                       uint32_t scene_index, uint32_t slot)
+{
+    const Scene *scene = &scenes[scene_index];
+
     VkRenderPassBeginInfo renderPassInfo = {};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = app->render_pass;
-    renderPassInfo.framebuffer = app->swapchain_framebuffers[imageIndex];
+    renderPassInfo.framebuffer = framebuffer;
     renderPassInfo.renderArea.offset.x = 0;
     renderPassInfo.renderArea.offset.y = 0;
-    renderPassInfo.renderArea.extent = app->swap_chain_extent;
+    renderPassInfo.renderArea.extent = extent;
 
-    VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    renderPassInfo.clearValueCount = 1;
-    renderPassInfo.pClearValues = &clearColor;
+    // Indexed like the attachments, the resolve target's entry is ignored
+    VkClearValue clearValues[3] = {0};
+    uint32_t depth_attachment = app->msaa_samples != VK_SAMPLE_COUNT_1_BIT ? 2 : 1;
 
-    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    memcpy(clearValues[0].color.float32, scene->clear_color, sizeof(scene->clear_color));
+    clearValues[depth_attachment].depthStencil.depth = 1.0f;
+    clearValues[depth_attachment].depthStencil.stencil = 0;
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, app->graphics_pipeline);
+    renderPassInfo.clearValueCount = depth_attachment + 1;
+    renderPassInfo.pClearValues = clearValues;
+
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
     VkViewport viewport = {};
     viewport.x = 0.0f;
     viewport.y = 0.0f;
-    viewport.width = (float)(app->swap_chain_extent.width);
-    viewport.height = (float)(app->swap_chain_extent.height);
+    viewport.width = (float)(extent.width);
+    viewport.height = (float)(extent.height);
     viewport.minDepth = 0.0f;
     viewport.maxDepth = 1.0f;
     vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
@@ -928,148 +2470,5604 @@ void recordCommandBuffer(App *app, VkCommandBuffer commandBuffer, uint32_t image
     VkRect2D scissor = {};
     scissor.offset.x = 0;
     scissor.offset.y = 0;
-    scissor.extent = app->swap_chain_extent;
+    scissor.extent = extent;
     vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-    vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+    // One draw per instance, the list folds them back into as few draws as the state allows
+    DrawList list;
+    draw_list_begin(app, &list, scene->instance_count * DRAW_PASS_COUNT);
 
-    vkCmdEndRenderPass(commandBuffer);
+    uint32_t material_id = app->textures.bound;
 
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    for (uint32_t instance = 0; instance < scene->instance_count; instance++)
     {
-        printf("failed to record command buffer!\n");
-        exit(18);
+        // Matches shader.vert, instances are laid out front to back
+        float depth = instance * 0.05f;
+        uint32_t shading = (app->config.shading + instance % scene->material_count) % SHADING_MODE_COUNT;
+        DrawItem item = {
+            .material = app->textures.descriptor_set,
+            .vertex_count = 3,
+            .instance_count = 1,
+            .first_instance = instance,
+        };
+
+        if (app->config.depth_prepass)
+        {
+            // Lay down depth first, then shade only the surviving fragments
+            PipelineKey prepass_key = pipeline_default_key(app, DEPTH_MODE_PREPASS);
+            item.key = draw_sort_key(DRAW_PASS_DEPTH_PREPASS, pipeline_sort_id(&prepass_key), material_id, depth, false);
+            item.pipeline = pipeline_get(app, &prepass_key);
+            draw_list_add(&list, &item);
+        }
+
+        PipelineKey key = pipeline_default_key(app, app->config.depth_prepass ? DEPTH_MODE_EQUAL : DEPTH_MODE_LESS);
+        key.spec[0] = shading;
+        item.key = draw_sort_key(DRAW_PASS_MAIN, pipeline_sort_id(&key), material_id, depth, false);
+        item.pipeline = pipeline_get(app, &key);
+        draw_list_add(&list, &item);
     }
-}
 
-void create_sync_objects(App *app)
-{
-    VkSemaphoreCreateInfo semaphoreInfo = {};
-    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    draw_list_record(app, &list, commandBuffer, slot);
 
-    VkFenceCreateInfo fenceInfo = {};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    record_mesh_draw(app, commandBuffer, extent, slot);
+    record_particle_draw(app, commandBuffer, slot);
 
-    if (vkCreateSemaphore(app->device, &semaphoreInfo, NULL, &app->imageAvailableSemaphore) != VK_SUCCESS ||
-    vkCreateSemaphore(app->device, &semaphoreInfo, NULL, &app->renderFinishedSemaphore) != VK_SUCCESS ||
-    vkCreateFence(app->device, &fenceInfo, NULL, &app->inFlightFence) != VK_SUCCESS)
-    {
-        printf("failed to create semaphores!\n");
-        exit(19);
-    }
+    vkCmdEndRenderPass(commandBuffer);
 }
 
-void init_vulkan(App *app)
+// Swap chains, framebuffers and command buffers of the extra windows. They reuse the main
+// output's render pass, multisampled color and depth images, so their surfaces have to offer
+// the same format and be no larger.
+void create_outputs(App *app)
 {
-    create_vulkan_instance(app);
-    create_surface(app);
-    pick_physical_device(app);
-    is_device_suitable(app->physical_device, app->surface);
-    create_logical_device(app);
-    create_swap_chain(app);
-    create_image_views(app);
-    create_render_pass(app);
-    create_graphics_pipeline(app);
-    create_framebuffers(app);
-    createCommandPool(app);
-    create_command_buffer(app);
-    create_sync_objects(app);
-}
+    QueueFamilyIndices indices = find_queue_families(app->physical_device, app->surface);
+    uint32_t queue_family_indices[] = {indices.graphics_family, indices.present_family};
 
-void draw_frame(App *app)
-{
-    vkWaitForFences(app->device, 1, &app->inFlightFence, VK_TRUE, UINT64_MAX);
-    vkResetFences(app->device, 1, &app->inFlightFence);
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        Output *output = &app->outputs[i];
+        VkBool32 present_support = VK_FALSE;
+        vkGetPhysicalDeviceSurfaceSupportKHR(app->physical_device, indices.present_family, output->surface, &present_support);
 
-    uint32_t imageIndex;
-    vkAcquireNextImageKHR(app->device, app->swap_chain, UINT64_MAX, app->imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+        if (!present_support)
+        {
+            printf("Window %u can't be presented from the main window's queue!\n", i + 1);
+            exit(41);
+        }
 
-    vkResetCommandBuffer(app->commandBuffer, 0);
-    recordCommandBuffer(app, app->commandBuffer, imageIndex);
+        size_t scratch_mark = app->frame_arena.used;
+        SwapChainDetails support = query_swap_chain_support(app->physical_device, output->surface, &app->frame_arena);
+        VkSurfaceFormatKHR surface_format = choose_swap_surface_format(support.formats, support.format_count);
+        output->extent = choose_swap_extent(output->window, support.capabilities);
+        arena_release(&app->frame_arena, scratch_mark);
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        if (surface_format.format != app->swap_chain_image_format ||
+            output->extent.width > app->target_extent.width || output->extent.height > app->target_extent.height)
+        {
+            printf("Window %u needs another format or a larger size than the main window!\n", i + 1);
+            exit(41);
+        }
 
-    VkSemaphore waitSemaphores[] = {app->imageAvailableSemaphore};
-    VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &app->commandBuffer;
+        uint32_t image_count = support.capabilities.minImageCount + 1;
 
-    VkSemaphore signalSemaphores[] = {app->renderFinishedSemaphore};
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = signalSemaphores;
+        if (support.capabilities.maxImageCount > 0 && image_count > support.capabilities.maxImageCount)
+        {
+            image_count = support.capabilities.maxImageCount;
+        }
 
-    if (vkQueueSubmit(app->graphics_queue, 1, &submitInfo, app->inFlightFence) != VK_SUCCESS)
-    {
-        printf("failed to submit draw command buffer!\n");
-        exit(20);
-    }
+        // FIFO is the one mode every surface supports, the windows present together anyway
+        VkSwapchainCreateInfoKHR create_info = {
+            .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+            .surface = output->surface,
+            .minImageCount = image_count,
+            .imageFormat = surface_format.format,
+            .imageColorSpace = surface_format.colorSpace,
+            .imageExtent = output->extent,
+            .imageArrayLayers = 1,
+            .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            .imageSharingMode = indices.graphics_family != indices.present_family ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = indices.graphics_family != indices.present_family ? 2 : 0,
+            .pQueueFamilyIndices = queue_family_indices,
+            .preTransform = support.capabilities.currentTransform,
+            .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+            .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+            .clipped = VK_TRUE,
+            .oldSwapchain = VK_NULL_HANDLE,
+        };
 
-    VkPresentInfoKHR presentInfo = {};
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        if (vkCreateSwapchainKHR(app->device, &create_info, &app->host_memory.callbacks, &output->swap_chain) != VK_SUCCESS)
+        {
+            printf("Could not create swap chain...\n");
+            exit(7);
+        }
 
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = signalSemaphores;
+        vkGetSwapchainImagesKHR(app->device, output->swap_chain, &image_count, NULL);
 
-    VkSwapchainKHR swapChains[] = {app->swap_chain};
-    presentInfo.swapchainCount = 1;
-    presentInfo.pSwapchains = swapChains;
-    presentInfo.pImageIndices = &imageIndex;
+        if (image_count > MAX_SWAP_CHAIN_IMAGES)
+        {
+            printf("Swap chain has %u images, at most %u are supported.\n", image_count, MAX_SWAP_CHAIN_IMAGES);
+            exit(36);
+        }
 
-    presentInfo.pResults = NULL; // Optional
+        vkGetSwapchainImagesKHR(app->device, output->swap_chain, &image_count, output->images);
+        output->image_count = image_count;
 
-    vkQueuePresentKHR(app->present_queue, &presentInfo);
-}
+        for (uint32_t image = 0; image < image_count; image++)
+        {
+            output->image_views[image] = create_image_view(app, output->images[image], surface_format.format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
 
-void main_loop(App *app)
+            // Same order as the render pass attachments
+            VkImageView attachments[3];
+            uint32_t attachment_count = 0;
+
+            if (app->msaa_samples != VK_SAMPLE_COUNT_1_BIT)
+            {
+                attachments[attachment_count++] = app->color_image_view;
+            }
+            attachments[attachment_count++] = output->image_views[image];
+            attachments[attachment_count++] = app->depth_image_view;
+
+            VkFramebufferCreateInfo framebuffer_info = {
+                .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+                .renderPass = app->render_pass,
+                .attachmentCount = attachment_count,
+                .pAttachments = attachments,
+                .width = output->extent.width,
+                .height = output->extent.height,
+                .layers = 1,
+            };
+
+            if (vkCreateFramebuffer(app->device, &framebuffer_info, &app->host_memory.callbacks, &output->framebuffers[image]) != VK_SUCCESS)
+            {
+                printf("failed to create framebuffer!\n");
+                exit(14);
+            }
+        }
+
+        VkSemaphoreCreateInfo semaphore_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+
+        if (vkCreateSemaphore(app->device, &semaphore_info, &app->host_memory.callbacks, &output->image_available) != VK_SUCCESS)
+        {
+            printf("failed to create semaphores!\n");
+            exit(19);
+        }
+
+        VkCommandBufferAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = app->commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = image_count,
+        };
+
+        if (vkAllocateCommandBuffers(app->device, &alloc_info, output->command_buffers) != VK_SUCCESS)
+        {
+            printf("failed to allocate command buffers!\n");
+            exit(16);
+        }
+
+        printf("Window %u: %ux%u, %u images, scene %s\n", i + 1, output->extent.width, output->extent.height,
+               image_count, scenes[output->scene].name);
+    }
+}
+
+// Their command buffers go with the pool, the surfaces and windows after the device
+void destroy_outputs(App *app)
+{
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        Output *output = &app->outputs[i];
+
+        for (uint32_t image = 0; image < output->image_count; image++)
+        {
+            vkDestroyFramebuffer(app->device, output->framebuffers[image], &app->host_memory.callbacks);
+            vkDestroyImageView(app->device, output->image_views[image], &app->host_memory.callbacks);
+        }
+
+        vkDestroySemaphore(app->device, output->image_available, &app->host_memory.callbacks);
+        vkDestroySwapchainKHR(app->device, output->swap_chain, &app->host_memory.callbacks);
+    }
+}
+
+// Draw slots: the main output's swap chain images come first, then MAX_SWAP_CHAIN_IMAGES per extra window
+uint32_t output_slot(App *app, uint32_t output, uint32_t image)
+{
+    return app->swap_chain_image_count + output * MAX_SWAP_CHAIN_IMAGES + image;
+}
+
+// The other way around: 0 for the main output's slots, 1 + n for extra window n's
+uint32_t slot_output(App *app, uint32_t slot)
+{
+    return slot < app->swap_chain_image_count ? 0 : 1 + (slot - app->swap_chain_image_count) / MAX_SWAP_CHAIN_IMAGES;
+}
+
+// Like get_command_buffer, for the image output acquired this frame
+VkCommandBuffer get_output_command_buffer(App *app, uint32_t output)
+{
+    Output *out = &app->outputs[output];
+    CommandCache *cache = &app->command_cache;
+    VkCommandBuffer commandBuffer = out->command_buffers[out->image_index];
+
+    if (out->recorded_version[out->image_index] == cache->version)
+    {
+        cache->hits++;
+        return commandBuffer;
+    }
+
+    vkResetCommandBuffer(commandBuffer, 0);
+    record_output_commands(app, output, commandBuffer);
+    out->recorded_version[out->image_index] = cache->version;
+    cache->misses++;
+
+    return commandBuffer;
+}
+
+// Runs after the main output's command buffer in the same submit
+void record_output_commands(App *app, uint32_t output, VkCommandBuffer commandBuffer)
+{
+    Output *out = &app->outputs[output];
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        printf("failed to begin recording command buffer!\n");
+        exit(17);
+    }
+
+    // The multisampled color and depth images are shared, the previous output's pass must be done with them
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                         VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+
+    record_scene_pass(app, commandBuffer, out->framebuffers[out->image_index], out->extent, out->scene,
+                      output_slot(app, output, out->image_index));
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    {
+        printf("failed to record command buffer!\n");
+        exit(18);
+    }
+}
+
+// Closing any window ends the run
+bool windows_should_close(App *app)
+{
+    if (glfwWindowShouldClose(app->window))
+    {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        if (glfwWindowShouldClose(app->outputs[i].window))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void create_sync_objects(App *app)
+{
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    if (vkCreateSemaphore(app->device, &semaphoreInfo, &app->host_memory.callbacks, &app->imageAvailableSemaphore) != VK_SUCCESS ||
+    vkCreateSemaphore(app->device, &semaphoreInfo, &app->host_memory.callbacks, &app->renderFinishedSemaphore) != VK_SUCCESS ||
+    vkCreateFence(app->device, &fenceInfo, &app->host_memory.callbacks, &app->inFlightFence) != VK_SUCCESS)
+    {
+        printf("failed to create semaphores!\n");
+        exit(19);
+    }
+}
+
+uint32_t find_memory_type(App *app, uint32_t type_filter, VkMemoryPropertyFlags properties)
+{
+    VkPhysicalDeviceMemoryProperties mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(app->physical_device, &mem_properties);
+
+    for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++)
+    {
+        if ((type_filter & (1u << i)) &&
+            (mem_properties.memoryTypes[i].propertyFlags & properties) == properties)
+        {
+            return i;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+void create_buffer(App *app, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags preferred,
+                   VkMemoryPropertyFlags required, VkBuffer *buffer, VkDeviceMemory *memory, VkMemoryPropertyFlags *actual)
+{
+    VkBufferCreateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    if (vkCreateBuffer(app->device, &buffer_info, &app->host_memory.callbacks, buffer) != VK_SUCCESS)
+    {
+        printf("failed to create buffer!\n");
+        exit(23);
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(app->device, *buffer, &mem_requirements);
+
+    VkMemoryPropertyFlags properties = preferred | required;
+    uint32_t memory_type = find_memory_type(app, mem_requirements.memoryTypeBits, properties);
+
+    if (memory_type == UINT32_MAX)
+    {
+        properties = required;
+        memory_type = find_memory_type(app, mem_requirements.memoryTypeBits, properties);
+    }
+
+    if (memory_type == UINT32_MAX)
+    {
+        printf("failed to find a suitable memory type!\n");
+        exit(24);
+    }
+
+    VkPhysicalDeviceMemoryProperties mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(app->physical_device, &mem_properties);
+
+    VkMemoryAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = mem_requirements.size,
+        .memoryTypeIndex = memory_type,
+    };
+
+    if (vkAllocateMemory(app->device, &alloc_info, &app->host_memory.callbacks, memory) != VK_SUCCESS)
+    {
+        printf("failed to allocate buffer memory!\n");
+        exit(25);
+    }
+
+    vkBindBufferMemory(app->device, *buffer, *memory, 0);
+
+    if (actual != NULL)
+    {
+        *actual = mem_properties.memoryTypes[memory_type].propertyFlags;
+    }
+}
+
+void create_image(App *app, uint32_t width, uint32_t height, uint32_t mip_levels, VkSampleCountFlagBits samples,
+                  VkFormat format, VkImageUsageFlags usage, VkMemoryPropertyFlags preferred, VkMemoryPropertyFlags required,
+                  VkImage *image, VkDeviceMemory *memory)
+{
+    VkImageCreateInfo image_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = format,
+        .extent = { width, height, 1 },
+        .mipLevels = mip_levels,
+        .arrayLayers = 1,
+        .samples = samples,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    if (vkCreateImage(app->device, &image_info, &app->host_memory.callbacks, image) != VK_SUCCESS)
+    {
+        printf("failed to create image!\n");
+        exit(28);
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetImageMemoryRequirements(app->device, *image, &mem_requirements);
+
+    uint32_t memory_type = find_memory_type(app, mem_requirements.memoryTypeBits, preferred | required);
+
+    if (memory_type == UINT32_MAX)
+    {
+        memory_type = find_memory_type(app, mem_requirements.memoryTypeBits, required);
+    }
+
+    VkMemoryAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = mem_requirements.size,
+        .memoryTypeIndex = memory_type,
+    };
+
+    if (memory_type == UINT32_MAX || vkAllocateMemory(app->device, &alloc_info, &app->host_memory.callbacks, memory) != VK_SUCCESS)
+    {
+        printf("failed to allocate image memory!\n");
+        exit(28);
+    }
+
+    vkBindImageMemory(app->device, *image, *memory, 0);
+}
+
+VkImageView create_image_view(App *app, VkImage image, VkFormat format, VkImageAspectFlags aspect, uint32_t mip_levels)
+{
+    VkImageViewCreateInfo create_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = format,
+        .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .subresourceRange.aspectMask = aspect,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = mip_levels,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    VkImageView image_view;
+
+    if (vkCreateImageView(app->device, &create_info, &app->host_memory.callbacks, &image_view) != VK_SUCCESS)
+    {
+        printf("Failed to create image view...\n");
+        exit(8);
+    }
+
+    return image_view;
+}
+
+VkSampleCountFlagBits choose_msaa_samples(App *app)
+{
+    if (app->config.msaa_samples <= 1)
+    {
+        return VK_SAMPLE_COUNT_1_BIT;
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(app->physical_device, &device_properties);
+
+    VkSampleCountFlags supported = device_properties.limits.framebufferColorSampleCounts &
+                                   device_properties.limits.framebufferDepthSampleCounts;
+    const VkSampleCountFlagBits candidates[] = { VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT };
+    const uint32_t counts[] = { 8, 4, 2 };
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        if (counts[i] <= app->config.msaa_samples && (supported & candidates[i]))
+        {
+            if (counts[i] != app->config.msaa_samples)
+            {
+                printf("MSAA %ux not supported, using %ux\n", app->config.msaa_samples, counts[i]);
+            }
+            return candidates[i];
+        }
+    }
+
+    printf("MSAA not supported, rendering without it\n");
+    return VK_SAMPLE_COUNT_1_BIT;
+}
+
+void create_color_resources(App *app)
+{
+    if (app->msaa_samples == VK_SAMPLE_COUNT_1_BIT)
+    {
+        return;
+    }
+
+    // Transient and lazily allocated: on tilers the samples live in tile memory
+    // and are never backed by real allocations, elsewhere this is plain device memory
+    create_image(app, app->target_extent.width, app->target_extent.height, 1, app->msaa_samples,
+                 app->swap_chain_image_format,
+                 VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                 VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &app->color_image, &app->color_image_memory);
+
+    app->color_image_view = create_image_view(app, app->color_image, app->swap_chain_image_format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+}
+
+void destroy_color_resources(App *app)
+{
+    if (app->msaa_samples == VK_SAMPLE_COUNT_1_BIT)
+    {
+        return;
+    }
+
+    vkDestroyImageView(app->device, app->color_image_view, &app->host_memory.callbacks);
+    vkDestroyImage(app->device, app->color_image, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, app->color_image_memory, &app->host_memory.callbacks);
+}
+
+VkFormat find_supported_format(App *app, const VkFormat *candidates, uint32_t candidate_count, VkImageTiling tiling, VkFormatFeatureFlags features)
+{
+    for (uint32_t i = 0; i < candidate_count; i++)
+    {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(app->physical_device, candidates[i], &properties);
+
+        VkFormatFeatureFlags available = tiling == VK_IMAGE_TILING_LINEAR ? properties.linearTilingFeatures
+                                                                          : properties.optimalTilingFeatures;
+        if ((available & features) == features)
+        {
+            return candidates[i];
+        }
+    }
+
+    printf("failed to find a supported format!\n");
+    exit(30);
+}
+
+void create_depth_resources(App *app)
+{
+    // Never stored, so it can be transient just like the MSAA color target
+    create_image(app, app->target_extent.width, app->target_extent.height, 1, app->msaa_samples,
+                 app->depth_format,
+                 VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                 VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &app->depth_image, &app->depth_image_memory);
+
+    app->depth_image_view = create_image_view(app, app->depth_image, app->depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
+}
+
+void destroy_depth_resources(App *app)
+{
+    vkDestroyImageView(app->device, app->depth_image_view, &app->host_memory.callbacks);
+    vkDestroyImage(app->device, app->depth_image, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, app->depth_image_memory, &app->host_memory.callbacks);
+}
+
+void create_dynamic_resolution(App *app)
+{
+    DynamicResolution *dr = &app->dynres;
+
+    app->target_extent = app->swap_chain_extent;
+    app->render_extent = app->swap_chain_extent;
+
+    if (!app->config.dynamic_resolution)
+    {
+        return;
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(app->physical_device, &device_properties);
+
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(app->physical_device, app->swap_chain_image_format, &format_properties);
+
+    VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+
+    if ((format_properties.optimalTilingFeatures & blit) != blit)
+    {
+        printf("Output format can't be blitted, dynamic resolution is unavailable.\n");
+        exit(31);
+    }
+
+    dr->enabled = true;
+    dr->min_scale = app->config.dynres_min_scale;
+    dr->max_scale = app->config.dynres_max_scale;
+    dr->target_ms = app->config.target_ms;
+    dr->scale = dr->max_scale;
+    dr->filter = (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)
+                 ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+    uint32_t max_dimension = device_properties.limits.maxImageDimension2D;
+    dr->max_extent.width = clamp_u32((uint32_t)(app->swap_chain_extent.width * dr->max_scale), 8, max_dimension);
+    dr->max_extent.height = clamp_u32((uint32_t)(app->swap_chain_extent.height * dr->max_scale), 8, max_dimension);
+
+    // Allocated once at the largest size, smaller frames only use its top left corner
+    create_image(app, dr->max_extent.width, dr->max_extent.height, 1, VK_SAMPLE_COUNT_1_BIT, app->swap_chain_image_format,
+                 VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &dr->image, &dr->memory);
+    dr->view = create_image_view(app, dr->image, app->swap_chain_image_format, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+
+    app->target_extent = dr->max_extent;
+    app->render_extent = dr->max_extent;
+}
+
+void destroy_dynamic_resolution(App *app)
+{
+    DynamicResolution *dr = &app->dynres;
+
+    if (!dr->enabled)
+    {
+        return;
+    }
+
+    printf("Dynamic resolution: final scale %.3f (%ux%u)\n", dr->scale, app->render_extent.width, app->render_extent.height);
+
+    vkDestroyImageView(app->device, dr->view, &app->host_memory.callbacks);
+    vkDestroyImage(app->device, dr->image, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, dr->memory, &app->host_memory.callbacks);
+}
+
+// Steers the render scale towards target_ms using the last GPU frame time
+void update_dynamic_resolution(App *app)
+{
+    DynamicResolution *dr = &app->dynres;
+
+    if (!dr->enabled || !app->profiler.enabled || app->profiler.last_gpu_ms <= 0.0)
+    {
+        return;
+    }
+
+    // GPU time follows the pixel count, which goes with the square of the scale
+    double ratio = dr->target_ms / app->profiler.last_gpu_ms;
+
+    // Dead band and damping keep the size from oscillating around the target
+    if (ratio > 0.95 && ratio < 1.05)
+    {
+        return;
+    }
+
+    float desired = dr->scale * (float)sqrt(ratio);
+    dr->scale += (desired - dr->scale) * 0.25f;
+
+    if (dr->scale < dr->min_scale) dr->scale = dr->min_scale;
+    if (dr->scale > dr->max_scale) dr->scale = dr->max_scale;
+
+    // Snap to 8 pixel steps so tiny corrections don't change the extent every frame
+    uint32_t width = (uint32_t)(app->swap_chain_extent.width * dr->scale) & ~7u;
+    uint32_t height = (uint32_t)(app->swap_chain_extent.height * dr->scale) & ~7u;
+
+    width = clamp_u32(width, 8, dr->max_extent.width);
+    height = clamp_u32(height, 8, dr->max_extent.height);
+
+    if (width != app->render_extent.width || height != app->render_extent.height)
+    {
+        app->render_extent.width = width;
+        app->render_extent.height = height;
+        invalidate_command_buffers(app);
+    }
+}
+
+void record_upscale(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    DynamicResolution *dr = &app->dynres;
+
+    if (!dr->enabled)
+    {
+        return;
+    }
+
+    // The render pass left the offscreen image in TRANSFER_SRC, make its writes visible to the blit
+    VkImageMemoryBarrier barriers[2] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = dr->image,
+            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = app->swap_chain_images[imageIndex],
+            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+        },
+    };
+
+    // COLOR_ATTACHMENT_OUTPUT also chains the blit behind the image acquire semaphore
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, NULL, 0, NULL, 2, barriers);
+
+    VkImageBlit blit = {
+        .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+        .srcOffsets = { { 0, 0, 0 }, { (int32_t)app->render_extent.width, (int32_t)app->render_extent.height, 1 } },
+        .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+        .dstOffsets = { { 0, 0, 0 }, { (int32_t)app->swap_chain_extent.width, (int32_t)app->swap_chain_extent.height, 1 } },
+    };
+
+    vkCmdBlitImage(commandBuffer, dr->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   app->swap_chain_images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, dr->filter);
+
+    VkImageMemoryBarrier to_present = barriers[1];
+    to_present.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    to_present.dstAccessMask = 0;
+    to_present.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    to_present.newLayout = app->present_layout;
+
+    // Ends in the transfer stage so a following readback copy chains onto it
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, NULL, 0, NULL, 1, &to_present);
+}
+
+void arena_init(Arena *arena, size_t size)
+{
+    *arena = (Arena){ .base = (uint8_t*)malloc(size), .size = size };
+
+    if (arena->base == NULL)
+    {
+        printf("failed to allocate host memory!\n");
+        exit(35);
+    }
+}
+
+// 16 byte aligned, valid until the arena is released past it
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size_t offset = (arena->used + 15) & ~(size_t)15;
+
+    if (offset > arena->size || size > arena->size - offset)
+    {
+        printf("frame arena exhausted, %zu of %zu bytes in use!\n", arena->used, arena->size);
+        exit(35);
+    }
+
+    arena->used = offset + size;
+    if (arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+
+    return arena->base + offset;
+}
+
+// Frees everything allocated after mark was taken from arena->used
+void arena_release(Arena *arena, size_t mark)
+{
+    arena->used = mark;
+}
+
+void arena_destroy(Arena *arena)
+{
+    free(arena->base);
+    *arena = (Arena){0};
+}
+
+void pool_init(Pool *pool, size_t block_size, uint32_t block_count)
+{
+    *pool = (Pool){
+        .base = (uint8_t*)aligned_alloc(HOST_POOL_ALIGNMENT, block_size * block_count),
+        .block_size = block_size,
+        .block_count = block_count,
+    };
+
+    if (pool->base == NULL)
+    {
+        printf("failed to allocate host memory!\n");
+        exit(35);
+    }
+
+    // Thread the free list back to front so blocks are handed out in address order
+    for (uint32_t i = block_count; i > 0; i--)
+    {
+        void **block = (void**)(pool->base + (i - 1) * block_size);
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+}
+
+// Returns NULL when every block is in use
+void *pool_alloc(Pool *pool)
+{
+    void **block = (void**)pool->free_list;
+
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    pool->free_list = *block;
+    pool->used++;
+    if (pool->used > pool->peak)
+    {
+        pool->peak = pool->used;
+    }
+
+    return block;
+}
+
+void pool_free(Pool *pool, void *block)
+{
+    *(void**)block = pool->free_list;
+    pool->free_list = block;
+    pool->used--;
+}
+
+bool pool_owns(const Pool *pool, const void *pointer)
+{
+    const uint8_t *address = (const uint8_t*)pointer;
+    return address >= pool->base && address < pool->base + pool->block_size * pool->block_count;
+}
+
+void pool_destroy(Pool *pool)
+{
+    free(pool->base);
+    *pool = (Pool){0};
+}
+
+// Sits right in front of allocations that don't come from a pool
+typedef struct HostHeapHeader
+{
+    void *raw;
+    size_t size;
+} HostHeapHeader;
+
+static void *host_alloc_locked(HostMemory *host, size_t size, size_t alignment)
+{
+    void *memory = NULL;
+    size_t held = 0;
+
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT && memory == NULL; i++)
+    {
+        if (size <= host->pools[i].block_size && alignment <= HOST_POOL_ALIGNMENT)
+        {
+            memory = pool_alloc(&host->pools[i]);
+            held = host->pools[i].block_size;
+        }
+    }
+
+    if (memory == NULL)
+    {
+        alignment = alignment > sizeof(HostHeapHeader) ? alignment : sizeof(HostHeapHeader);
+
+        uint8_t *raw = (uint8_t*)malloc(size + alignment + sizeof(HostHeapHeader));
+        if (raw == NULL)
+        {
+            return NULL;
+        }
+
+        uintptr_t address = ((uintptr_t)raw + sizeof(HostHeapHeader) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        HostHeapHeader *header = (HostHeapHeader*)address - 1;
+        header->raw = raw;
+        header->size = size;
+
+        memory = (void*)address;
+        held = size;
+        host->heap_allocations++;
+    }
+
+    host->live_bytes += held;
+    if (host->live_bytes > host->peak_bytes)
+    {
+        host->peak_bytes = host->live_bytes;
+    }
+
+    return memory;
+}
+
+// Bytes held by memory, the block size for pooled allocations
+static size_t host_size_locked(HostMemory *host, void *memory)
+{
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT; i++)
+    {
+        if (pool_owns(&host->pools[i], memory))
+        {
+            return host->pools[i].block_size;
+        }
+    }
+
+    return ((HostHeapHeader*)memory - 1)->size;
+}
+
+static void host_free_locked(HostMemory *host, void *memory)
+{
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT; i++)
+    {
+        if (pool_owns(&host->pools[i], memory))
+        {
+            host->live_bytes -= host->pools[i].block_size;
+            pool_free(&host->pools[i], memory);
+            return;
+        }
+    }
+
+    HostHeapHeader *header = (HostHeapHeader*)memory - 1;
+    host->live_bytes -= header->size;
+    free(header->raw);
+}
+
+static void *VKAPI_PTR host_allocation(void *user, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostMemory *host = (HostMemory*)user;
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&host->mutex);
+
+    void *memory = host_alloc_locked(host, size, alignment);
+    host->allocations++;
+    host->scope_allocations[(uint32_t)scope < 5 ? scope : 4]++;
+    if (atomic_load(&host->in_frame))
+    {
+        host->frame_allocations++;
+    }
+
+    pthread_mutex_unlock(&host->mutex);
+    return memory;
+}
+
+static void *VKAPI_PTR host_reallocation(void *user, void *original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    HostMemory *host = (HostMemory*)user;
+
+    if (original == NULL)
+    {
+        return host_allocation(user, size, alignment, scope);
+    }
+
+    pthread_mutex_lock(&host->mutex);
+
+    host->reallocations++;
+    if (atomic_load(&host->in_frame))
+    {
+        host->frame_allocations++;
+    }
+
+    void *memory = NULL;
+
+    if (size == 0)
+    {
+        host_free_locked(host, original);
+    }
+    else
+    {
+        size_t original_size = host_size_locked(host, original);
+
+        // Growing within a pool block or shrinking keeps the block
+        if (size <= original_size && ((uintptr_t)original & (alignment - 1)) == 0)
+        {
+            memory = original;
+        }
+        else if ((memory = host_alloc_locked(host, size, alignment)) != NULL)
+        {
+            memcpy(memory, original, original_size < size ? original_size : size);
+            host_free_locked(host, original);
+        }
+    }
+
+    pthread_mutex_unlock(&host->mutex);
+    return memory;
+}
+
+static void VKAPI_PTR host_free(void *user, void *memory)
+{
+    HostMemory *host = (HostMemory*)user;
+
+    if (memory == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&host->mutex);
+    host->frees++;
+    host_free_locked(host, memory);
+    pthread_mutex_unlock(&host->mutex);
+}
+
+static void VKAPI_PTR host_internal_allocation(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    HostMemory *host = (HostMemory*)user;
+
+    pthread_mutex_lock(&host->mutex);
+    host->internal_bytes += size;
+    pthread_mutex_unlock(&host->mutex);
+}
+
+static void VKAPI_PTR host_internal_free(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    HostMemory *host = (HostMemory*)user;
+
+    pthread_mutex_lock(&host->mutex);
+    host->internal_bytes -= size;
+    pthread_mutex_unlock(&host->mutex);
+}
+
+void create_host_memory(App *app)
+{
+    HostMemory *host = &app->host_memory;
+
+    // Sized for what the driver keeps alive for this renderer, anything else falls through to the heap
+    static const size_t block_sizes[HOST_POOL_CLASS_COUNT] = { 64, 256, 1024, 4096, 16384 };
+    static const uint32_t block_counts[HOST_POOL_CLASS_COUNT] = { 2048, 1024, 256, 64, 16 };
+
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT; i++)
+    {
+        pool_init(&host->pools[i], block_sizes[i], block_counts[i]);
+    }
+
+    pthread_mutex_init(&host->mutex, NULL);
+
+    host->callbacks = (VkAllocationCallbacks){
+        .pUserData = host,
+        .pfnAllocation = host_allocation,
+        .pfnReallocation = host_reallocation,
+        .pfnFree = host_free,
+        .pfnInternalAllocation = host_internal_allocation,
+        .pfnInternalFree = host_internal_free,
+    };
+
+    arena_init(&app->frame_arena, FRAME_ARENA_SIZE);
+}
+
+// Runs after the instance is gone, nothing may allocate through the callbacks anymore
+void destroy_host_memory(App *app)
+{
+    HostMemory *host = &app->host_memory;
+
+    printf("Host memory: %" PRIu64 " driver allocations (%" PRIu64 " from the heap), %" PRIu64 " reallocations, peak %.1f KiB, "
+           "%" PRIu64 " during steady state frames\n",
+           host->allocations, host->heap_allocations, host->reallocations, host->peak_bytes / 1024.0, host->frame_allocations);
+    printf("Host memory by scope: command %" PRIu64 ", object %" PRIu64 ", cache %" PRIu64 ", device %" PRIu64 ", instance %" PRIu64 "\n",
+           host->scope_allocations[0], host->scope_allocations[1], host->scope_allocations[2],
+           host->scope_allocations[3], host->scope_allocations[4]);
+
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT; i++)
+    {
+        printf("Host memory pool %zu B: peak %u of %u blocks\n", host->pools[i].block_size,
+               host->pools[i].peak, host->pools[i].block_count);
+    }
+
+    printf("Frame arena: peak %.1f of %.1f KiB\n", app->frame_arena.peak / 1024.0, app->frame_arena.size / 1024.0);
+
+    if (host->live_bytes != 0)
+    {
+        printf("Host memory: %zu bytes were never freed by the driver\n", host->live_bytes);
+    }
+
+    for (uint32_t i = 0; i < HOST_POOL_CLASS_COUNT; i++)
+    {
+        pool_destroy(&host->pools[i]);
+    }
+
+    pthread_mutex_destroy(&host->mutex);
+    arena_destroy(&app->frame_arena);
+}
+
+void create_memory_budget(App *app)
+{
+    MemoryBudget *mb = &app->memory_budget;
+    VkPhysicalDeviceMemoryProperties mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(app->physical_device, &mem_properties);
+
+    mb->heap_count = mem_properties.memoryHeapCount;
+    for (uint32_t i = 0; i < mb->heap_count; i++)
+    {
+        mb->heap_flags[i] = mem_properties.memoryHeaps[i].flags;
+    }
+
+    mb->pressure = app->config.memory_pressure / 100.0f;
+
+    if (mb->supported)
+    {
+        mb->get_memory_properties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)
+            vkGetInstanceProcAddr(app->instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+        mb->supported = mb->get_memory_properties2 != NULL;
+    }
+
+    if (!mb->supported)
+    {
+        printf("VK_EXT_memory_budget unavailable, evicting against the texture budget only.\n");
+        return;
+    }
+
+    sample_memory_budget(app);
+}
+
+// Heap usage includes other processes' allocations, budget is what the driver expects we can use without paging
+void sample_memory_budget(App *app)
+{
+    MemoryBudget *mb = &app->memory_budget;
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+    };
+
+    VkPhysicalDeviceMemoryProperties2KHR properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR,
+        .pNext = &budget_properties,
+    };
+
+    mb->get_memory_properties2(app->physical_device, &properties);
+
+    for (uint32_t i = 0; i < mb->heap_count; i++)
+    {
+        char name[32];
+
+        mb->usage[i] = budget_properties.heapUsage[i];
+        mb->budget[i] = budget_properties.heapBudget[i];
+
+        snprintf(name, sizeof(name), "heap%u usage MiB", i);
+        profiler_set_counter(app, name, mb->usage[i] / 1048576.0);
+        snprintf(name, sizeof(name), "heap%u budget MiB", i);
+        profiler_set_counter(app, name, mb->budget[i] / 1048576.0);
+    }
+}
+
+bool memory_under_pressure(App *app)
+{
+    MemoryBudget *mb = &app->memory_budget;
+
+    if (app->textures.used > app->textures.budget)
+    {
+        return true;
+    }
+
+    for (uint32_t i = 0; mb->supported && i < mb->heap_count; i++)
+    {
+        if ((mb->heap_flags[i] & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && mb->usage[i] > mb->budget[i] * mb->pressure)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Runs after the in-flight fence. Evicts textures in least recently used order while a device
+// local heap is close to its budget, so we give memory back before the driver starts paging.
+void update_memory_budget(App *app)
+{
+    MemoryBudget *mb = &app->memory_budget;
+    TextureStreamer *streamer = &app->textures;
+
+    if (mb->supported && app->frame_number % MEMORY_BUDGET_INTERVAL == 0)
+    {
+        sample_memory_budget(app);
+    }
+
+    while (memory_under_pressure(app))
+    {
+        uint32_t victim = UINT32_MAX;
+
+        // Never the white texel or the bound texture, the descriptor set may point at either
+        for (uint32_t i = 1; i < streamer->texture_count; i++)
+        {
+            Texture *texture = &streamer->textures[i];
+
+            if (i != streamer->bound && !texture->evicted &&
+                (victim == UINT32_MAX || texture->last_used < streamer->textures[victim].last_used))
+            {
+                victim = i;
+            }
+        }
+
+        if (victim == UINT32_MAX)
+        {
+            break;
+        }
+
+        printf("Memory pressure: evicting texture %u, unused for %" PRIu64 " frames\n", victim,
+               app->frame_number - streamer->textures[victim].last_used);
+        texture_evict(app, victim);
+
+        if (mb->supported)
+        {
+            sample_memory_budget(app);
+        }
+    }
+
+    profiler_set_counter(app, "texture MiB", streamer->used / 1048576.0);
+    profiler_set_counter(app, "evicted MiB", mb->evicted_bytes / 1048576.0);
+}
+
+static const TextureFormatInfo texture_formats[] = {
+    { VK_FORMAT_R8G8B8A8_UNORM,       1, 1, 4 },
+    { VK_FORMAT_R8G8B8A8_SRGB,        1, 1, 4 },
+    { VK_FORMAT_B8G8R8A8_UNORM,       1, 1, 4 },
+    { VK_FORMAT_B8G8R8A8_SRGB,        1, 1, 4 },
+    { VK_FORMAT_BC1_RGB_UNORM_BLOCK,  4, 4, 8 },
+    { VK_FORMAT_BC1_RGB_SRGB_BLOCK,   4, 4, 8 },
+    { VK_FORMAT_BC1_RGBA_UNORM_BLOCK, 4, 4, 8 },
+    { VK_FORMAT_BC1_RGBA_SRGB_BLOCK,  4, 4, 8 },
+    { VK_FORMAT_BC3_UNORM_BLOCK,      4, 4, 16 },
+    { VK_FORMAT_BC3_SRGB_BLOCK,       4, 4, 16 },
+    { VK_FORMAT_BC4_UNORM_BLOCK,      4, 4, 8 },
+    { VK_FORMAT_BC5_UNORM_BLOCK,      4, 4, 16 },
+    { VK_FORMAT_BC7_UNORM_BLOCK,      4, 4, 16 },
+    { VK_FORMAT_BC7_SRGB_BLOCK,       4, 4, 16 },
+};
+static const uint32_t texture_format_count = sizeof(texture_formats) / sizeof(texture_formats[0]);
+
+static const uint8_t ktx2_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+static const TextureFormatInfo *find_texture_format(VkFormat format)
+{
+    for (uint32_t i = 0; i < texture_format_count; i++)
+    {
+        if (texture_formats[i].format == format)
+        {
+            return &texture_formats[i];
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t mip_size(uint32_t size, uint32_t level)
+{
+    size >>= level;
+    return size > 0 ? size : 1;
+}
+
+static uint32_t texture_block_rows(const TextureFormatInfo *format, uint32_t height)
+{
+    return (height + format->block_height - 1) / format->block_height;
+}
+
+static VkDeviceSize texture_row_size(const TextureFormatInfo *format, uint32_t width)
+{
+    return (VkDeviceSize)((width + format->block_width - 1) / format->block_width) * format->block_size;
+}
+
+// Bytes of levels first..last-1 of a width x height level 0
+static VkDeviceSize texture_chain_size(const TextureFormatInfo *format, uint32_t width, uint32_t height,
+                                       uint32_t first, uint32_t last)
+{
+    VkDeviceSize size = 0;
+
+    for (uint32_t level = first; level < last; level++)
+    {
+        size += texture_row_size(format, mip_size(width, level)) * texture_block_rows(format, mip_size(height, level));
+    }
+
+    return size;
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static uint64_t read_u64(const uint8_t *data)
+{
+    return (uint64_t)read_u32(data) | (uint64_t)read_u32(data + 4) << 32;
+}
+
+void create_texture_streamer(App *app)
+{
+    TextureStreamer *streamer = &app->textures;
+
+    streamer->budget = (VkDeviceSize)app->config.texture_budget_mb * 1024 * 1024;
+
+    create_buffer(app, TEXTURE_STAGING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 0,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  &streamer->staging, &streamer->staging_memory, NULL);
+
+    if (vkMapMemory(app->device, streamer->staging_memory, 0, TEXTURE_STAGING_SIZE, 0, (void**)&streamer->staging_mapped) != VK_SUCCESS)
+    {
+        printf("failed to map texture staging memory!\n");
+        exit(26);
+    }
+
+    VkCommandBufferAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = app->commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    if (vkAllocateCommandBuffers(app->device, &alloc_info, &streamer->command_buffer) != VK_SUCCESS)
+    {
+        printf("failed to allocate command buffers!\n");
+        exit(16);
+    }
+
+    // Levels become visible through the view as they arrive, the sampler itself never clamps
+    VkSamplerCreateInfo sampler_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .minLod = 0.0f,
+        .maxLod = VK_LOD_CLAMP_NONE,
+    };
+
+    VkDescriptorSetLayoutBinding binding = {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .pImmutableSamplers = &streamer->sampler,
+    };
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &binding,
+    };
+
+    VkDescriptorPoolSize pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = 1,
+        .poolSizeCount = 1,
+        .pPoolSizes = &pool_size,
+    };
+
+    if (vkCreateSampler(app->device, &sampler_info, &app->host_memory.callbacks, &streamer->sampler) != VK_SUCCESS ||
+        vkCreateDescriptorSetLayout(app->device, &layout_info, &app->host_memory.callbacks, &streamer->set_layout) != VK_SUCCESS ||
+        vkCreateDescriptorPool(app->device, &pool_info, &app->host_memory.callbacks, &streamer->descriptor_pool) != VK_SUCCESS)
+    {
+        printf("failed to create texture sampler or descriptors!\n");
+        exit(34);
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = streamer->descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &streamer->set_layout,
+    };
+
+    if (vkAllocateDescriptorSets(app->device, &set_info, &streamer->descriptor_set) != VK_SUCCESS)
+    {
+        printf("failed to allocate texture descriptor set!\n");
+        exit(34);
+    }
+
+    // Modulates the vertex colors by one, so untextured scenes render as before
+    static const uint8_t white[4] = { 255, 255, 255, 255 };
+    TextureLevel white_level = { white, sizeof(white) };
+    create_texture(app, find_texture_format(VK_FORMAT_R8G8B8A8_UNORM), 1, 1, 1, &white_level, NULL, 0);
+
+    // All of them stream in now, the first one stays bound
+    for (uint32_t i = 0; i < app->config.texture_path_count; i++)
+    {
+        load_texture(app, app->config.texture_paths[i], app->config.texture_width, app->config.texture_height);
+    }
+
+    if (app->config.texture_path_count > 0)
+    {
+        bind_texture(app, 1);
+    }
+}
+
+void destroy_texture_streamer(App *app)
+{
+    TextureStreamer *streamer = &app->textures;
+
+    printf("Textures: %u loaded, %.1f of %.1f MiB budget used, %.1f MiB streamed\n", streamer->texture_count,
+           streamer->used / 1048576.0, streamer->budget / 1048576.0, streamer->uploaded / 1048576.0);
+
+    for (uint32_t i = 0; i < streamer->texture_count; i++)
+    {
+        Texture *texture = &streamer->textures[i];
+
+        if (!texture->evicted)
+        {
+            if (texture->view != VK_NULL_HANDLE)
+            {
+                vkDestroyImageView(app->device, texture->view, &app->host_memory.callbacks);
+            }
+            vkDestroyImage(app->device, texture->image, &app->host_memory.callbacks);
+            vkFreeMemory(app->device, texture->memory, &app->host_memory.callbacks);
+        }
+
+        if (texture->file != NULL)
+        {
+            munmap(texture->file, texture->file_size);
+        }
+    }
+
+    vkDestroyDescriptorPool(app->device, streamer->descriptor_pool, &app->host_memory.callbacks);
+    vkDestroyDescriptorSetLayout(app->device, streamer->set_layout, &app->host_memory.callbacks);
+    vkDestroySampler(app->device, streamer->sampler, &app->host_memory.callbacks);
+    vkUnmapMemory(app->device, streamer->staging_memory);
+    vkDestroyBuffer(app->device, streamer->staging, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, streamer->staging_memory, &app->host_memory.callbacks);
+}
+
+// Maps a KTX2 file, or a raw RGBA8 file of raw_width x raw_height, and queues it for streaming.
+// Only the level index is read here; pixel data is paged in as the streamer copies it.
+uint32_t load_texture(App *app, const char *path, uint32_t raw_width, uint32_t raw_height)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        printf("failed to open texture %s!\n", path);
+        exit(32);
+    }
+
+    size_t file_size = (size_t)file_stat.st_size;
+    uint8_t *file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED)
+    {
+        printf("failed to map texture %s!\n", path);
+        exit(32);
+    }
+
+    const TextureFormatInfo *format;
+    TextureLevel levels[TEXTURE_MAX_LEVELS] = {0};
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+
+    if (file_size >= sizeof(ktx2_identifier) && memcmp(file, ktx2_identifier, sizeof(ktx2_identifier)) == 0)
+    {
+        // Header, section index and level index, see the KTX 2.0 specification
+        const size_t level_index_offset = 80;
+
+        if (file_size < level_index_offset)
+        {
+            printf("truncated KTX2 texture %s!\n", path);
+            exit(33);
+        }
+
+        format = find_texture_format((VkFormat)read_u32(file + 12));
+        width = read_u32(file + 20);
+        height = read_u32(file + 24);
+        level_count = read_u32(file + 40);
+        level_count = level_count > 0 ? level_count : 1;
+
+        uint32_t depth = read_u32(file + 28);
+        uint32_t layer_count = read_u32(file + 32);
+        uint32_t face_count = read_u32(file + 36);
+        uint32_t supercompression = read_u32(file + 44);
+
+        if (format == NULL || width == 0 || height == 0 || depth > 1 || layer_count > 1 || face_count != 1 ||
+            supercompression != 0 || level_count > TEXTURE_MAX_LEVELS ||
+            level_index_offset + level_count * 24 > file_size)
+        {
+            printf("unsupported KTX2 texture %s, only uncompressed 2D RGBA8 and BCn files are handled!\n", path);
+            exit(33);
+        }
+
+        for (uint32_t level = 0; level < level_count; level++)
+        {
+            const uint8_t *entry = file + level_index_offset + level * 24;
+            uint64_t offset = read_u64(entry);
+            uint64_t length = read_u64(entry + 8);
+            VkDeviceSize expected = texture_chain_size(format, width, height, level, level + 1);
+
+            if (offset > file_size || length > file_size - offset || length < expected)
+            {
+                printf("KTX2 texture %s has an invalid level %u!\n", path, level);
+                exit(33);
+            }
+
+            levels[level].data = file + offset;
+            levels[level].size = length;
+        }
+    }
+    else
+    {
+        format = find_texture_format(VK_FORMAT_R8G8B8A8_SRGB);
+        width = raw_width;
+        height = raw_height;
+        level_count = 1;
+
+        if (width == 0 || height == 0 || (uint64_t)width * height * 4 != file_size)
+        {
+            printf("raw texture %s is not %ux%u RGBA8, pass its size with --texture-size!\n", path, width, height);
+            exit(33);
+        }
+
+        levels[0].data = file;
+        levels[0].size = file_size;
+    }
+
+    return create_texture(app, format, width, height, level_count, levels, file, file_size);
+}
+
+// Creates the image and queues its levels for streaming. Takes ownership of file, if any.
+uint32_t create_texture(App *app, const TextureFormatInfo *format, uint32_t width, uint32_t height,
+                        uint32_t source_levels, const TextureLevel *levels, void *file, size_t file_size)
+{
+    TextureStreamer *streamer = &app->textures;
+
+    if (streamer->texture_count == TEXTURE_MAX_COUNT)
+    {
+        printf("too many textures!\n");
+        exit(33);
+    }
+
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(app->physical_device, format->format, &properties);
+
+    bool compressed = format->block_width > 1;
+
+    if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) || (compressed && !streamer->compression_bc))
+    {
+        printf("texture format %d is not supported by the device!\n", format->format);
+        exit(33);
+    }
+
+    if (texture_row_size(format, width) > TEXTURE_STAGING_SIZE)
+    {
+        printf("texture is too wide to stream!\n");
+        exit(33);
+    }
+
+    // Block compressed formats can't be blit targets, they keep the levels they came with
+    VkFormatFeatureFlags blit_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                                         VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    bool generate_mips = source_levels == 1 && !compressed && (properties.optimalTilingFeatures & blit_features) == blit_features;
+    uint32_t level_count = source_levels;
+
+    if (generate_mips)
+    {
+        uint32_t largest = width > height ? width : height;
+        level_count = (uint32_t)floor(log2(largest)) + 1;
+    }
+
+    // Leave out the finest source levels until the rest fits what is left of the budget. A generated
+    // chain is blitted from the only source level, the full size one, so it can't start lower.
+    VkDeviceSize available = streamer->budget > streamer->used ? streamer->budget - streamer->used : 0;
+    uint32_t first_level = 0;
+
+    while (!generate_mips && first_level + 1 < level_count &&
+           texture_chain_size(format, width, height, first_level, level_count) > available)
+    {
+        first_level++;
+    }
+
+    Texture *texture = &streamer->textures[streamer->texture_count];
+    *texture = (Texture){
+        .format = format,
+        .width = mip_size(width, first_level),
+        .height = mip_size(height, first_level),
+        .level_count = level_count - first_level,
+        .generate_mips = generate_mips,
+        .file = file,
+        .file_size = file_size,
+    };
+
+    for (uint32_t level = first_level; level < source_levels; level++)
+    {
+        texture->levels[level - first_level] = levels[level];
+    }
+
+    texture_allocate(app, streamer->texture_count);
+
+    if (first_level > 0)
+    {
+        printf("Texture %u: dropped %u finest levels to fit the %u MiB budget\n", streamer->texture_count,
+               first_level, app->config.texture_budget_mb);
+    }
+    if (streamer->used > streamer->budget)
+    {
+        printf("Texture %u: over the texture budget, %.1f MiB in use\n", streamer->texture_count, streamer->used / 1048576.0);
+    }
+
+    return streamer->texture_count++;
+}
+
+// Creates the image of a new or evicted texture and queues all of its levels
+void texture_allocate(App *app, uint32_t index)
+{
+    TextureStreamer *streamer = &app->textures;
+    Texture *texture = &streamer->textures[index];
+
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                              (texture->generate_mips ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0);
+    create_image(app, texture->width, texture->height, texture->level_count, VK_SAMPLE_COUNT_1_BIT, texture->format->format,
+                 usage, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->image, &texture->memory);
+
+    VkMemoryRequirements mem_requirements;
+    vkGetImageMemoryRequirements(app->device, texture->image, &mem_requirements);
+    texture->memory_size = mem_requirements.size;
+    streamer->used += mem_requirements.size;
+
+    // Coarsest level first, so something can be sampled after the first few kilobytes
+    texture->evicted = false;
+    texture->initialized = false;
+    texture->streaming = true;
+    texture->resident_level = texture->level_count;
+    texture->streaming_level = texture->generate_mips ? 0 : texture->level_count - 1;
+    texture->streaming_row = 0;
+    texture->last_used = app->frame_number;
+
+    // Keeps frames, and with them uploads, coming in on demand mode
+    begin_animation(app);
+}
+
+// Releases a texture's image, its source stays mapped so it can be streamed again.
+// Only for textures the pending frame doesn't sample, draw_frame waited on the fence.
+void texture_evict(App *app, uint32_t index)
+{
+    TextureStreamer *streamer = &app->textures;
+    Texture *texture = &streamer->textures[index];
+
+    if (texture->view != VK_NULL_HANDLE)
+    {
+        vkDestroyImageView(app->device, texture->view, &app->host_memory.callbacks);
+        texture->view = VK_NULL_HANDLE;
+    }
+    vkDestroyImage(app->device, texture->image, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, texture->memory, &app->host_memory.callbacks);
+
+    if (texture->streaming)
+    {
+        texture->streaming = false;
+        end_animation(app);
+    }
+
+    streamer->used -= texture->memory_size;
+    app->memory_budget.evictions++;
+    app->memory_budget.evicted_bytes += texture->memory_size;
+    texture->evicted = true;
+    texture->resident_level = texture->level_count;
+}
+
+// Points the descriptor set at the bound texture, or at the white texel until it has a resident level
+static void texture_update_descriptor(App *app)
+{
+    TextureStreamer *streamer = &app->textures;
+    VkImageView view = streamer->textures[streamer->bound].view;
+
+    if (view == VK_NULL_HANDLE)
+    {
+        view = streamer->textures[0].view;
+    }
+
+    if (view == VK_NULL_HANDLE || view == streamer->bound_view)
+    {
+        return;
+    }
+
+    VkDescriptorImageInfo image_info = {
+        .imageView = view,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+
+    VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = streamer->descriptor_set,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = &image_info,
+    };
+
+    // Nothing referencing the set is pending, draw_frame waited on the in-flight fence
+    vkUpdateDescriptorSets(app->device, 1, &write, 0, NULL);
+    streamer->bound_view = view;
+    invalidate_command_buffers(app);
+    request_redraw(app);
+}
+
+// Binds the next loaded texture every --texture-cycle frames or after T was pressed. Runs after
+// the in-flight fence, so update_memory_budget sees what binding an evicted texture allocated.
+void update_texture_cycle(App *app)
+{
+    TextureStreamer *streamer = &app->textures;
+    bool due = app->config.texture_cycle > 0 && app->frame_number > 0 && app->frame_number % app->config.texture_cycle == 0;
+
+    if (!due && !streamer->cycle_requested)
+    {
+        return;
+    }
+
+    streamer->cycle_requested = false;
+
+    // The white texel and at least two loaded textures
+    if (streamer->texture_count > 2)
+    {
+        bind_texture(app, streamer->bound % (streamer->texture_count - 1) + 1);
+    }
+}
+
+void bind_texture(App *app, uint32_t index)
+{
+    if (index < app->textures.texture_count)
+    {
+        if (app->textures.textures[index].evicted)
+        {
+            texture_allocate(app, index);
+        }
+
+        app->textures.bound = index;
+        app->textures.textures[index].last_used = app->frame_number;
+        texture_update_descriptor(app);
+    }
+}
+
+static void texture_barrier(VkCommandBuffer commandBuffer, VkImage image, uint32_t base_level, uint32_t level_count,
+                            VkImageLayout old_layout, VkImageLayout new_layout, VkAccessFlags src_access,
+                            VkAccessFlags dst_access, VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage)
+{
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = src_access,
+        .dstAccessMask = dst_access,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = base_level,
+        .subresourceRange.levelCount = level_count,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, src_stage, dst_stage, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+// Fills levels 1.. from level 0, each one blitted from the one above it
+static void texture_generate_mips(VkCommandBuffer commandBuffer, Texture *texture)
+{
+    for (uint32_t level = 1; level < texture->level_count; level++)
+    {
+        texture_barrier(commandBuffer, texture->image, level - 1, 1,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+        VkImageBlit blit = {
+            .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 },
+            .srcOffsets[1] = { (int32_t)mip_size(texture->width, level - 1), (int32_t)mip_size(texture->height, level - 1), 1 },
+            .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 },
+            .dstOffsets[1] = { (int32_t)mip_size(texture->width, level), (int32_t)mip_size(texture->height, level), 1 },
+        };
+
+        vkCmdBlitImage(commandBuffer, texture->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       texture->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+        texture_barrier(commandBuffer, texture->image, level - 1, 1,
+                        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                        VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+    }
+
+    texture_barrier(commandBuffer, texture->image, texture->level_count - 1, 1,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+}
+
+// Called once the last row of streaming_level has been copied
+static void texture_finish_level(App *app, Texture *texture, VkCommandBuffer commandBuffer)
+{
+    if (texture->generate_mips)
+    {
+        texture_generate_mips(commandBuffer, texture);
+        texture->resident_level = 0;
+    }
+    else
+    {
+        texture_barrier(commandBuffer, texture->image, texture->streaming_level, 1,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+        texture->resident_level = texture->streaming_level;
+    }
+
+    // The old view was last used by the previous frame, which has completed
+    if (texture->view != VK_NULL_HANDLE)
+    {
+        vkDestroyImageView(app->device, texture->view, &app->host_memory.callbacks);
+    }
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = texture->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = texture->format->format,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = texture->resident_level,
+        .subresourceRange.levelCount = texture->level_count - texture->resident_level,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    if (vkCreateImageView(app->device, &view_info, &app->host_memory.callbacks, &texture->view) != VK_SUCCESS)
+    {
+        printf("Failed to create image view...\n");
+        exit(8);
+    }
+
+    if (texture->resident_level > 0)
+    {
+        texture->streaming_level--;
+        texture->streaming_row = 0;
+    }
+    else
+    {
+        texture->streaming = false;
+        end_animation(app);
+    }
+
+    texture_update_descriptor(app);
+}
+
+// Copies up to TEXTURE_STAGING_SIZE bytes of pending texture data through the staging buffer.
+// Returns the command buffer to submit ahead of the frame, or VK_NULL_HANDLE when nothing is streaming.
+// Must run after the in-flight fence wait, the staging buffer is reused every frame.
+VkCommandBuffer texture_stream_update(App *app)
+{
+    TextureStreamer *streamer = &app->textures;
+    VkCommandBuffer commandBuffer = streamer->command_buffer;
+    VkDeviceSize staged = 0;
+    bool recording = false;
+
+    // Whatever the descriptor set can point at counts as used this frame
+    streamer->textures[0].last_used = app->frame_number;
+    streamer->textures[streamer->bound].last_used = app->frame_number;
+
+    for (uint32_t i = 0; i < streamer->texture_count; i++)
+    {
+        Texture *texture = &streamer->textures[i];
+
+        while (texture->streaming)
+        {
+            const TextureFormatInfo *format = texture->format;
+            uint32_t level = texture->streaming_level;
+            uint32_t width = mip_size(texture->width, level);
+            uint32_t height = mip_size(texture->height, level);
+            uint32_t row_count = texture_block_rows(format, height);
+            VkDeviceSize row_size = texture_row_size(format, width);
+
+            VkDeviceSize rows = (TEXTURE_STAGING_SIZE - staged) / row_size;
+            if (rows > row_count - texture->streaming_row)
+            {
+                rows = row_count - texture->streaming_row;
+            }
+            if (rows == 0)
+            {
+                break;
+            }
+
+            if (!recording)
+            {
+                VkCommandBufferBeginInfo beginInfo = {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                };
+
+                vkResetCommandBuffer(commandBuffer, 0);
+                if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+                {
+                    printf("failed to begin recording command buffer!\n");
+                    exit(17);
+                }
+                recording = true;
+            }
+
+            if (!texture->initialized)
+            {
+                texture_barrier(commandBuffer, texture->image, 0, texture->level_count,
+                                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                0, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+                texture->initialized = true;
+            }
+
+            VkDeviceSize size = rows * row_size;
+            memcpy(streamer->staging_mapped + staged,
+                   texture->levels[level].data + texture->streaming_row * row_size, size);
+
+            uint32_t y = texture->streaming_row * format->block_height;
+            uint32_t copy_height = (uint32_t)rows * format->block_height;
+
+            VkBufferImageCopy region = {
+                .bufferOffset = staged,
+                .bufferRowLength = 0,
+                .bufferImageHeight = 0,
+                .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 },
+                .imageOffset = { 0, (int32_t)y, 0 },
+                .imageExtent = { width, copy_height < height - y ? copy_height : height - y, 1 },
+            };
+
+            vkCmdCopyBufferToImage(commandBuffer, streamer->staging, texture->image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+            // Next copy offset stays a multiple of every block size
+            staged += (size + 15) & ~(VkDeviceSize)15;
+            streamer->uploaded += size;
+            texture->streaming_row += (uint32_t)rows;
+
+            if (texture->streaming_row == row_count)
+            {
+                texture_finish_level(app, texture, commandBuffer);
+            }
+        }
+    }
+
+    if (!recording)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    {
+        printf("failed to record command buffer!\n");
+        exit(18);
+    }
+
+    return commandBuffer;
+}
+
+// FNV-1a over the whole key, keys are zeroed before they are filled so unused spec slots match
+static uint64_t pipeline_key_hash(const PipelineKey *key)
+{
+    const uint8_t *bytes = (const uint8_t*)key;
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < sizeof(*key); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    // 0 marks a free slot
+    return hash != 0 ? hash : 1;
+}
+
+// The permutation the scene draws with in depth_mode, shaded as config.shading asks
+PipelineKey pipeline_default_key(App *app, DepthMode depth_mode)
+{
+    PipelineKey key;
+    memset(&key, 0, sizeof(key));
+
+    key.shader = 0;
+    key.depth_mode = depth_mode;
+    key.cull_mode = VK_CULL_MODE_BACK_BIT;
+    key.front_face = VK_FRONT_FACE_CLOCKWISE;
+    key.blend_mode = depth_mode == DEPTH_MODE_PREPASS ? BLEND_MODE_OPAQUE : BLEND_MODE_ALPHA;
+
+    // The pre-pass has no fragment stage to specialize
+    if (depth_mode != DEPTH_MODE_PREPASS)
+    {
+        key.spec_count = 1;
+        key.spec[0] = app->config.shading;
+    }
+
+    return key;
+}
+
+// Groups draws by permutation in sort keys, a collision only costs an extra bind
+uint32_t pipeline_sort_id(const PipelineKey *key)
+{
+    return (uint32_t)(pipeline_key_hash(key) & 0xfff);
+}
+
+// Lock-free, published entries are never moved or removed until destroy_pipeline_cache
+static PipelineEntry *pipeline_find(PipelineCache *pc, const PipelineKey *key, uint64_t hash)
+{
+    for (uint32_t probe = 0; probe < PIPELINE_CACHE_CAPACITY; probe++)
+    {
+        PipelineEntry *entry = &pc->entries[(hash + probe) & (PIPELINE_CACHE_CAPACITY - 1)];
+        uint64_t entry_hash = atomic_load_explicit(&entry->hash, memory_order_acquire);
+
+        if (entry_hash == 0)
+        {
+            return NULL;
+        }
+
+        if (entry_hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Only the render thread inserts. The key is written before the hash is published, so a
+// concurrent pipeline_find either skips the slot or sees the whole key. NULL when full.
+static PipelineEntry *pipeline_insert(PipelineCache *pc, const PipelineKey *key, uint64_t hash)
+{
+    for (uint32_t probe = 0; probe < PIPELINE_CACHE_CAPACITY; probe++)
+    {
+        PipelineEntry *entry = &pc->entries[(hash + probe) & (PIPELINE_CACHE_CAPACITY - 1)];
+
+        if (atomic_load_explicit(&entry->hash, memory_order_relaxed) == 0)
+        {
+            entry->key = *key;
+            entry->pipeline = VK_NULL_HANDLE;
+            atomic_store_explicit(&entry->state, PIPELINE_QUEUED, memory_order_relaxed);
+            atomic_store_explicit(&entry->hash, hash, memory_order_release);
+            pc->entry_count++;
+            return entry;
+        }
+    }
+
+    if (!pc->full_reported)
+    {
+        printf("Pipeline cache: all %u slots in use, new permutations draw with the fallback\n", PIPELINE_CACHE_CAPACITY);
+        pc->full_reported = true;
+    }
+
+    return NULL;
+}
+
+static double monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+// Runs on the render thread during init or on a compile worker
+static void pipeline_compile_entry(App *app, PipelineEntry *entry)
+{
+    PipelineCache *pc = &app->pipelines;
+
+    double start = monotonic_ms();
+    VkPipeline pipeline = create_pipeline_permutation(app, &entry->key);
+    double elapsed = monotonic_ms() - start;
+
+    entry->pipeline = pipeline;
+    atomic_store_explicit(&entry->state, pipeline != VK_NULL_HANDLE ? PIPELINE_READY : PIPELINE_FAILED,
+                          memory_order_release);
+
+    pthread_mutex_lock(&pc->mutex);
+    pc->compiles++;
+    pc->compile_ms += elapsed;
+    if (elapsed > pc->compile_max_ms)
+    {
+        pc->compile_max_ms = elapsed;
+    }
+    if (pipeline == VK_NULL_HANDLE)
+    {
+        pc->failures++;
+    }
+    pthread_mutex_unlock(&pc->mutex);
+}
+
+static void pipeline_enqueue(PipelineCache *pc, PipelineEntry *entry)
+{
+    pthread_mutex_lock(&pc->mutex);
+    pc->queue[(pc->queue_head + pc->queue_count) % PIPELINE_CACHE_CAPACITY] = (uint32_t)(entry - pc->entries);
+    pc->queue_count++;
+    pthread_cond_signal(&pc->cond);
+    pthread_mutex_unlock(&pc->mutex);
+}
+
+void *pipeline_compile_worker(void *arg)
+{
+    App *app = (App*)arg;
+    PipelineCache *pc = &app->pipelines;
+
+    pthread_mutex_lock(&pc->mutex);
+    for (;;)
+    {
+        while (pc->queue_count == 0 && !pc->stop)
+        {
+            pthread_cond_wait(&pc->cond, &pc->mutex);
+        }
+
+        // Queued permutations are abandoned on exit, they would only be thrown away
+        if (pc->stop)
+        {
+            break;
+        }
+
+        PipelineEntry *entry = &pc->entries[pc->queue[pc->queue_head]];
+        pc->queue_head = (pc->queue_head + 1) % PIPELINE_CACHE_CAPACITY;
+        pc->queue_count--;
+        pc->active++;
+        atomic_store_explicit(&entry->state, PIPELINE_COMPILING, memory_order_relaxed);
+        pthread_mutex_unlock(&pc->mutex);
+
+        pipeline_compile_entry(app, entry);
+
+        // The render thread re-records once it sees the count move
+        atomic_fetch_add(&pc->completed, 1);
+        request_redraw(app);
+
+        pthread_mutex_lock(&pc->mutex);
+        pc->active--;
+        if (pc->queue_count == 0 && pc->active == 0)
+        {
+            pthread_cond_broadcast(&pc->idle);
+        }
+    }
+    pthread_mutex_unlock(&pc->mutex);
+
+    return NULL;
+}
+
+// Draws never wait on a compile. A permutation that isn't ready yet is queued once and the
+// depth mode's fallback, compiled before the first frame, is returned in its place.
+VkPipeline pipeline_get(App *app, const PipelineKey *key)
+{
+    PipelineCache *pc = &app->pipelines;
+    uint64_t hash = pipeline_key_hash(key);
+    PipelineEntry *entry = pipeline_find(pc, key, hash);
+
+    if (entry == NULL)
+    {
+        pc->misses++;
+        entry = pipeline_insert(pc, key, hash);
+        if (entry != NULL)
+        {
+            pipeline_enqueue(pc, entry);
+        }
+    }
+    else if (atomic_load_explicit(&entry->state, memory_order_acquire) == PIPELINE_READY)
+    {
+        pc->hits++;
+        return entry->pipeline;
+    }
+
+    pc->fallback_draws++;
+    pc->fallback_recorded = true;
+    return pc->fallback[key->depth_mode];
+}
+
+// Compiles key on the calling thread unless it is cached already, for the fallbacks. VK_NULL_HANDLE on failure.
+VkPipeline pipeline_compile_now(App *app, const PipelineKey *key)
+{
+    PipelineCache *pc = &app->pipelines;
+    uint64_t hash = pipeline_key_hash(key);
+    PipelineEntry *entry = pipeline_find(pc, key, hash);
+
+    if (entry == NULL && (entry = pipeline_insert(pc, key, hash)) != NULL)
+    {
+        pipeline_compile_entry(app, entry);
+    }
+
+    if (entry == NULL || atomic_load(&entry->state) != PIPELINE_READY)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    return entry->pipeline;
+}
+
+// Re-records command buffers that were recorded with a fallback once a compile finished
+void pipeline_cache_update(App *app)
+{
+    PipelineCache *pc = &app->pipelines;
+    uint32_t completed = atomic_load(&pc->completed);
+
+    if (completed != pc->seen_completed)
+    {
+        pc->seen_completed = completed;
+
+        if (pc->fallback_recorded)
+        {
+            pc->fallback_recorded = false;
+            invalidate_command_buffers(app);
+        }
+    }
+}
+
+// One permutation per line, tokens are name=value and default to pipeline_default_key, or to
+// particle_pipeline_key for depth=test:
+//   depth=less|prepass|equal|test cull=none|front|back front=cw|ccw blend=opaque|alpha|additive spec=A,B,..
+static bool parse_pipeline_key(App *app, char *line, PipelineKey *key)
+{
+    DepthMode depth_mode = DEPTH_MODE_LESS;
+    char *tokens[16];
+    uint32_t token_count = 0;
+
+    for (char *token = strtok(line, " \t\r\n"); token != NULL && token_count < 16; token = strtok(NULL, " \t\r\n"))
+    {
+        tokens[token_count++] = token;
+    }
+
+    // The depth mode decides the defaults of everything else
+    for (uint32_t i = 0; i < token_count; i++)
+    {
+        if (strncmp(tokens[i], "depth=", 6) == 0)
+        {
+            const char *value = tokens[i] + 6;
+
+            if (strcmp(value, "less") == 0)
+                depth_mode = DEPTH_MODE_LESS;
+            else if (strcmp(value, "prepass") == 0)
+                depth_mode = DEPTH_MODE_PREPASS;
+            else if (strcmp(value, "equal") == 0)
+                depth_mode = DEPTH_MODE_EQUAL;
+            else if (strcmp(value, "test") == 0)
+                depth_mode = DEPTH_MODE_TEST;
+            else
+                return false;
+        }
+    }
+
+    *key = depth_mode == DEPTH_MODE_TEST ? particle_pipeline_key() : pipeline_default_key(app, depth_mode);
+
+    for (uint32_t i = 0; i < token_count; i++)
+    {
+        char *value = strchr(tokens[i], '=');
+
+        if (value == NULL)
+        {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (strcmp(tokens[i], "depth") == 0)
+        {
+            continue;
+        }
+        else if (strcmp(tokens[i], "cull") == 0)
+        {
+            if (strcmp(value, "none") == 0)
+                key->cull_mode = VK_CULL_MODE_NONE;
+            else if (strcmp(value, "front") == 0)
+                key->cull_mode = VK_CULL_MODE_FRONT_BIT;
+            else if (strcmp(value, "back") == 0)
+                key->cull_mode = VK_CULL_MODE_BACK_BIT;
+            else
+                return false;
+        }
+        else if (strcmp(tokens[i], "front") == 0)
+        {
+            if (strcmp(value, "cw") == 0)
+                key->front_face = VK_FRONT_FACE_CLOCKWISE;
+            else if (strcmp(value, "ccw") == 0)
+                key->front_face = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+            else
+                return false;
+        }
+        else if (strcmp(tokens[i], "blend") == 0)
+        {
+            if (strcmp(value, "opaque") == 0)
+                key->blend_mode = BLEND_MODE_OPAQUE;
+            else if (strcmp(value, "alpha") == 0)
+                key->blend_mode = BLEND_MODE_ALPHA;
+            else if (strcmp(value, "additive") == 0)
+                key->blend_mode = BLEND_MODE_ADDITIVE;
+            else
+                return false;
+        }
+        else if (strcmp(tokens[i], "spec") == 0 && depth_mode != DEPTH_MODE_PREPASS && depth_mode != DEPTH_MODE_TEST)
+        {
+            memset(key->spec, 0, sizeof(key->spec));
+            key->spec_count = 0;
+
+            for (char *number = strtok(value, ","); number != NULL; number = strtok(NULL, ","))
+            {
+                if (key->spec_count == PIPELINE_MAX_SPEC_CONSTANTS)
+                {
+                    return false;
+                }
+                key->spec[key->spec_count++] = (uint32_t)strtoul(number, NULL, 10);
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Queues every permutation in the list and waits until the workers compiled them all
+void precompile_pipelines(App *app, const char *path)
+{
+    PipelineCache *pc = &app->pipelines;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        printf("Failed to open file: %s\n", path);
+        exit(37);
+    }
+
+    char line[256];
+    uint32_t line_number = 0;
+    uint32_t queued = 0;
+    double start = monotonic_ms();
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        PipelineKey key;
+
+        if (!parse_pipeline_key(app, line, &key))
+        {
+            printf("%s:%u: invalid pipeline permutation\n", path, line_number);
+            exit(37);
+        }
+
+        uint64_t hash = pipeline_key_hash(&key);
+        PipelineEntry *entry;
+
+        if (pipeline_find(pc, &key, hash) == NULL && (entry = pipeline_insert(pc, &key, hash)) != NULL)
+        {
+            pipeline_enqueue(pc, entry);
+            queued++;
+        }
+    }
+
+    fclose(file);
+
+    pthread_mutex_lock(&pc->mutex);
+    while (pc->queue_count != 0 || pc->active != 0)
+    {
+        pthread_cond_wait(&pc->idle, &pc->mutex);
+    }
+    pthread_mutex_unlock(&pc->mutex);
+
+    // Nothing was recorded yet, there is nothing to re-record
+    pc->seen_completed = atomic_load(&pc->completed);
+
+    printf("Pipeline cache: precompiled %u permutations in %.1f ms\n", queued, monotonic_ms() - start);
+}
+
+// The header lets a stale file from another driver or device be dropped before the driver sees it
+static bool pipeline_cache_data_valid(App *app, const uint8_t *data, size_t size)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(app->physical_device, &properties);
+
+    return size >= 16 + VK_UUID_SIZE &&
+           read_u32(data) >= 16 + VK_UUID_SIZE &&
+           read_u32(data + 4) == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           read_u32(data + 8) == properties.vendorID &&
+           read_u32(data + 12) == properties.deviceID &&
+           memcmp(data + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void create_pipeline_cache(App *app)
+{
+    PipelineCache *pc = &app->pipelines;
+    const char *path = app->config.pipeline_cache_path;
+    void *data = NULL;
+    size_t size = 0;
+
+    if (path != NULL)
+    {
+        FILE *file = fopen(path, "rb");
+
+        if (file != NULL)
+        {
+            fseek(file, 0, SEEK_END);
+            size = (size_t)ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            data = malloc(size);
+            if (data == NULL || fread(data, 1, size, file) != size || !pipeline_cache_data_valid(app, data, size))
+            {
+                printf("Pipeline cache: ignoring %s, it is unreadable or from another device or driver\n", path);
+                size = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = size,
+        .pInitialData = data,
+    };
+
+    if (vkCreatePipelineCache(app->device, &cache_info, &app->host_memory.callbacks, &pc->cache) != VK_SUCCESS)
+    {
+        printf("failed to create pipeline cache!\n");
+        exit(37);
+    }
+
+    pc->loaded_bytes = size;
+    free(data);
+
+    // Kept for the whole run, background compiles may need them at any time
+    for (uint32_t i = 0; i < pipeline_shader_count; i++)
+    {
+        if ((i == PIPELINE_SHADER_PARTICLES && app->config.particle_count == 0) ||
+            (i == PIPELINE_SHADER_MESH && app->config.mesh_path == NULL))
+        {
+            continue;
+        }
+
+        size_t scratch_mark = app->frame_arena.used;
+        ShaderFile vert_file = {0};
+        ShaderFile frag_file = {0};
+        read_file(pipeline_shaders[i].vert_path, &vert_file, &app->frame_arena);
+        read_file(pipeline_shaders[i].frag_path, &frag_file, &app->frame_arena);
+
+        pc->vert_modules[i] = create_shader_module(app, &vert_file);
+        pc->frag_modules[i] = create_shader_module(app, &frag_file);
+        arena_release(&app->frame_arena, scratch_mark);
+    }
+
+    pthread_mutex_init(&pc->mutex, NULL);
+    pthread_cond_init(&pc->cond, NULL);
+    pthread_cond_init(&pc->idle, NULL);
+
+    for (uint32_t i = 0; i < PIPELINE_COMPILE_THREADS; i++)
+    {
+        if (pthread_create(&pc->threads[i], NULL, pipeline_compile_worker, app) != 0)
+        {
+            printf("failed to start pipeline compile thread!\n");
+            exit(37);
+        }
+    }
+}
+
+// Runs after the device is idle
+void destroy_pipeline_cache(App *app)
+{
+    PipelineCache *pc = &app->pipelines;
+
+    pthread_mutex_lock(&pc->mutex);
+    pc->stop = true;
+    pthread_cond_broadcast(&pc->cond);
+    pthread_mutex_unlock(&pc->mutex);
+
+    for (uint32_t i = 0; i < PIPELINE_COMPILE_THREADS; i++)
+    {
+        pthread_join(pc->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pc->idle);
+    pthread_cond_destroy(&pc->cond);
+    pthread_mutex_destroy(&pc->mutex);
+
+    for (uint32_t i = 0; i < PIPELINE_CACHE_CAPACITY; i++)
+    {
+        if (atomic_load(&pc->entries[i].state) == PIPELINE_READY)
+        {
+            vkDestroyPipeline(app->device, pc->entries[i].pipeline, &app->host_memory.callbacks);
+        }
+    }
+
+    for (uint32_t i = 0; i < pipeline_shader_count; i++)
+    {
+        vkDestroyShaderModule(app->device, pc->vert_modules[i], &app->host_memory.callbacks);
+        vkDestroyShaderModule(app->device, pc->frag_modules[i], &app->host_memory.callbacks);
+    }
+
+    size_t size = 0;
+    void *data = NULL;
+
+    // Written next to the target and renamed over it, so an interrupted run never leaves half a file
+    if (app->config.pipeline_cache_path != NULL &&
+        vkGetPipelineCacheData(app->device, pc->cache, &size, NULL) == VK_SUCCESS &&
+        (data = malloc(size)) != NULL &&
+        vkGetPipelineCacheData(app->device, pc->cache, &size, data) == VK_SUCCESS)
+    {
+        char temp_path[PATH_MAX];
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", app->config.pipeline_cache_path);
+
+        FILE *file = fopen(temp_path, "wb");
+        bool written = file != NULL && fwrite(data, 1, size, file) == size;
+
+        if (file != NULL && fclose(file) != 0)
+        {
+            written = false;
+        }
+
+        if (!written || rename(temp_path, app->config.pipeline_cache_path) != 0)
+        {
+            printf("Pipeline cache: failed to write %s\n", app->config.pipeline_cache_path);
+            size = 0;
+        }
+    }
+    free(data);
+
+    vkDestroyPipelineCache(app->device, pc->cache, &app->host_memory.callbacks);
+
+    printf("Pipeline cache: %u permutations, %" PRIu64 " compiled (%" PRIu64 " failed, %.1f ms average, %.1f ms max), "
+           "%" PRIu64 " lookups hit, %" PRIu64 " missed, %" PRIu64 " draws recorded with a fallback, %zu bytes loaded, %zu saved\n",
+           pc->entry_count, pc->compiles, pc->failures, pc->compiles > 0 ? pc->compile_ms / pc->compiles : 0.0,
+           pc->compile_max_ms, pc->hits, pc->misses, pc->fallback_draws, pc->loaded_bytes, size);
+}
+
+// The particle quads: read only depth, no culling, additively blended
+PipelineKey particle_pipeline_key(void)
+{
+    PipelineKey key;
+    memset(&key, 0, sizeof(key));
+
+    key.shader = PIPELINE_SHADER_PARTICLES;
+    key.depth_mode = DEPTH_MODE_TEST;
+    key.cull_mode = VK_CULL_MODE_NONE;
+    key.front_face = VK_FRONT_FACE_CLOCKWISE;
+    key.blend_mode = BLEND_MODE_ADDITIVE;
+
+    return key;
+}
+
+// Buffers, descriptor sets and the graphics set layout. Runs before the pipeline layout is
+// created, the compute pipelines follow in create_particle_pipelines.
+void create_particle_system(App *app)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (app->config.particle_count == 0)
+    {
+        return;
+    }
+
+    ps->enabled = true;
+    ps->capacity = app->config.particle_count;
+
+    // Simulation and draw share the graphics queue, which has to do compute as well
+    QueueFamilyIndices indices = find_queue_families(app->physical_device, app->surface);
+    VkQueueFamilyProperties families[MAX_QUEUE_FAMILIES];
+    uint32_t family_count = MAX_QUEUE_FAMILIES;
+    vkGetPhysicalDeviceQueueFamilyProperties(app->physical_device, &family_count, families);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(app->physical_device, &properties);
+
+    if (!(families[indices.graphics_family].queueFlags & VK_QUEUE_COMPUTE_BIT) ||
+        (ps->capacity + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE > properties.limits.maxComputeWorkGroupCount[0])
+    {
+        printf("particles need a compute capable graphics queue and at most %u particles!\n",
+               properties.limits.maxComputeWorkGroupCount[0] * PARTICLE_GROUP_SIZE);
+        exit(38);
+    }
+
+    VkDeviceSize index_size = (VkDeviceSize)ps->capacity * sizeof(uint32_t);
+
+    create_buffer(app, (VkDeviceSize)ps->capacity * PARTICLE_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &ps->particles, &ps->particles_memory, NULL);
+    create_buffer(app, index_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &ps->dead_list, &ps->dead_list_memory, NULL);
+    create_buffer(app, index_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &ps->draw_list, &ps->draw_list_memory, NULL);
+    create_buffer(app, sizeof(ParticleState), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                  0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &ps->state, &ps->state_memory, NULL);
+
+    // Rewritten every frame after the fence, the only per-frame CPU work
+    create_buffer(app, sizeof(ParticleParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 0,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  &ps->params, &ps->params_memory, NULL);
+
+    if (vkMapMemory(app->device, ps->params_memory, 0, sizeof(ParticleParams), 0, (void**)&ps->params_mapped) != VK_SUCCESS)
+    {
+        printf("failed to map particle parameters!\n");
+        exit(26);
+    }
+
+    VkDescriptorSetLayoutBinding compute_bindings[5] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 2, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 3, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 4, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+
+    VkDescriptorSetLayoutBinding draw_bindings[2] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_VERTEX_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_VERTEX_BIT },
+    };
+
+    VkDescriptorSetLayoutCreateInfo compute_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 5,
+        .pBindings = compute_bindings,
+    };
+
+    VkDescriptorSetLayoutCreateInfo draw_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings = draw_bindings,
+    };
+
+    VkDescriptorPoolSize pool_sizes[2] = {
+        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = 1 },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 6 },
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = 2,
+        .poolSizeCount = 2,
+        .pPoolSizes = pool_sizes,
+    };
+
+    if (vkCreateDescriptorSetLayout(app->device, &compute_layout_info, &app->host_memory.callbacks, &ps->compute_set_layout) != VK_SUCCESS ||
+        vkCreateDescriptorSetLayout(app->device, &draw_layout_info, &app->host_memory.callbacks, &ps->draw_set_layout) != VK_SUCCESS ||
+        vkCreateDescriptorPool(app->device, &pool_info, &app->host_memory.callbacks, &ps->descriptor_pool) != VK_SUCCESS)
+    {
+        printf("failed to create particle descriptors!\n");
+        exit(38);
+    }
+
+    VkDescriptorSetLayout set_layouts[2] = { ps->compute_set_layout, ps->draw_set_layout };
+    VkDescriptorSet sets[2];
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = ps->descriptor_pool,
+        .descriptorSetCount = 2,
+        .pSetLayouts = set_layouts,
+    };
+
+    if (vkAllocateDescriptorSets(app->device, &set_info, sets) != VK_SUCCESS)
+    {
+        printf("failed to allocate particle descriptor sets!\n");
+        exit(38);
+    }
+
+    ps->compute_set = sets[0];
+    ps->draw_set = sets[1];
+
+    VkDescriptorBufferInfo buffer_infos[5] = {
+        { ps->params, 0, VK_WHOLE_SIZE },
+        { ps->particles, 0, VK_WHOLE_SIZE },
+        { ps->dead_list, 0, VK_WHOLE_SIZE },
+        { ps->draw_list, 0, VK_WHOLE_SIZE },
+        { ps->state, 0, VK_WHOLE_SIZE },
+    };
+
+    VkWriteDescriptorSet writes[7];
+
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        writes[i] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = ps->compute_set,
+            .dstBinding = i,
+            .descriptorCount = 1,
+            .descriptorType = compute_bindings[i].descriptorType,
+            .pBufferInfo = &buffer_infos[i],
+        };
+    }
+
+    // The vertex shader reads the particles through the compacted draw list
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        writes[5 + i] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = ps->draw_set,
+            .dstBinding = i,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &buffer_infos[i == 0 ? 1 : 3],
+        };
+    }
+
+    vkUpdateDescriptorSets(app->device, 7, writes, 0, NULL);
+
+    *ps->params_mapped = (ParticleParams){
+        .emitter = { 0.0f, 0.8f, 0.0f, 0.4f },
+        .gravity = { 0.0f, 0.6f, 0.0f, PARTICLE_LIFETIME },
+        .capacity = ps->capacity,
+    };
+
+    // Steady state is a full pool: every particle respawns once per lifetime on average
+    ps->emit_rate = ps->capacity / PARTICLE_LIFETIME;
+
+    // Frames render continuously while particles move
+    begin_animation(app);
+}
+
+// One compute pipeline per kernel, then the free list is filled on the GPU once
+void create_particle_pipelines(App *app)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (!ps->enabled)
+    {
+        return;
+    }
+
+    VkPipelineLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &ps->compute_set_layout,
+    };
+
+    if (vkCreatePipelineLayout(app->device, &layout_info, &app->host_memory.callbacks, &ps->compute_layout) != VK_SUCCESS)
+    {
+        printf("failed to create pipeline layout!\n");
+        exit(11);
+    }
+
+    size_t scratch_mark = app->frame_arena.used;
+    ShaderFile comp_file = {0};
+    read_file("shaders/particle_comp.spv", &comp_file, &app->frame_arena);
+    VkShaderModule comp_module = create_shader_module(app, &comp_file);
+    arena_release(&app->frame_arena, scratch_mark);
+
+    uint32_t kernels[PARTICLE_KERNEL_COUNT];
+    VkSpecializationMapEntry spec_entry = { .constantID = 0, .offset = 0, .size = sizeof(uint32_t) };
+    VkSpecializationInfo spec_infos[PARTICLE_KERNEL_COUNT];
+    VkComputePipelineCreateInfo pipeline_infos[PARTICLE_KERNEL_COUNT];
+
+    for (uint32_t i = 0; i < PARTICLE_KERNEL_COUNT; i++)
+    {
+        kernels[i] = i;
+        spec_infos[i] = (VkSpecializationInfo){
+            .mapEntryCount = 1,
+            .pMapEntries = &spec_entry,
+            .dataSize = sizeof(uint32_t),
+            .pData = &kernels[i],
+        };
+        pipeline_infos[i] = (VkComputePipelineCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = comp_module,
+                .pName = "main",
+                .pSpecializationInfo = &spec_infos[i],
+            },
+            .layout = ps->compute_layout,
+            .basePipelineIndex = -1,
+        };
+    }
+
+    if (vkCreateComputePipelines(app->device, app->pipelines.cache, PARTICLE_KERNEL_COUNT, pipeline_infos,
+                                 &app->host_memory.callbacks, ps->kernels) != VK_SUCCESS)
+    {
+        printf("failed to create particle compute pipelines!\n");
+        exit(13);
+    }
+
+    vkDestroyShaderModule(app->device, comp_module, &app->host_memory.callbacks);
+
+    VkCommandBufferAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = app->commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    VkCommandBuffer command_buffer;
+
+    if (vkAllocateCommandBuffers(app->device, &alloc_info, &command_buffer) != VK_SUCCESS)
+    {
+        printf("failed to allocate command buffers!\n");
+        exit(16);
+    }
+
+    vkBeginCommandBuffer(command_buffer, &begin_info);
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->kernels[PARTICLE_KERNEL_INIT]);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->compute_layout, 0, 1, &ps->compute_set, 0, NULL);
+    vkCmdDispatch(command_buffer, (ps->capacity + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE, 1, 1);
+    vkEndCommandBuffer(command_buffer);
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &command_buffer,
+    };
+
+    if (vkQueueSubmit(app->graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        printf("failed to submit particle initialization!\n");
+        exit(20);
+    }
+
+    vkQueueWaitIdle(app->graphics_queue);
+    vkFreeCommandBuffers(app->device, app->commandPool, 1, &command_buffer);
+}
+
+void destroy_particle_system(App *app)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (!ps->enabled)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < PARTICLE_KERNEL_COUNT; i++)
+    {
+        vkDestroyPipeline(app->device, ps->kernels[i], &app->host_memory.callbacks);
+    }
+
+    vkDestroyPipelineLayout(app->device, ps->compute_layout, &app->host_memory.callbacks);
+    vkDestroyDescriptorPool(app->device, ps->descriptor_pool, &app->host_memory.callbacks);
+    vkDestroyDescriptorSetLayout(app->device, ps->compute_set_layout, &app->host_memory.callbacks);
+    vkDestroyDescriptorSetLayout(app->device, ps->draw_set_layout, &app->host_memory.callbacks);
+
+    vkUnmapMemory(app->device, ps->params_memory);
+
+    VkBuffer buffers[5] = { ps->particles, ps->dead_list, ps->draw_list, ps->state, ps->params };
+    VkDeviceMemory memories[5] = { ps->particles_memory, ps->dead_list_memory, ps->draw_list_memory,
+                                   ps->state_memory, ps->params_memory };
+
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        vkDestroyBuffer(app->device, buffers[i], &app->host_memory.callbacks);
+        vkFreeMemory(app->device, memories[i], &app->host_memory.callbacks);
+    }
+
+    printf("Particles: %u capacity, %" PRIu64 " emitted\n", ps->capacity, ps->emitted);
+}
+
+// Advances the parameters the cached command buffers read. Headless runs step a fixed
+// 1/60 s so their output doesn't depend on how fast they render.
+void update_particles(App *app)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (!ps->enabled)
+    {
+        return;
+    }
+
+    double now = monotonic_ms();
+    float dt = app->config.headless || ps->last_update_ms == 0.0 ? 1.0f / 60.0f : (float)((now - ps->last_update_ms) / 1000.0);
+    ps->last_update_ms = now;
+
+    // Long stalls would otherwise launch a single burst of particles
+    if (dt > 0.1f)
+    {
+        dt = 0.1f;
+    }
+
+    // Fractional particles carry over so low rates still emit
+    ps->emit_accumulator += ps->emit_rate * dt;
+    uint32_t emit_count = (uint32_t)ps->emit_accumulator;
+    ps->emit_accumulator -= emit_count;
+    ps->emitted += emit_count;
+
+    ps->params_mapped->dt = dt;
+    ps->params_mapped->frame = (uint32_t)app->frame_number;
+    ps->params_mapped->emit_count = emit_count;
+}
+
+static void particle_barrier(VkCommandBuffer commandBuffer, VkAccessFlags dst_access, VkPipelineStageFlags dst_stage)
+{
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = dst_access,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dst_stage, 0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+// Recorded before the render pass. The dispatch sizes only depend on the capacity or come from
+// the GPU itself, so the cached command buffers never need re-recording for the simulation.
+void record_particle_simulation(App *app, VkCommandBuffer commandBuffer)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (!ps->enabled)
+    {
+        return;
+    }
+
+    VkAccessFlags compute_access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->compute_layout, 0, 1, &ps->compute_set, 0, NULL);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->kernels[PARTICLE_KERNEL_PREPARE]);
+    vkCmdDispatch(commandBuffer, 1, 1, 1);
+    particle_barrier(commandBuffer, compute_access | VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->kernels[PARTICLE_KERNEL_EMIT]);
+    vkCmdDispatchIndirect(commandBuffer, ps->state, offsetof(ParticleState, emit));
+    particle_barrier(commandBuffer, compute_access, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ps->kernels[PARTICLE_KERNEL_INTEGRATE]);
+    vkCmdDispatch(commandBuffer, (ps->capacity + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE, 1, 1);
+    particle_barrier(commandBuffer, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+                     VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+}
+
+// Inside the render pass after the scene, one quad per live particle
+void record_particle_draw(App *app, VkCommandBuffer commandBuffer, uint32_t slot)
+{
+    ParticleSystem *ps = &app->particles;
+
+    if (!ps->enabled)
+    {
+        return;
+    }
+
+    PipelineKey key = particle_pipeline_key();
+
+    query_scope_begin(app, commandBuffer, slot, QUERY_SCOPE_PARTICLES);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_get(app, &key));
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, app->pipeline_layout, 1, 1, &ps->draw_set, 0, NULL);
+    vkCmdDrawIndirect(commandBuffer, ps->state, offsetof(ParticleState, draw), 1, sizeof(VkDrawIndirectCommand));
+    query_scope_end(app, commandBuffer, slot, QUERY_SCOPE_PARTICLES);
+}
+
+// count elements of size bytes at offset lie inside the file, without overflowing on hostile headers
+static bool mesh_section_fits(uint64_t offset, uint64_t count, uint64_t size, size_t file_size)
+{
+    return offset <= file_size && count <= (file_size - offset) / size;
+}
+
+// Maps a mesh file written by tools/meshconv and uploads its vertex and index sections with a
+// single copy from the mapping into a staging buffer. Only the header and the meshlet and LOD
+// tables are checked, indices are trusted like the rest of the data so that loading stays
+// bound by I/O.
+void load_mesh(App *app, const char *path)
+{
+    Mesh *mesh = &app->mesh;
+    double start_ms = monotonic_ms();
+
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(MeshHeader))
+    {
+        printf("failed to open mesh %s!\n", path);
+        exit(40);
+    }
+
+    size_t file_size = (size_t)file_stat.st_size;
+    uint8_t *file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED)
+    {
+        printf("failed to map mesh %s!\n", path);
+        exit(40);
+    }
+
+    // Read front to back once, let the kernel read ahead aggressively
+    madvise(file, file_size, MADV_SEQUENTIAL);
+
+    const MeshHeader *header = (const MeshHeader *)file;
+    uint64_t index_size = header->flags & MESH_FLAG_INDEX32 ? sizeof(uint32_t) : sizeof(uint16_t);
+
+    if (header->magic != MESH_MAGIC || header->version != MESH_VERSION)
+    {
+        printf("%s is not a version %u mesh file, convert it with tools/meshconv!\n", path, MESH_VERSION);
+        exit(40);
+    }
+
+    if (header->vertex_count == 0 || header->index_count == 0 || header->index_count % 3 != 0 ||
+        header->vertex_offset % MESH_SECTION_ALIGNMENT != 0 || header->index_offset % MESH_SECTION_ALIGNMENT != 0 ||
+        header->meshlet_offset % MESH_SECTION_ALIGNMENT != 0 || header->lod_offset % MESH_SECTION_ALIGNMENT != 0 ||
+        header->vertex_offset < sizeof(MeshHeader) || header->lod_count == 0 || header->lod_count > MESH_MAX_LODS ||
+        !mesh_section_fits(header->vertex_offset, header->vertex_count, sizeof(MeshVertex), header->index_offset) ||
+        !mesh_section_fits(header->index_offset, header->index_count, index_size, file_size) ||
+        !mesh_section_fits(header->meshlet_offset, header->meshlet_count, sizeof(MeshMeshlet), file_size) ||
+        !mesh_section_fits(header->lod_offset, header->lod_count, sizeof(MeshLod), file_size))
+    {
+        printf("mesh %s is truncated or has invalid sections!\n", path);
+        exit(40);
+    }
+
+    // Can't overflow, the index section fits inside the file
+    uint64_t index_end = header->index_offset + (uint64_t)header->index_count * index_size;
+
+    const MeshMeshlet *meshlets = (const MeshMeshlet *)(file + header->meshlet_offset);
+
+    for (uint32_t i = 0; i < header->meshlet_count; i++)
+    {
+        if (meshlets[i].first_index > header->index_count ||
+            (uint64_t)meshlets[i].triangle_count * 3 > header->index_count - meshlets[i].first_index)
+        {
+            printf("mesh %s has an invalid meshlet %u!\n", path, i);
+            exit(40);
+        }
+    }
+
+    const MeshLod *lods = (const MeshLod *)(file + header->lod_offset);
+
+    for (uint32_t i = 0; i < header->lod_count; i++)
+    {
+        const MeshLod *lod = &lods[i];
+        bool valid = lod->index_count > 0 && lod->index_count % 3 == 0 && lod->first_index <= header->index_count &&
+                     lod->index_count <= header->index_count - lod->first_index &&
+                     lod->first_meshlet <= header->meshlet_count && lod->meshlet_count <= header->meshlet_count - lod->first_meshlet &&
+                     lod->error >= 0.0f && (i == 0 || lod->error >= lods[i - 1].error);
+
+        // A level's meshlets are drawn in place of its indices, they may not reach into another level
+        for (uint32_t m = lod->first_meshlet; valid && m < lod->first_meshlet + lod->meshlet_count; m++)
+        {
+            valid = meshlets[m].first_index >= lod->first_index &&
+                    meshlets[m].first_index - lod->first_index + (uint64_t)meshlets[m].triangle_count * 3 <= lod->index_count;
+        }
+
+        if (!valid)
+        {
+            printf("mesh %s has an invalid LOD %u!\n", path, i);
+            exit(40);
+        }
+    }
+
+    *mesh = (Mesh){
+        .loaded = true,
+        .file = file,
+        .file_size = file_size,
+        .header = header,
+        .meshlets = meshlets,
+        .lods = lods,
+        .instance_count = app->config.mesh_grid * app->config.mesh_grid,
+        .index_offset = header->index_offset - header->vertex_offset,
+        .index_type = index_size == sizeof(uint32_t) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16,
+    };
+
+    // Vertices, padding and indices go up as one range
+    VkDeviceSize upload_size = index_end - header->vertex_offset;
+    VkBuffer staging;
+    VkDeviceMemory staging_memory;
+    void *staging_mapped;
+
+    create_buffer(app, upload_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 0,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  &staging, &staging_memory, NULL);
+    create_buffer(app, upload_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &mesh->buffer, &mesh->memory, NULL);
+
+    if (vkMapMemory(app->device, staging_memory, 0, upload_size, 0, &staging_mapped) != VK_SUCCESS)
+    {
+        printf("failed to map mesh staging memory!\n");
+        exit(40);
+    }
+
+    memcpy(staging_mapped, file + header->vertex_offset, upload_size);
+    vkUnmapMemory(app->device, staging_memory);
+
+    VkCommandBufferAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = app->commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    VkCommandBuffer command_buffer;
+
+    if (vkAllocateCommandBuffers(app->device, &alloc_info, &command_buffer) != VK_SUCCESS)
+    {
+        printf("failed to allocate command buffers!\n");
+        exit(16);
+    }
+
+    VkBufferCopy region = { .srcOffset = 0, .dstOffset = 0, .size = upload_size };
+
+    vkBeginCommandBuffer(command_buffer, &begin_info);
+    vkCmdCopyBuffer(command_buffer, staging, mesh->buffer, 1, &region);
+    vkEndCommandBuffer(command_buffer);
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &command_buffer,
+    };
+
+    if (vkQueueSubmit(app->graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        printf("failed to submit mesh upload!\n");
+        exit(20);
+    }
+
+    vkQueueWaitIdle(app->graphics_queue);
+    vkFreeCommandBuffers(app->device, app->commandPool, 1, &command_buffer);
+    vkDestroyBuffer(app->device, staging, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, staging_memory, &app->host_memory.callbacks);
+
+    // Fits the bounding sphere into the view, camera looking down -z. Depth spans [0, 1] over
+    // the sphere and y flips to Vulkan's downward axis.
+    float radius = header->radius > 0.0f ? header->radius : 1.0f;
+    const float axis_scale[3] = { 0.9f / radius, -0.9f / radius, -0.5f / radius };
+    const float axis_base[3] = { 0.0f, 0.0f, 0.5f };
+
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        float extent = header->bounds_max[axis] - header->bounds_min[axis];
+        mesh->transform.scale[axis] = extent / 65535.0f * axis_scale[axis];
+        mesh->transform.offset[axis] = (header->bounds_min[axis] - header->center[axis]) * axis_scale[axis] + axis_base[axis];
+    }
+
+    memset(mesh->instance_lods, 0xff, sizeof(mesh->instance_lods));
+    mesh->load_ms = monotonic_ms() - start_ms;
+
+    printf("Mesh %s: %u vertices, %u triangles in %u LODs, %u meshlets, %.1f MiB uploaded in %.1f ms (%.0f MiB/s)\n", path,
+           header->vertex_count, lods[0].index_count / 3, header->lod_count, header->meshlet_count, upload_size / 1048576.0,
+           mesh->load_ms, mesh->load_ms > 0.0 ? upload_size / 1048576.0 / (mesh->load_ms / 1000.0) : 0.0);
+}
+
+void destroy_mesh(App *app)
+{
+    Mesh *mesh = &app->mesh;
+
+    if (!mesh->loaded)
+    {
+        return;
+    }
+
+    printf("Mesh: loaded in %.1f ms, %" PRIu64 " meshlets drawn, %" PRIu64 " cone culled, %" PRIu64 " LOD switches\n", mesh->load_ms,
+           mesh->meshlets_drawn, mesh->meshlets_culled, mesh->lod_switches);
+
+    vkDestroyBuffer(app->device, mesh->buffer, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, mesh->memory, &app->host_memory.callbacks);
+    munmap(mesh->file, mesh->file_size);
+}
+
+// Opaque and back face culled, OBJ faces wind counter-clockwise
+PipelineKey mesh_pipeline_key(App *app)
+{
+    PipelineKey key = pipeline_default_key(app, DEPTH_MODE_LESS);
+
+    key.shader = PIPELINE_SHADER_MESH;
+    key.front_face = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    key.blend_mode = BLEND_MODE_OPAQUE;
+
+    return key;
+}
+
+// Copies sit on a grid, one per cell, each row further up drawn smaller as if further away.
+// Returns the copy's size relative to the full view, a single copy fills it.
+float mesh_instance_transform(App *app, uint32_t instance, MeshTransform *transform)
+{
+    Mesh *mesh = &app->mesh;
+    uint32_t grid = app->config.mesh_grid;
+    uint32_t column = instance % grid;
+    uint32_t row = instance / grid;
+    float scale = 1.0f / (grid * (1.0f + 3.0f * row / grid));
+
+    // load_mesh centers the bounding sphere here, cells move it in x and y
+    const float center[3] = { 0.0f, 0.0f, 0.5f };
+    const float cell[3] = { (2.0f * column + 1.0f) / grid - 1.0f, 1.0f - (2.0f * row + 1.0f) / grid, 0.0f };
+
+    *transform = mesh->transform;
+
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        transform->scale[axis] = mesh->transform.scale[axis] * scale;
+        transform->offset[axis] = (mesh->transform.offset[axis] - center[axis]) * scale + center[axis] + cell[axis];
+    }
+
+    return scale;
+}
+
+// Picks the coarsest level of each copy whose error, scaled by pixel_scale into pixels, stays
+// under threshold. A copy only leaves the level it was last drawn at, from current, once the
+// level's error is LOD_HYSTERESIS past the threshold, or a coarser one is that far below it,
+// so copies near a boundary don't pop back and forth. Returns the triangles the picked levels draw.
+uint32_t select_mesh_lods(App *app, const uint8_t *current, const float *pixel_scale, float threshold, uint8_t *lods)
+{
+    Mesh *mesh = &app->mesh;
+    uint32_t lod_count = mesh->header->lod_count;
+    uint32_t triangles = 0;
+
+    for (uint32_t i = 0; i < mesh->instance_count; i++)
+    {
+        uint32_t previous = current[i];
+        uint32_t lod = 0;
+
+        // Errors grow along the chain and level 0's is 0
+        for (uint32_t l = lod_count - 1; l > 0; l--)
+        {
+            if (mesh->lods[l].error * pixel_scale[i] <= threshold)
+            {
+                lod = l;
+                break;
+            }
+        }
+
+        if (previous != UINT8_MAX && lod > previous)
+        {
+            uint32_t coarser = previous;
+
+            for (uint32_t l = previous + 1; l <= lod; l++)
+            {
+                if (mesh->lods[l].error * pixel_scale[i] <= threshold / (1.0f + LOD_HYSTERESIS))
+                    coarser = l;
+            }
+            lod = coarser;
+        }
+        else if (previous != UINT8_MAX && lod < previous &&
+                 mesh->lods[previous].error * pixel_scale[i] <= threshold * (1.0f + LOD_HYSTERESIS))
+        {
+            lod = previous;
+        }
+
+        lods[i] = (uint8_t)lod;
+        triangles += mesh->lods[lod].index_count / 3;
+    }
+
+    return triangles;
+}
+
+// Inside the render pass after the scene. Each copy draws the level its projected error
+// allows; over the triangle budget, the threshold is raised until the levels fit, which
+// coarsens the smallest copies first. Meshlets whose normal cone faces away from the camera
+// are skipped, runs of the visible ones go out as one indexed draw.
+void record_mesh_draw(App *app, VkCommandBuffer commandBuffer, VkExtent2D extent, uint32_t slot)
+{
+    Mesh *mesh = &app->mesh;
+
+    if (!mesh->loaded)
+    {
+        return;
+    }
+
+    PipelineKey key = mesh_pipeline_key(app);
+    VkPipeline pipeline = pipeline_get(app, &key);
+
+    // The fallback can't read vertices, skip the mesh until the permutation is compiled and this is re-recorded
+    if (pipeline == app->pipelines.fallback[key.depth_mode])
+    {
+        return;
+    }
+
+    // Object units to pixels. The transform scales both axes alike, so the larger side is the worst case.
+    float radius = mesh->header->radius > 0.0f ? mesh->header->radius : 1.0f;
+    float pixels_per_unit = 0.9f / radius * (extent.width > extent.height ? extent.width : extent.height) * 0.5f;
+    MeshTransform transforms[MESH_MAX_INSTANCES];
+    float pixel_scale[MESH_MAX_INSTANCES];
+    uint8_t lods[MESH_MAX_INSTANCES];
+
+    for (uint32_t i = 0; i < mesh->instance_count; i++)
+    {
+        pixel_scale[i] = mesh_instance_transform(app, i, &transforms[i]) * pixels_per_unit;
+    }
+
+    // Outputs differ in size, so each keeps the levels its own copies were drawn at
+    uint8_t *current = mesh->instance_lods[slot_output(app, slot)];
+    float threshold = app->config.lod_pixels;
+    uint32_t budget = app->config.triangle_budget;
+    uint32_t triangles = select_mesh_lods(app, current, pixel_scale, threshold, lods);
+
+    if (budget > 0 && triangles > budget)
+    {
+        // Double until it fits or every copy sits at its coarsest level, then bisect
+        float low = threshold;
+        float high = threshold;
+        float coarsest = mesh->lods[mesh->header->lod_count - 1].error * pixels_per_unit * (1.0f + LOD_HYSTERESIS);
+
+        while (triangles > budget && high <= coarsest)
+        {
+            low = high;
+            high *= 2.0f;
+            triangles = select_mesh_lods(app, current, pixel_scale, high, lods);
+        }
+
+        for (uint32_t step = 0; step < 16 && triangles <= budget; step++)
+        {
+            float middle = (low + high) * 0.5f;
+
+            if (select_mesh_lods(app, current, pixel_scale, middle, lods) <= budget)
+                high = middle;
+            else
+                low = middle;
+        }
+
+        threshold = high;
+        triangles = select_mesh_lods(app, current, pixel_scale, threshold, lods);
+    }
+
+    VkDeviceSize vertex_offset = 0;
+
+    query_scope_begin(app, commandBuffer, slot, QUERY_SCOPE_MESH);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, app->pipeline_layout, 0, 1,
+                            &app->textures.descriptor_set, 0, NULL);
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mesh->buffer, &vertex_offset);
+    vkCmdBindIndexBuffer(commandBuffer, mesh->buffer, mesh->index_offset, mesh->index_type);
+
+    uint32_t drawn = 0;
+    uint32_t culled = 0;
+
+    for (uint32_t instance = 0; instance < mesh->instance_count; instance++)
+    {
+        const MeshLod *lod = &mesh->lods[lods[instance]];
+        uint32_t run_first = 0;
+        uint32_t run_count = 0;
+
+        if (lods[instance] != current[instance])
+        {
+            mesh->lod_switches += current[instance] != UINT8_MAX;
+            current[instance] = lods[instance];
+        }
+
+        vkCmdPushConstants(commandBuffer, app->pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(MeshTransform),
+                           &transforms[instance]);
+
+        for (uint32_t i = lod->first_meshlet; i < lod->first_meshlet + lod->meshlet_count; i++)
+        {
+            const MeshMeshlet *meshlet = &mesh->meshlets[i];
+
+            // Every triangle faces away when the view direction (0, 0, -1) lies inside the cone
+            if (-meshlet->cone_axis[2] > meshlet->cone_cutoff)
+            {
+                culled++;
+                continue;
+            }
+
+            if (run_count > 0 && run_first + run_count != meshlet->first_index)
+            {
+                vkCmdDrawIndexed(commandBuffer, run_count, 1, run_first, 0, 0);
+                run_count = 0;
+            }
+
+            run_first = run_count == 0 ? meshlet->first_index : run_first;
+            run_count += meshlet->triangle_count * 3;
+            drawn++;
+        }
+
+        if (run_count > 0)
+        {
+            vkCmdDrawIndexed(commandBuffer, run_count, 1, run_first, 0, 0);
+        }
+    }
+
+    query_scope_end(app, commandBuffer, slot, QUERY_SCOPE_MESH);
+
+    mesh->meshlets_drawn += drawn;
+    mesh->meshlets_culled += culled;
+    profiler_set_counter(app, "meshlets drawn", drawn);
+    profiler_set_counter(app, "meshlets culled", culled);
+    profiler_set_counter(app, "mesh triangles", triangles);
+    profiler_set_counter(app, "mesh lod pixels", threshold);
+}
+
+void *task_worker(void *arg)
+{
+    TaskPool *pool = (TaskPool*)arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;)
+    {
+        // Workers only join a run while it is open, so none is left over once task_pool_run returns
+        while ((pool->generation == seen || !pool->open) && !pool->stop)
+        {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+
+        if (pool->stop)
+        {
+            break;
+        }
+
+        seen = pool->generation;
+        pool->active++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        uint32_t done = 0;
+        for (uint32_t index = atomic_fetch_add(&pool->next, 1); index < pool->count; index = atomic_fetch_add(&pool->next, 1))
+        {
+            pool->function(pool->user, index);
+            done++;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->finished += done;
+        pool->active--;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+void task_pool_init(TaskPool *pool)
+{
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (uint32_t i = 0; i < TASK_THREAD_COUNT - 1; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, task_worker, pool) != 0)
+        {
+            printf("failed to start task thread!\n");
+            exit(39);
+        }
+    }
+}
+
+void task_pool_destroy(TaskPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < TASK_THREAD_COUNT - 1; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+// Runs function(user, index) for every index below count and returns once all are done.
+// The calling thread works too, a single task runs on it without waking anybody.
+void task_pool_run(TaskPool *pool, TaskFunction function, void *user, uint32_t count)
+{
+    if (count == 1)
+    {
+        function(user, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->function = function;
+    pool->user = user;
+    pool->count = count;
+    pool->finished = 0;
+    atomic_store(&pool->next, 0);
+    pool->generation++;
+    pool->open = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    uint32_t done = 0;
+    for (uint32_t index = atomic_fetch_add(&pool->next, 1); index < count; index = atomic_fetch_add(&pool->next, 1))
+    {
+        function(user, index);
+        done++;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->finished += done;
+    while (pool->finished < count || pool->active > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pool->open = false;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void create_draw_batcher(App *app)
+{
+    DrawBatcher *batcher = &app->batcher;
+
+    uint32_t slot_count = output_slot(app, app->config.output_count, 0);
+
+    create_buffer(app, (VkDeviceSize)slot_count * DRAW_LIST_MAX_INDIRECT * sizeof(VkDrawIndirectCommand),
+                  VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 0,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  &batcher->indirect, &batcher->indirect_memory, NULL);
+
+    if (vkMapMemory(app->device, batcher->indirect_memory, 0, VK_WHOLE_SIZE, 0, (void**)&batcher->indirect_mapped) != VK_SUCCESS)
+    {
+        printf("failed to map indirect draw buffer!\n");
+        exit(26);
+    }
+
+    task_pool_init(&batcher->tasks);
+
+    if (app->config.sort_check)
+    {
+        check_draw_sort(app);
+    }
+}
+
+void destroy_draw_batcher(App *app)
+{
+    DrawBatcher *batcher = &app->batcher;
+
+    task_pool_destroy(&batcher->tasks);
+
+    vkUnmapMemory(app->device, batcher->indirect_memory);
+    vkDestroyBuffer(app->device, batcher->indirect, &app->host_memory.callbacks);
+    vkFreeMemory(app->device, batcher->indirect_memory, &app->host_memory.callbacks);
+
+    printf("Draw lists: %" PRIu64 " draws in %" PRIu64 " calls (%s), %" PRIu64 " pipeline and %" PRIu64 " descriptor set binds, "
+           "%" PRIu64 " redundant binds skipped, %" PRIu64 " of %" PRIu64 " sorts parallel\n",
+           batcher->draws, batcher->calls, batcher->multi_draw ? "multi-draw" : "no multi-draw",
+           batcher->pipeline_binds, batcher->set_binds, batcher->skipped_binds, batcher->parallel_sorts, batcher->sorts);
+}
+
+// Most significant first: pass (4 bits), pipeline (12), material (16), depth (32). Depth is a
+// non-negative float, whose bits order like the value, flipped for back to front passes.
+uint64_t draw_sort_key(DrawPass pass, uint32_t pipeline_id, uint32_t material_id, float depth, bool back_to_front)
+{
+    uint32_t depth_bits = 0;
+
+    if (depth > 0.0f)
+    {
+        memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    }
+
+    if (back_to_front)
+    {
+        depth_bits = ~depth_bits;
+    }
+
+    return (uint64_t)(pass & 0xf) << 60 | (uint64_t)(pipeline_id & 0xfff) << 48 |
+           (uint64_t)(material_id & 0xffff) << 32 | depth_bits;
+}
+
+// Items live in the frame arena, lists are built while a command buffer is recorded
+void draw_list_begin(App *app, DrawList *list, uint32_t capacity)
+{
+    list->items = (DrawItem*)arena_alloc(&app->frame_arena, sizeof(DrawItem) * capacity);
+    list->count = 0;
+    list->capacity = capacity;
+}
+
+void draw_list_add(DrawList *list, const DrawItem *item)
+{
+    if (list->count == list->capacity)
+    {
+        printf("draw list full, %u draws!\n", list->capacity);
+        exit(39);
+    }
+
+    list->items[list->count++] = *item;
+}
+
+static void radix_histogram_task(void *user, uint32_t chunk)
+{
+    RadixSortJob *job = (RadixSortJob*)user;
+    uint32_t begin = chunk * job->chunk_size;
+    uint32_t end = begin + job->chunk_size < job->count ? begin + job->chunk_size : job->count;
+    uint32_t *histogram = job->histograms[chunk];
+
+    memset(histogram, 0, sizeof(job->histograms[chunk]));
+
+    for (uint32_t i = begin; i < end; i++)
+    {
+        histogram[(job->src[i].key >> job->shift) & 0xff]++;
+    }
+}
+
+// Each chunk writes its keys in order from the offsets its histogram was turned into, so the sort is stable
+static void radix_scatter_task(void *user, uint32_t chunk)
+{
+    RadixSortJob *job = (RadixSortJob*)user;
+    uint32_t begin = chunk * job->chunk_size;
+    uint32_t end = begin + job->chunk_size < job->count ? begin + job->chunk_size : job->count;
+    uint32_t *offsets = job->histograms[chunk];
+
+    for (uint32_t i = begin; i < end; i++)
+    {
+        job->dst[offsets[(job->src[i].key >> job->shift) & 0xff]++] = job->src[i];
+    }
+}
+
+// LSD radix sort over 8 bit digits. Long lists split every pass into one chunk per task thread.
+void radix_sort_draws(App *app, DrawSortEntry *entries, uint32_t count)
+{
+    DrawBatcher *batcher = &app->batcher;
+    size_t scratch_mark = app->frame_arena.used;
+    uint32_t chunk_count = count >= DRAW_SORT_PARALLEL_MIN ? TASK_THREAD_COUNT : 1;
+
+    RadixSortJob job = {
+        .src = entries,
+        .dst = (DrawSortEntry*)arena_alloc(&app->frame_arena, sizeof(DrawSortEntry) * count),
+        .count = count,
+        .chunk_count = chunk_count,
+        .chunk_size = (count + chunk_count - 1) / chunk_count,
+        .histograms = (uint32_t(*)[256])arena_alloc(&app->frame_arena, sizeof(uint32_t) * 256 * chunk_count),
+    };
+
+    for (job.shift = 0; job.shift < 64; job.shift += 8)
+    {
+        task_pool_run(&batcher->tasks, radix_histogram_task, &job, chunk_count);
+
+        // Digits every key shares, most of the pass, pipeline and material bytes, need no pass
+        uint32_t offset = 0;
+        bool shared = false;
+
+        for (uint32_t digit = 0; digit < 256 && !shared; digit++)
+        {
+            uint32_t total = 0;
+
+            for (uint32_t chunk = 0; chunk < chunk_count; chunk++)
+            {
+                total += job.histograms[chunk][digit];
+            }
+
+            shared = total == count;
+        }
+
+        if (shared)
+        {
+            continue;
+        }
+
+        for (uint32_t digit = 0; digit < 256; digit++)
+        {
+            for (uint32_t chunk = 0; chunk < chunk_count; chunk++)
+            {
+                uint32_t digit_count = job.histograms[chunk][digit];
+                job.histograms[chunk][digit] = offset;
+                offset += digit_count;
+            }
+        }
+
+        task_pool_run(&batcher->tasks, radix_scatter_task, &job, chunk_count);
+
+        DrawSortEntry *sorted = job.dst;
+        job.dst = job.src;
+        job.src = sorted;
+    }
+
+    if (job.src != entries)
+    {
+        memcpy(entries, job.src, sizeof(DrawSortEntry) * count);
+    }
+
+    batcher->sorts++;
+    if (chunk_count > 1)
+    {
+        batcher->parallel_sorts++;
+    }
+
+    arena_release(&app->frame_arena, scratch_mark);
+}
+
+static int compare_sort_entry(const void *a, const void *b)
+{
+    const DrawSortEntry *x = (const DrawSortEntry*)a, *y = (const DrawSortEntry*)b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Scenes never get near DRAW_SORT_PARALLEL_MIN, so sort generated keys on both sides of it and
+// compare with qsort. Few distinct pass and pipeline bytes skip passes like real keys do, and
+// few materials and depths make equal keys, which have to stay in index order.
+void check_draw_sort(App *app)
+{
+    DrawBatcher *batcher = &app->batcher;
+    const uint32_t counts[] = { 1, 37, DRAW_SORT_PARALLEL_MIN - 1, DRAW_SORT_PARALLEL_MIN, DRAW_SORT_PARALLEL_MIN * 4 + 3 };
+    const uint32_t max_count = DRAW_SORT_PARALLEL_MIN * 4 + 3;
+    uint64_t sorts = batcher->sorts, parallel_sorts = batcher->parallel_sorts;
+    uint32_t random = 0x2545f491;
+
+    DrawSortEntry *entries = (DrawSortEntry*)malloc(sizeof(DrawSortEntry) * max_count);
+    DrawSortEntry *reference = (DrawSortEntry*)malloc(sizeof(DrawSortEntry) * max_count);
+
+    if (entries == NULL || reference == NULL)
+    {
+        printf("failed to allocate draw sort check!\n");
+        exit(39);
+    }
+
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        uint32_t count = counts[c];
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t r[3];
+
+            for (uint32_t j = 0; j < 3; j++)
+            {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                r[j] = random;
+            }
+
+            entries[i].key = draw_sort_key((DrawPass)(r[0] % DRAW_PASS_COUNT), (r[0] >> 8) & 3, r[1] & 0x3f,
+                                           (float)(r[2] % 512) / 64.0f, r[1] >> 31);
+            entries[i].index = i;
+        }
+
+        memcpy(reference, entries, sizeof(DrawSortEntry) * count);
+        qsort(reference, count, sizeof(DrawSortEntry), compare_sort_entry);
+        radix_sort_draws(app, entries, count);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (entries[i].key != reference[i].key || entries[i].index != reference[i].index)
+            {
+                printf("draw sort check failed for %u keys at %u!\n", count, i);
+                exit(39);
+            }
+        }
+    }
+
+    uint32_t parallel = (uint32_t)(batcher->parallel_sorts - parallel_sorts);
+
+    if (parallel == 0)
+    {
+        printf("draw sort check never sorted in parallel!\n");
+        exit(39);
+    }
+
+    printf("Draw sort check: %u lists of up to %u keys match qsort, %u sorted in parallel\n",
+           (uint32_t)(sizeof(counts) / sizeof(counts[0])), max_count, parallel);
+
+    free(reference);
+    free(entries);
+
+    // Only count the sorts frames did
+    batcher->sorts = sorts;
+    batcher->parallel_sorts = parallel_sorts;
+}
+
+// Sorts the list and records it. Consecutive draws sharing pass, pipeline and material form a
+// run: instances that continue the previous draw fold into it, and a run that still needs
+// several draws goes out as one multi-draw indirect when the device has it.
+void draw_list_record(App *app, const DrawList *list, VkCommandBuffer commandBuffer, uint32_t slot)
+{
+    DrawBatcher *batcher = &app->batcher;
+    size_t scratch_mark = app->frame_arena.used;
+
+    DrawSortEntry *sorted = (DrawSortEntry*)arena_alloc(&app->frame_arena, sizeof(DrawSortEntry) * list->count);
+    VkDrawIndirectCommand *commands = (VkDrawIndirectCommand*)arena_alloc(&app->frame_arena, sizeof(VkDrawIndirectCommand) * list->count);
+
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        sorted[i] = (DrawSortEntry){ list->items[i].key, i };
+    }
+
+    radix_sort_draws(app, sorted, list->count);
+
+    // This slot's slice of the indirect buffer, the GPU is done with it after the fence
+    VkDrawIndirectCommand *indirect = batcher->indirect_mapped + slot * DRAW_LIST_MAX_INDIRECT;
+    uint32_t indirect_used = 0;
+
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    VkDescriptorSet bound_material = VK_NULL_HANDLE;
+    uint32_t pass = DRAW_PASS_COUNT;
+    uint64_t calls = 0;
+    uint64_t binds = 0;
+
+    for (uint32_t i = 0; i < list->count;)
+    {
+        const DrawItem *first = &list->items[sorted[i].index];
+        uint32_t run_pass = (uint32_t)(first->key >> 60);
+
+        if (run_pass != pass)
+        {
+            if (pass != DRAW_PASS_COUNT)
+            {
+                query_scope_end(app, commandBuffer, slot, draw_pass_scopes[pass]);
+            }
+            query_scope_begin(app, commandBuffer, slot, draw_pass_scopes[run_pass]);
+            pass = run_pass;
+        }
+
+        if (first->pipeline != bound_pipeline)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, first->pipeline);
+            bound_pipeline = first->pipeline;
+            batcher->pipeline_binds++;
+            binds++;
+        }
+        else
+        {
+            batcher->skipped_binds++;
+        }
+
+        if (first->material != bound_material)
+        {
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, app->pipeline_layout, 0, 1,
+                                    &first->material, 0, NULL);
+            bound_material = first->material;
+            batcher->set_binds++;
+            binds++;
+        }
+        else
+        {
+            batcher->skipped_binds++;
+        }
+
+        uint32_t command_count = 0;
+        uint32_t end = i;
+
+        for (; end < list->count; end++)
+        {
+            const DrawItem *item = &list->items[sorted[end].index];
+
+            if ((uint32_t)(item->key >> 60) != run_pass || item->pipeline != first->pipeline || item->material != first->material)
+            {
+                break;
+            }
+
+            VkDrawIndirectCommand *last = command_count > 0 ? &commands[command_count - 1] : NULL;
+
+            if (last != NULL && last->vertexCount == item->vertex_count && last->firstVertex == item->first_vertex &&
+                last->firstInstance + last->instanceCount == item->first_instance)
+            {
+                last->instanceCount += item->instance_count;
+            }
+            else
+            {
+                commands[command_count++] = (VkDrawIndirectCommand){
+                    .vertexCount = item->vertex_count,
+                    .instanceCount = item->instance_count,
+                    .firstVertex = item->first_vertex,
+                    .firstInstance = item->first_instance,
+                };
+            }
+        }
+
+        if (command_count > 1 && batcher->multi_draw && indirect_used + command_count <= DRAW_LIST_MAX_INDIRECT)
+        {
+            memcpy(indirect + indirect_used, commands, sizeof(VkDrawIndirectCommand) * command_count);
+            vkCmdDrawIndirect(commandBuffer, batcher->indirect,
+                              (slot * DRAW_LIST_MAX_INDIRECT + indirect_used) * sizeof(VkDrawIndirectCommand),
+                              command_count, sizeof(VkDrawIndirectCommand));
+            indirect_used += command_count;
+            calls++;
+        }
+        else
+        {
+            for (uint32_t c = 0; c < command_count; c++)
+            {
+                vkCmdDraw(commandBuffer, commands[c].vertexCount, commands[c].instanceCount,
+                          commands[c].firstVertex, commands[c].firstInstance);
+            }
+            calls += command_count;
+        }
+
+        i = end;
+    }
+
+    if (pass != DRAW_PASS_COUNT)
+    {
+        query_scope_end(app, commandBuffer, slot, draw_pass_scopes[pass]);
+    }
+
+    batcher->draws += list->count;
+    batcher->calls += calls;
+    profiler_set_counter(app, "draws per recording", list->count);
+    profiler_set_counter(app, "draw calls per recording", (double)calls);
+    profiler_set_counter(app, "state binds per recording", (double)binds);
+
+    arena_release(&app->frame_arena, scratch_mark);
+}
+
+void create_headless_targets(App *app)
+{
+    // Same format a typical surface would pick, so headless output matches windowed output
+    VkFormat format = VK_FORMAT_B8G8R8A8_SRGB;
+
+    app->swap_chain_image_count = HEADLESS_IMAGE_COUNT;
+    app->swap_chain_image_format = format;
+    app->swap_chain_extent = (VkExtent2D){ app->config.width, app->config.height };
+    app->present_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+    for (uint32_t i = 0; i < HEADLESS_IMAGE_COUNT; i++)
+    {
+        create_image(app, app->config.width, app->config.height, 1, VK_SAMPLE_COUNT_1_BIT, format,
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &app->swap_chain_images[i], &app->headless_memory[i]);
+    }
+}
+
+void destroy_headless_targets(App *app)
+{
+    for (uint32_t i = 0; i < HEADLESS_IMAGE_COUNT; i++)
+    {
+        vkDestroyImage(app->device, app->swap_chain_images[i], &app->host_memory.callbacks);
+        vkFreeMemory(app->device, app->headless_memory[i], &app->host_memory.callbacks);
+    }
+}
+
+void create_profiler(App *app)
+{
+    Profiler *profiler = &app->profiler;
+
+    profiler->pending_image = -1;
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(app->physical_device, &device_properties);
+
+    QueueFamilyIndices indices = find_queue_families(app->physical_device, app->surface);
+
+    uint32_t queue_family_count = MAX_QUEUE_FAMILIES;
+    VkQueueFamilyProperties queue_families[MAX_QUEUE_FAMILIES];
+    vkGetPhysicalDeviceQueueFamilyProperties(app->physical_device, &queue_family_count, queue_families);
+
+    uint32_t valid_bits = queue_families[indices.graphics_family].timestampValidBits;
+
+    if (valid_bits == 0)
+    {
+        printf("Graphics queue has no timestamp support, GPU profiling disabled.\n");
+        return;
+    }
+
+    profiler->timestamp_period = device_properties.limits.timestampPeriod;
+    profiler->timestamp_mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = app->swap_chain_image_count * 2,
+    };
+
+    if (vkCreateQueryPool(app->device, &pool_info, &app->host_memory.callbacks, &profiler->timestamp_pool) != VK_SUCCESS)
+    {
+        printf("failed to create timestamp query pool!\n");
+        exit(29);
+    }
+
+    profiler->enabled = true;
+}
+
+void destroy_profiler(App *app)
+{
+    if (app->profiler.enabled)
+    {
+        vkDestroyQueryPool(app->device, app->profiler.timestamp_pool, &app->host_memory.callbacks);
+    }
+}
+
+void profiler_begin(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    if (!app->profiler.enabled)
+    {
+        return;
+    }
+
+    vkCmdResetQueryPool(commandBuffer, app->profiler.timestamp_pool, imageIndex * 2, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, app->profiler.timestamp_pool, imageIndex * 2);
+}
+
+void profiler_end(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    if (!app->profiler.enabled)
+    {
+        return;
+    }
+
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, app->profiler.timestamp_pool, imageIndex * 2 + 1);
+}
+
+// Must only be called once the in-flight fence covering the pending image has signaled
+void profiler_collect(App *app)
+{
+    Profiler *profiler = &app->profiler;
+
+    if (!profiler->enabled || profiler->pending_image < 0)
+    {
+        return;
+    }
+
+    uint64_t timestamps[2];
+
+    if (vkGetQueryPoolResults(app->device, profiler->timestamp_pool, (uint32_t)profiler->pending_image * 2, 2,
+                              sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+    {
+        uint64_t ticks = (timestamps[1] - timestamps[0]) & profiler->timestamp_mask;
+
+        profiler->last_gpu_ms = (double)ticks * profiler->timestamp_period / 1e6;
+        profiler->samples_ms[profiler->sample_count % PROFILER_MAX_SAMPLES] = profiler->last_gpu_ms;
+        profiler->sample_count++;
+    }
+
+    profiler->pending_image = -1;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void profiler_report(App *app)
+{
+    Profiler *profiler = &app->profiler;
+
+    for (uint32_t i = 0; i < profiler->counter_count; i++)
+    {
+        printf("Counter %s: last %.2f, peak %.2f\n", profiler->counters[i].name,
+               profiler->counters[i].value, profiler->counters[i].peak);
+    }
+
+    if (!profiler->enabled || profiler->sample_count == 0)
+    {
+        return;
+    }
+
+    uint32_t count = profiler->sample_count < PROFILER_MAX_SAMPLES ? profiler->sample_count : PROFILER_MAX_SAMPLES;
+    double sorted[PROFILER_MAX_SAMPLES];
+    double total = 0.0;
+
+    memcpy(sorted, profiler->samples_ms, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_double);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        total += sorted[i];
+    }
+
+    // Parsed by tests/run_golden.sh, keep the format stable
+    printf("GPU frame time: median %.4f ms, mean %.4f ms, p95 %.4f ms, max %.4f ms over %u frames\n",
+           sorted[count / 2], total / count, sorted[(count * 95) / 100], sorted[count - 1], count);
+}
+
+// In result order, which follows the bit order
+static const VkQueryPipelineStatisticFlags query_statistics_flags =
+    VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+    VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+    VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT |
+    VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+    VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+void create_query_stats(App *app)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (!qs->enabled)
+    {
+        return;
+    }
+
+    VkQueryPoolCreateInfo statistics_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+        .queryCount = app->swap_chain_image_count * QUERY_SCOPE_COUNT,
+        .pipelineStatistics = query_statistics_flags,
+    };
+
+    VkQueryPoolCreateInfo occlusion_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_OCCLUSION,
+        .queryCount = app->swap_chain_image_count * QUERY_SCOPE_COUNT,
+    };
+
+    if (vkCreateQueryPool(app->device, &statistics_info, &app->host_memory.callbacks, &qs->statistics_pool) != VK_SUCCESS ||
+        vkCreateQueryPool(app->device, &occlusion_info, &app->host_memory.callbacks, &qs->occlusion_pool) != VK_SUCCESS)
+    {
+        printf("failed to create query pool!\n");
+        exit(29);
+    }
+}
+
+void destroy_query_stats(App *app)
+{
+    if (app->query_stats.enabled)
+    {
+        vkDestroyQueryPool(app->device, app->query_stats.statistics_pool, &app->host_memory.callbacks);
+        vkDestroyQueryPool(app->device, app->query_stats.occlusion_pool, &app->host_memory.callbacks);
+    }
+}
+
+// Recorded outside the render pass at the start of the image's command buffer
+void query_stats_reset(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (!qs->enabled)
+    {
+        return;
+    }
+
+    vkCmdResetQueryPool(commandBuffer, qs->statistics_pool, imageIndex * QUERY_SCOPE_COUNT, QUERY_SCOPE_COUNT);
+    vkCmdResetQueryPool(commandBuffer, qs->occlusion_pool, imageIndex * QUERY_SCOPE_COUNT, QUERY_SCOPE_COUNT);
+    qs->recorded_scopes[imageIndex] = 0;
+    qs->recorded_extent[imageIndex] = app->render_extent;
+}
+
+// Scopes must not nest, only one pipeline statistics query can be active at a time
+void query_scope_begin(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex, QueryScope scope)
+{
+    QueryStats *qs = &app->query_stats;
+
+    // Only the main output is measured, the extra windows record into slots past its images
+    if (!qs->enabled || imageIndex >= app->swap_chain_image_count)
+    {
+        return;
+    }
+
+    uint32_t query = imageIndex * QUERY_SCOPE_COUNT + scope;
+    vkCmdBeginQuery(commandBuffer, qs->statistics_pool, query, 0);
+    vkCmdBeginQuery(commandBuffer, qs->occlusion_pool, query, qs->precise ? VK_QUERY_CONTROL_PRECISE_BIT : 0);
+    qs->recorded_scopes[imageIndex] |= 1u << scope;
+}
+
+void query_scope_end(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex, QueryScope scope)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (!qs->enabled || imageIndex >= app->swap_chain_image_count)
+    {
+        return;
+    }
+
+    uint32_t query = imageIndex * QUERY_SCOPE_COUNT + scope;
+    vkCmdEndQuery(commandBuffer, qs->occlusion_pool, query);
+    vkCmdEndQuery(commandBuffer, qs->statistics_pool, query);
+}
+
+// Reads back every submitted image whose results are available, without waiting. The results
+// stay in the pool until the image's command buffer runs again, so they can be read late.
+void query_stats_collect(App *app)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (!qs->enabled)
+    {
+        return;
+    }
+
+    VkQueryResultFlags flags = VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT;
+
+    for (uint32_t image = 0; image < app->swap_chain_image_count; image++)
+    {
+        if (!qs->pending[image])
+        {
+            continue;
+        }
+
+        // Statistics followed by the availability word, likewise for the occlusion count
+        uint64_t statistics[QUERY_SCOPE_COUNT][QUERY_STATISTIC_COUNT + 1] = {0};
+        uint64_t occlusion[QUERY_SCOPE_COUNT][2] = {0};
+        bool available = true;
+
+        for (uint32_t scope = 0; scope < QUERY_SCOPE_COUNT && available; scope++)
+        {
+            if (!(qs->recorded_scopes[image] & (1u << scope)))
+            {
+                continue;
+            }
+
+            uint32_t query = image * QUERY_SCOPE_COUNT + scope;
+            vkGetQueryPoolResults(app->device, qs->statistics_pool, query, 1, sizeof(statistics[scope]),
+                                  statistics[scope], sizeof(statistics[scope]), flags);
+            vkGetQueryPoolResults(app->device, qs->occlusion_pool, query, 1, sizeof(occlusion[scope]),
+                                  occlusion[scope], sizeof(occlusion[scope]), flags);
+
+            available = statistics[scope][QUERY_STATISTIC_COUNT] != 0 && occlusion[scope][1] != 0;
+        }
+
+        if (!available)
+        {
+            continue;
+        }
+
+        uint64_t pixels = (uint64_t)qs->recorded_extent[image].width * qs->recorded_extent[image].height;
+
+        for (uint32_t scope = 0; scope < QUERY_SCOPE_COUNT; scope++)
+        {
+            if (!(qs->recorded_scopes[image] & (1u << scope)))
+            {
+                continue;
+            }
+
+            QueryScopeTotals *totals = &qs->totals[scope];
+            totals->frames++;
+            totals->pixels += pixels;
+            totals->samples += pixels * app->msaa_samples;
+            totals->input_primitives += statistics[scope][0];
+            totals->vertex_invocations += statistics[scope][1];
+            totals->clipping_invocations += statistics[scope][2];
+            totals->clipping_primitives += statistics[scope][3];
+            totals->fragment_invocations += statistics[scope][4];
+            totals->samples_passed += occlusion[scope][0];
+        }
+
+        qs->pending[image] = false;
+    }
+
+    query_stats_overlay(app);
+}
+
+static double ratio(uint64_t numerator, uint64_t denominator)
+{
+    return denominator > 0 ? (double)numerator / denominator : 0.0;
+}
+
+// Fragment shader invocations per pixel of the render area
+static double query_overdraw(const QueryScopeTotals *totals)
+{
+    return ratio(totals->fragment_invocations, totals->pixels);
+}
+
+// Share of primitives reaching the clipper that were discarded there
+static double query_clipped(const QueryScopeTotals *totals)
+{
+    return 1.0 - ratio(totals->clipping_primitives, totals->clipping_invocations);
+}
+
+// Share of shaded fragments that then failed the depth test, the fragment work that was wasted.
+// Only meaningful for scopes with a fragment shader and with precise occlusion queries.
+static double query_wasted(const QueryScopeTotals *totals, uint32_t samples)
+{
+    if (totals->fragment_invocations == 0)
+    {
+        return 0.0;
+    }
+
+    return 1.0 - ratio(totals->samples_passed, totals->fragment_invocations * samples);
+}
+
+// Publishes the numbers since the last update as profiler counters and, with a window, in its title
+void query_stats_overlay(App *app)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (app->frame_number == 0 || app->frame_number % QUERY_OVERLAY_INTERVAL != 0)
+    {
+        return;
+    }
+
+    char title[256];
+    int length = snprintf(title, sizeof(title), "test");
+
+    for (uint32_t scope = 0; scope < QUERY_SCOPE_COUNT; scope++)
+    {
+        QueryScopeTotals *totals = &qs->totals[scope];
+        QueryScopeTotals *base = &qs->overlay_base[scope];
+
+        if (totals->frames == base->frames)
+        {
+            continue;
+        }
+
+        QueryScopeTotals window = {
+            .frames = totals->frames - base->frames,
+            .pixels = totals->pixels - base->pixels,
+            .input_primitives = totals->input_primitives - base->input_primitives,
+            .clipping_invocations = totals->clipping_invocations - base->clipping_invocations,
+            .clipping_primitives = totals->clipping_primitives - base->clipping_primitives,
+            .fragment_invocations = totals->fragment_invocations - base->fragment_invocations,
+            .samples_passed = totals->samples_passed - base->samples_passed,
+        };
+        *base = *totals;
+
+        double overdraw = query_overdraw(&window);
+        double clipped = query_clipped(&window);
+        double wasted = query_wasted(&window, app->msaa_samples);
+        char name[32];
+
+        snprintf(name, sizeof(name), "%s overdraw", query_scope_names[scope]);
+        profiler_set_counter(app, name, overdraw);
+        snprintf(name, sizeof(name), "%s wasted %%", query_scope_names[scope]);
+        profiler_set_counter(app, name, wasted * 100.0);
+
+        if (length < (int)sizeof(title))
+        {
+            length += snprintf(title + length, sizeof(title) - length, " | %s: %.2fx overdraw, %.0f%% clipped, %.0f%% wasted",
+                               query_scope_names[scope], overdraw, clipped * 100.0, wasted * 100.0);
+        }
+    }
+
+    if (!app->config.headless)
+    {
+        glfwSetWindowTitle(app->window, title);
+    }
+}
+
+void query_stats_report(App *app)
+{
+    QueryStats *qs = &app->query_stats;
+
+    if (!qs->enabled)
+    {
+        return;
+    }
+
+    for (uint32_t scope = 0; scope < QUERY_SCOPE_COUNT; scope++)
+    {
+        QueryScopeTotals *totals = &qs->totals[scope];
+
+        if (totals->frames == 0)
+        {
+            continue;
+        }
+
+        printf("Scope %s: %.0f primitives, %.0f fragments per frame, %.2fx overdraw, %.1f%% clipped, %.1f%% of shaded fragments occluded\n",
+               query_scope_names[scope], ratio(totals->input_primitives, totals->frames),
+               ratio(totals->fragment_invocations, totals->frames), query_overdraw(totals),
+               query_clipped(totals) * 100.0, query_wasted(totals, app->msaa_samples) * 100.0);
+    }
+
+    if (app->config.query_json != NULL)
+    {
+        write_query_json(app, app->config.query_json);
+    }
+}
+
+void write_query_json(App *app, const char *path)
+{
+    QueryStats *qs = &app->query_stats;
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        printf("Failed to open file: %s\n", path);
+        return;
+    }
+
+    fprintf(file, "{\n  \"msaa_samples\": %u,\n  \"precise_occlusion\": %s,\n  \"scopes\": [",
+            (uint32_t)app->msaa_samples, qs->precise ? "true" : "false");
+
+    bool first = true;
+
+    for (uint32_t scope = 0; scope < QUERY_SCOPE_COUNT; scope++)
+    {
+        QueryScopeTotals *totals = &qs->totals[scope];
+
+        if (totals->frames == 0)
+        {
+            continue;
+        }
+
+        fprintf(file, "%s\n    {\n", first ? "" : ",");
+        fprintf(file, "      \"name\": \"%s\",\n", query_scope_names[scope]);
+        fprintf(file, "      \"frames\": %" PRIu64 ",\n", totals->frames);
+        fprintf(file, "      \"input_primitives\": %" PRIu64 ",\n", totals->input_primitives);
+        fprintf(file, "      \"vertex_invocations\": %" PRIu64 ",\n", totals->vertex_invocations);
+        fprintf(file, "      \"clipping_invocations\": %" PRIu64 ",\n", totals->clipping_invocations);
+        fprintf(file, "      \"clipping_primitives\": %" PRIu64 ",\n", totals->clipping_primitives);
+        fprintf(file, "      \"fragment_invocations\": %" PRIu64 ",\n", totals->fragment_invocations);
+        fprintf(file, "      \"samples_passed\": %" PRIu64 ",\n", totals->samples_passed);
+        fprintf(file, "      \"overdraw\": %.4f,\n", query_overdraw(totals));
+        fprintf(file, "      \"clipped_fraction\": %.4f,\n", query_clipped(totals));
+        fprintf(file, "      \"occluded_fraction\": %.4f\n", query_wasted(totals, app->msaa_samples));
+        fprintf(file, "    }");
+        first = false;
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
+
+// Counters are created on first use and kept until exit
+void profiler_set_counter(App *app, const char *name, double value)
+{
+    Profiler *profiler = &app->profiler;
+    uint32_t i = 0;
+
+    while (i < profiler->counter_count && strcmp(profiler->counters[i].name, name) != 0)
+        i++;
+
+    if (i == profiler->counter_count)
+    {
+        if (profiler->counter_count == PROFILER_MAX_COUNTERS)
+        {
+            return;
+        }
+
+        snprintf(profiler->counters[i].name, sizeof(profiler->counters[i].name), "%s", name);
+        profiler->counters[i].peak = value;
+        profiler->counter_count++;
+    }
+
+    profiler->counters[i].value = value;
+    if (value > profiler->counters[i].peak)
+    {
+        profiler->counters[i].peak = value;
+    }
+}
+
+void create_readback(App *app)
+{
+    Readback *rb = &app->readback;
+
+    rb->current_slot = -1;
+
+    if (app->config.capture_prefix == NULL && app->config.capture_stream == NULL)
+    {
+        return;
+    }
+
+    rb->enabled = true;
+    rb->yuv = app->config.capture_format >= CAPTURE_FORMAT_Y4M;
+    rb->width = app->swap_chain_extent.width;
+    rb->height = app->swap_chain_extent.height;
+    rb->format = app->swap_chain_image_format;
+    rb->size = (VkDeviceSize)rb->width * rb->height * 4;
+    rb->coherent = true;
+
+    VkBufferUsageFlags slot_usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+    if (rb->yuv)
+    {
+        // Chroma is subsampled 2x2 and the shader writes 8 luma bytes at a time, crop to what it covers
+        rb->width &= ~7u;
+        rb->height &= ~1u;
+
+        if (rb->width == 0 || rb->height == 0)
+        {
+            printf("Output is too small for YUV capture\n");
+            exit(42);
+        }
+
+        rb->format = app->config.capture_format == CAPTURE_FORMAT_NV12 ?
+                     VK_FORMAT_G8_B8R8_2PLANE_420_UNORM : VK_FORMAT_G8_B8_R8_3PLANE_420_UNORM;
+        rb->size = (VkDeviceSize)rb->width * rb->height * 3 / 2;
+        slot_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    }
+
+    // Persistently mapped, host cached where possible so the writer reads at memory speed
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        ReadbackSlot *slot = &rb->slots[i];
+        VkMemoryPropertyFlags actual;
+
+        create_buffer(app, rb->size, slot_usage,
+                      VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                      &slot->buffer, &slot->memory, &actual);
+
+        if (!(actual & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+        {
+            rb->coherent = false;
+        }
+
+        if (vkMapMemory(app->device, slot->memory, 0, VK_WHOLE_SIZE, 0, &slot->mapped) != VK_SUCCESS)
+        {
+            printf("failed to map readback buffer!\n");
+            exit(26);
+        }
+
+        slot->state = READBACK_FREE;
+
+        VkCommandBufferAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = app->commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+
+        if (vkAllocateCommandBuffers(app->device, &allocInfo, &slot->command_buffer) != VK_SUCCESS)
+        {
+            printf("failed to allocate command buffers!\n");
+            exit(16);
+        }
+    }
+
+    if (rb->yuv)
+    {
+        create_yuv_converter(app);
+    }
+
+    if (app->config.capture_stream != NULL)
+    {
+        // Opening a named pipe blocks until the consumer opens it for reading
+        rb->stream = fopen(app->config.capture_stream, "wb");
+
+        if (rb->stream == NULL)
+        {
+            printf("Failed to open capture stream: %s\n", app->config.capture_stream);
+            exit(42);
+        }
+
+        // A consumer that goes away shows up as a failed write instead of killing the process.
+        // Only pipes and sockets raise SIGPIPE, for anything else the disposition is left alone.
+        struct stat stream_stat;
+
+        if (fstat(fileno(rb->stream), &stream_stat) == 0 && (S_ISFIFO(stream_stat.st_mode) || S_ISSOCK(stream_stat.st_mode)))
+        {
+            signal(SIGPIPE, SIG_IGN);
+        }
+    }
+
+    if (rb->callback == NULL)
+    {
+        rb->callback = write_capture_file;
+        rb->callback_user = app;
+    }
+
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->cond, NULL);
+
+    if (pthread_create(&rb->thread, NULL, readback_writer, rb) != 0)
+    {
+        printf("failed to start readback writer thread!\n");
+        exit(27);
+    }
+}
+
+// Compute pass turning the copied image into 4:2:0 planes, one descriptor set per slot
+void create_yuv_converter(App *app)
+{
+    Readback *rb = &app->readback;
+
+    // Only the compute pass reads the full image, so it never has to leave the device
+    create_buffer(app, (VkDeviceSize)rb->width * rb->height * 4,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &rb->rgba, &rb->rgba_memory, NULL);
+
+    VkDescriptorSetLayoutBinding bindings[2] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings = bindings,
+    };
+
+    VkDescriptorPoolSize pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 2 * READBACK_RING_SIZE,
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = READBACK_RING_SIZE,
+        .poolSizeCount = 1,
+        .pPoolSizes = &pool_size,
+    };
+
+    if (vkCreateDescriptorSetLayout(app->device, &set_layout_info, &app->host_memory.callbacks, &rb->yuv_set_layout) != VK_SUCCESS ||
+        vkCreateDescriptorPool(app->device, &pool_info, &app->host_memory.callbacks, &rb->yuv_pool) != VK_SUCCESS)
+    {
+        printf("failed to create YUV descriptors!\n");
+        exit(42);
+    }
+
+    VkDescriptorSetLayout set_layouts[READBACK_RING_SIZE];
+    VkDescriptorSet sets[READBACK_RING_SIZE];
+
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        set_layouts[i] = rb->yuv_set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = rb->yuv_pool,
+        .descriptorSetCount = READBACK_RING_SIZE,
+        .pSetLayouts = set_layouts,
+    };
+
+    if (vkAllocateDescriptorSets(app->device, &set_info, sets) != VK_SUCCESS)
+    {
+        printf("failed to allocate YUV descriptor sets!\n");
+        exit(42);
+    }
+
+    VkDescriptorBufferInfo source_info = { rb->rgba, 0, VK_WHOLE_SIZE };
+
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        rb->slots[i].yuv_set = sets[i];
+
+        VkDescriptorBufferInfo planes_info = { rb->slots[i].buffer, 0, VK_WHOLE_SIZE };
+
+        VkWriteDescriptorSet writes[2] = {
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = sets[i],
+                .dstBinding = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &source_info,
+            },
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = sets[i],
+                .dstBinding = 1,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &planes_info,
+            },
+        };
+
+        vkUpdateDescriptorSets(app->device, 2, writes, 0, NULL);
+    }
+
+    VkPushConstantRange push_range = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(YuvParams),
+    };
+
+    VkPipelineLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &rb->yuv_set_layout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &push_range,
+    };
+
+    if (vkCreatePipelineLayout(app->device, &layout_info, &app->host_memory.callbacks, &rb->yuv_layout) != VK_SUCCESS)
+    {
+        printf("failed to create pipeline layout!\n");
+        exit(11);
+    }
+
+    size_t scratch_mark = app->frame_arena.used;
+    ShaderFile comp_file = {0};
+    read_file("shaders/yuv_comp.spv", &comp_file, &app->frame_arena);
+    VkShaderModule comp_module = create_shader_module(app, &comp_file);
+    arena_release(&app->frame_arena, scratch_mark);
+
+    VkComputePipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = comp_module,
+            .pName = "main",
+        },
+        .layout = rb->yuv_layout,
+        .basePipelineIndex = -1,
+    };
+
+    if (vkCreateComputePipelines(app->device, app->pipelines.cache, 1, &pipeline_info,
+                                 &app->host_memory.callbacks, &rb->yuv_pipeline) != VK_SUCCESS)
+    {
+        printf("failed to create YUV compute pipeline!\n");
+        exit(13);
+    }
+
+    vkDestroyShaderModule(app->device, comp_module, &app->host_memory.callbacks);
+}
+
+void destroy_readback(App *app)
+{
+    Readback *rb = &app->readback;
+
+    if (!rb->enabled)
+    {
+        return;
+    }
+
+    // The writer drains the queue before it exits
+    pthread_mutex_lock(&rb->mutex);
+    rb->stop = true;
+    pthread_cond_signal(&rb->cond);
+    pthread_mutex_unlock(&rb->mutex);
+    pthread_join(rb->thread, NULL);
+
+    pthread_cond_destroy(&rb->cond);
+    pthread_mutex_destroy(&rb->mutex);
+
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        vkUnmapMemory(app->device, rb->slots[i].memory);
+        vkDestroyBuffer(app->device, rb->slots[i].buffer, &app->host_memory.callbacks);
+        vkFreeMemory(app->device, rb->slots[i].memory, &app->host_memory.callbacks);
+    }
+
+    if (rb->yuv)
+    {
+        vkDestroyPipeline(app->device, rb->yuv_pipeline, &app->host_memory.callbacks);
+        vkDestroyPipelineLayout(app->device, rb->yuv_layout, &app->host_memory.callbacks);
+        vkDestroyDescriptorPool(app->device, rb->yuv_pool, &app->host_memory.callbacks);
+        vkDestroyDescriptorSetLayout(app->device, rb->yuv_set_layout, &app->host_memory.callbacks);
+        vkDestroyBuffer(app->device, rb->rgba, &app->host_memory.callbacks);
+        vkFreeMemory(app->device, rb->rgba_memory, &app->host_memory.callbacks);
+    }
+
+    if (rb->stream != NULL)
+    {
+        fclose(rb->stream);
+    }
+
+    printf("Readback: %" PRIu64 " frames written, %" PRIu64 " dropped\n", rb->written, rb->dropped);
+}
+
+void readback_set_callback(App *app, ReadbackCallback callback, void *user)
+{
+    app->readback.callback = callback;
+    app->readback.callback_user = user;
+}
+
+void readback_begin_frame(App *app)
+{
+    Readback *rb = &app->readback;
+
+    rb->current_slot = -1;
+
+    if (!rb->enabled)
+    {
+        return;
+    }
+
+    if (app->config.capture_frame >= 0 && (uint64_t)app->config.capture_frame != app->frame_number)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&rb->mutex);
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        if (rb->slots[i].state == READBACK_FREE)
+        {
+            rb->slots[i].state = READBACK_IN_FLIGHT;
+            rb->slots[i].frame_number = app->frame_number;
+            rb->current_slot = (int)i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rb->mutex);
+
+    // Never stall the render loop on a slow writer, skip the frame instead
+    if (rb->current_slot < 0)
+    {
+        rb->dropped++;
+    }
+
+    profiler_set_counter(app, "capture dropped", (double)rb->dropped);
+}
+
+// Must only be called once the in-flight fence covering the copies has signaled
+void readback_collect(App *app)
+{
+    Readback *rb = &app->readback;
+
+    if (!rb->enabled)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&rb->mutex);
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        ReadbackSlot *slot = &rb->slots[i];
+
+        if (slot->state != READBACK_IN_FLIGHT)
+        {
+            continue;
+        }
+
+        if (!rb->coherent)
+        {
+            VkMappedMemoryRange range = {
+                .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                .memory = slot->memory,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            };
+            vkInvalidateMappedMemoryRanges(app->device, 1, &range);
+        }
+
+        slot->state = READBACK_QUEUED;
+        rb->queue[(rb->queue_head + rb->queue_count) % READBACK_RING_SIZE] = i;
+        rb->queue_count++;
+    }
+    pthread_cond_signal(&rb->cond);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
+void record_readback(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+    Readback *rb = &app->readback;
+
+    if (rb->current_slot < 0)
+    {
+        return;
+    }
+
+    VkImageMemoryBarrier to_transfer = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .oldLayout = app->present_layout,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = app->swap_chain_images[imageIndex],
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    // The output was last written either by the render pass or by the upscale blit
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &to_transfer);
+
+    VkBufferImageCopy region = {
+        .bufferOffset = 0,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .imageSubresource.mipLevel = 0,
+        .imageSubresource.baseArrayLayer = 0,
+        .imageSubresource.layerCount = 1,
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {rb->width, rb->height, 1},
+    };
+
+    VkImageMemoryBarrier to_present = to_transfer;
+    to_present.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    to_present.dstAccessMask = 0;
+    to_present.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    to_present.newLayout = app->present_layout;
+
+    if (rb->yuv)
+    {
+        record_yuv_conversion(app, commandBuffer, imageIndex, &region, &to_present);
+        return;
+    }
+
+    vkCmdCopyImageToBuffer(commandBuffer, app->swap_chain_images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           rb->slots[rb->current_slot].buffer, 1, &region);
+
+    VkBufferMemoryBarrier to_host = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = rb->slots[rb->current_slot].buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 0, NULL, 1, &to_host, 1, &to_present);
+}
+
+// Copies the image to the device local buffer and converts it into the slot, so only
+// the 4:2:0 planes cross the bus
+void record_yuv_conversion(App *app, VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                           const VkBufferImageCopy *region, const VkImageMemoryBarrier *to_present)
+{
+    Readback *rb = &app->readback;
+    ReadbackSlot *slot = &rb->slots[rb->current_slot];
+
+    vkCmdCopyImageToBuffer(commandBuffer, app->swap_chain_images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           rb->rgba, 1, region);
+
+    VkBufferMemoryBarrier to_compute = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = rb->rgba,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    // The image goes back to the presentation engine as soon as the copy is done
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, NULL, 1, &to_compute, 1, to_present);
+
+    YuvParams params = {
+        .width = rb->width,
+        .height = rb->height,
+        .bgra = app->swap_chain_image_format == VK_FORMAT_B8G8R8A8_SRGB ||
+                app->swap_chain_image_format == VK_FORMAT_B8G8R8A8_UNORM,
+        .nv12 = app->config.capture_format == CAPTURE_FORMAT_NV12,
+    };
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, rb->yuv_pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, rb->yuv_layout, 0, 1, &slot->yuv_set, 0, NULL);
+    vkCmdPushConstants(commandBuffer, rb->yuv_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+
+    // 8x8 invocations per group, each converting an 8x2 block
+    vkCmdDispatch(commandBuffer, (rb->width / 8 + 7) / 8, (rb->height / 2 + 7) / 8, 1);
+
+    VkBufferMemoryBarrier to_host = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = slot->buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 0, NULL, 1, &to_host, 0, NULL);
+}
+
+// Records the copy for this frame's slot, VK_NULL_HANDLE when nothing is captured
+VkCommandBuffer record_readback_commands(App *app, uint32_t imageIndex)
+{
+    Readback *rb = &app->readback;
+
+    if (rb->current_slot < 0)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    VkCommandBuffer commandBuffer = rb->slots[rb->current_slot].command_buffer;
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    vkResetCommandBuffer(commandBuffer, 0);
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        printf("failed to begin recording command buffer!\n");
+        exit(17);
+    }
+
+    record_readback(app, commandBuffer, imageIndex);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+    {
+        printf("failed to record command buffer!\n");
+        exit(18);
+    }
+
+    return commandBuffer;
+}
+
+void *readback_writer(void *arg)
+{
+    Readback *rb = (Readback*)arg;
+
+    pthread_mutex_lock(&rb->mutex);
+    for (;;)
+    {
+        while (rb->queue_count == 0 && !rb->stop)
+        {
+            pthread_cond_wait(&rb->cond, &rb->mutex);
+        }
+
+        if (rb->queue_count == 0)
+        {
+            break;
+        }
+
+        uint32_t index = rb->queue[rb->queue_head];
+        rb->queue_head = (rb->queue_head + 1) % READBACK_RING_SIZE;
+        rb->queue_count--;
+
+        ReadbackSlot *slot = &rb->slots[index];
+        pthread_mutex_unlock(&rb->mutex);
+
+        // The slot is QUEUED, so the render loop won't touch it while we read
+        rb->callback(rb->callback_user, &(ReadbackFrame){
+            .pixels = (const uint8_t*)slot->mapped,
+            .size = rb->size,
+            .width = rb->width,
+            .height = rb->height,
+            .row_pitch = rb->yuv ? rb->width : rb->width * 4,
+            .format = rb->format,
+            .frame_number = slot->frame_number,
+        });
+
+        pthread_mutex_lock(&rb->mutex);
+        slot->state = READBACK_FREE;
+        rb->written++;
+    }
+    pthread_mutex_unlock(&rb->mutex);
+
+    return NULL;
+}
+
+static void write_capture(FILE *file, CaptureFormat format, const ReadbackFrame *frame)
+{
+    switch (format)
+    {
+        case CAPTURE_FORMAT_PPM: write_ppm(file, frame); break;
+        case CAPTURE_FORMAT_PNG: write_png(file, frame); break;
+        case CAPTURE_FORMAT_Y4M: write_y4m(file, frame); break;
+        case CAPTURE_FORMAT_RAW:
+        case CAPTURE_FORMAT_NV12:
+        case CAPTURE_FORMAT_I420: write_raw(file, frame); break;
+    }
+}
+
+// Runs on the writer thread: appends to the stream, then writes the numbered file
+void write_capture_file(void *user, const ReadbackFrame *frame)
+{
+    App *app = (App*)user;
+    Readback *rb = &app->readback;
+    const char *extensions[] = { "ppm", "png", "raw", "y4m", "nv12", "yuv" };
+    char path[PATH_MAX];
+
+    if (rb->stream != NULL)
+    {
+        if (app->config.capture_format == CAPTURE_FORMAT_Y4M && !rb->stream_header)
+        {
+            write_y4m_header(rb->stream, frame);
+            rb->stream_header = true;
+        }
+
+        write_capture(rb->stream, app->config.capture_format, frame);
+
+        // Flushed per frame so a pipe consumer sees whole frames without waiting for the buffer to fill
+        if (fflush(rb->stream) != 0 || ferror(rb->stream))
+        {
+            printf("Capture stream closed, no longer streaming\n");
+            fclose(rb->stream);
+            rb->stream = NULL;
+        }
+    }
+
+    if (app->config.capture_prefix == NULL)
+    {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s_%06" PRIu64 ".%s", app->config.capture_prefix, frame->frame_number,
+             extensions[app->config.capture_format]);
+
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL)
+    {
+        printf("Failed to open capture file: %s\n", path);
+        return;
+    }
+
+    if (app->config.capture_format == CAPTURE_FORMAT_Y4M)
+    {
+        write_y4m_header(file, frame);
+    }
+
+    write_capture(file, app->config.capture_format, frame);
+    fclose(file);
+}
+
+// Converts one row of the readback to packed RGB, swapping channels for BGRA surfaces
+static void convert_row_rgb(const ReadbackFrame *frame, uint32_t y, uint8_t *out)
+{
+    const uint8_t *in = frame->pixels + (size_t)y * frame->row_pitch;
+    bool bgra = frame->format == VK_FORMAT_B8G8R8A8_SRGB || frame->format == VK_FORMAT_B8G8R8A8_UNORM;
+
+    for (uint32_t x = 0; x < frame->width; x++)
+    {
+        out[x * 3 + 0] = in[x * 4 + (bgra ? 2 : 0)];
+        out[x * 3 + 1] = in[x * 4 + 1];
+        out[x * 3 + 2] = in[x * 4 + (bgra ? 0 : 2)];
+    }
+}
+
+void write_ppm(FILE *file, const ReadbackFrame *frame)
+{
+    uint8_t row[frame->width * 3];
+
+    fprintf(file, "P6\n%u %u\n255\n", frame->width, frame->height);
+
+    for (uint32_t y = 0; y < frame->height; y++)
+    {
+        convert_row_rgb(frame, y, row);
+        fwrite(row, 1, sizeof(row), file);
+    }
+}
+
+void write_raw(FILE *file, const ReadbackFrame *frame)
+{
+    // Native surface layout or the converted planes, straight from the mapped buffer
+    fwrite(frame->pixels, 1, frame->size, file);
+}
+
+// BT.601 limited range with centered chroma, which is what the conversion shader produces
+void write_y4m_header(FILE *file, const ReadbackFrame *frame)
+{
+    fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", frame->width, frame->height);
+}
+
+void write_y4m(FILE *file, const ReadbackFrame *frame)
+{
+    fputs("FRAME\n", file);
+    fwrite(frame->pixels, 1, frame->size, file);
+}
+
+static uint32_t png_crc(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void png_put_u32(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+// Writes data to the open IDAT chunk, keeping its CRC and the zlib Adler-32 running
+static void png_write_data(FILE *file, const uint8_t *data, size_t size, uint32_t *crc, uint32_t *adler)
+{
+    uint32_t a = *adler & 0xFFFF, b = *adler >> 16;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    *adler = (b << 16) | a;
+    *crc = png_crc(*crc, data, size);
+    fwrite(data, 1, size, file);
+}
+
+// Uncompressed PNG: zlib stream of stored deflate blocks, no dependencies and
+// no extra pass over the image, encoding cost is just the row conversion
+void write_png(FILE *file, const ReadbackFrame *frame)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    const size_t max_block = 65535;
+
+    size_t row_size = 1 + (size_t)frame->width * 3;
+    size_t raw_size = row_size * frame->height;
+    size_t block_count = (raw_size + max_block - 1) / max_block;
+    size_t idat_size = 2 + block_count * 5 + raw_size + 4;
+
+    uint8_t row[row_size];
+    uint8_t header[25];
+
+    fwrite(signature, 1, sizeof(signature), file);
+
+    png_put_u32(header, 13);
+    memcpy(header + 4, "IHDR", 4);
+    png_put_u32(header + 8, frame->width);
+    png_put_u32(header + 12, frame->height);
+    header[16] = 8; // Bit depth
+    header[17] = 2; // Truecolor
+    header[18] = 0;
+    header[19] = 0;
+    header[20] = 0;
+    png_put_u32(header + 21, png_crc(0, header + 4, 17));
+    fwrite(header, 1, sizeof(header), file);
+
+    uint8_t chunk[8];
+    png_put_u32(chunk, (uint32_t)idat_size);
+    memcpy(chunk + 4, "IDAT", 4);
+    fwrite(chunk, 1, 8, file);
+
+    uint32_t crc = png_crc(0, chunk + 4, 4);
+    uint32_t adler = 1;
+
+    static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+    crc = png_crc(crc, zlib_header, 2);
+    fwrite(zlib_header, 1, 2, file);
+
+    // Rows are fed through fixed size stored blocks, so block and row boundaries interleave
+    size_t block_left = 0;
+    size_t total_left = raw_size;
+
+    for (uint32_t y = 0; y < frame->height; y++)
+    {
+        row[0] = 0; // Filter: none
+        convert_row_rgb(frame, y, row + 1);
+
+        size_t offset = 0;
+        while (offset < row_size)
+        {
+            if (block_left == 0)
+            {
+                block_left = total_left < max_block ? total_left : max_block;
+                uint8_t block_header[5] = {
+                    (uint8_t)(block_left == total_left ? 1 : 0),
+                    (uint8_t)block_left, (uint8_t)(block_left >> 8),
+                    (uint8_t)~block_left, (uint8_t)(~block_left >> 8),
+                };
+                crc = png_crc(crc, block_header, 5);
+                fwrite(block_header, 1, 5, file);
+            }
+
+            size_t count = row_size - offset < block_left ? row_size - offset : block_left;
+            png_write_data(file, row + offset, count, &crc, &adler);
+            offset += count;
+            block_left -= count;
+            total_left -= count;
+        }
+    }
+
+    uint8_t trailer[4];
+    png_put_u32(trailer, adler);
+    crc = png_crc(crc, trailer, 4);
+    fwrite(trailer, 1, 4, file);
+
+    png_put_u32(trailer, crc);
+    fwrite(trailer, 1, 4, file);
+
+    static const uint8_t iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xAE, 0x42, 0x60, 0x82 };
+    fwrite(iend, 1, sizeof(iend), file);
+}
+
+void init_vulkan(App *app)
+{
+    create_host_memory(app);
+    create_vulkan_instance(app);
+    create_surface(app);
+    pick_physical_device(app);
+    is_device_suitable(app->physical_device, app->surface, &app->frame_arena);
+    app->msaa_samples = choose_msaa_samples(app);
+
+    const VkFormat depth_candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT };
+    app->depth_format = find_supported_format(app, depth_candidates, 3, VK_IMAGE_TILING_OPTIMAL,
+                                              VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+    create_logical_device(app);
+    create_memory_budget(app);
+    create_swap_chain(app);
+    create_image_views(app);
+    create_dynamic_resolution(app);
+    create_render_pass(app);
+    createCommandPool(app);
+    create_pipeline_cache(app);
+    create_texture_streamer(app);
+    create_particle_system(app);
+
+    if (app->config.mesh_path != NULL)
+    {
+        load_mesh(app, app->config.mesh_path);
+    }
+
+    create_graphics_pipeline(app);
+    create_particle_pipelines(app);
+    create_color_resources(app);
+    create_depth_resources(app);
+    create_framebuffers(app);
+    create_command_buffer(app);
+    create_outputs(app);
+    create_draw_batcher(app);
+    create_sync_objects(app);
+    create_readback(app);
+    create_profiler(app);
+    create_query_stats(app);
+}
+
+void draw_frame(App *app)
+{
+    vkWaitForFences(app->device, 1, &app->inFlightFence, VK_TRUE, UINT64_MAX);
+    vkResetFences(app->device, 1, &app->inFlightFence);
+
+    // Every cached command buffer has been recorded once by now, later driver allocations are steady state
+    arena_release(&app->frame_arena, 0);
+    atomic_store(&app->host_memory.in_frame, app->frame_number >= app->swap_chain_image_count);
+
+    // Everything submitted before the fence is done, hand finished copies to the writer
+    readback_collect(app);
+    profiler_collect(app);
+    query_stats_collect(app);
+    update_dynamic_resolution(app);
+    update_texture_cycle(app);
+    update_memory_budget(app);
+    pipeline_cache_update(app);
+    update_particles(app);
+
+    uint32_t imageIndex;
+
+    if (app->config.headless)
+        imageIndex = (uint32_t)(app->frame_number % app->swap_chain_image_count);
+    else
+        vkAcquireNextImageKHR(app->device, app->swap_chain, UINT64_MAX, app->imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        vkAcquireNextImageKHR(app->device, app->outputs[i].swap_chain, UINT64_MAX, app->outputs[i].image_available,
+                              VK_NULL_HANDLE, &app->outputs[i].image_index);
+    }
+
+    readback_begin_frame(app);
+
+    // Texture uploads, which may repoint the descriptor set and so go first,
+    // the cached frame, the extra windows' frames and, when capturing, a small per-frame copy recorded behind it
+    VkCommandBuffer commandBuffers[3 + MAX_OUTPUTS];
+    uint32_t commandBufferCount = 0;
+
+    VkCommandBuffer uploadCommands = texture_stream_update(app);
+    if (uploadCommands != VK_NULL_HANDLE)
+    {
+        commandBuffers[commandBufferCount++] = uploadCommands;
+    }
+
+    commandBuffers[commandBufferCount++] = get_command_buffer(app, imageIndex);
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        commandBuffers[commandBufferCount++] = get_output_command_buffer(app, i);
+    }
+
+    VkCommandBuffer readbackCommands = record_readback_commands(app, imageIndex);
+    if (readbackCommands != VK_NULL_HANDLE)
+    {
+        commandBuffers[commandBufferCount++] = readbackCommands;
+    }
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+    // One submit waits for every window's image
+    VkSemaphore waitSemaphores[1 + MAX_OUTPUTS] = {app->imageAvailableSemaphore};
+    VkPipelineStageFlags waitStages[1 + MAX_OUTPUTS] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        waitSemaphores[1 + i] = app->outputs[i].image_available;
+        waitStages[1 + i] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    }
+
+    submitInfo.waitSemaphoreCount = app->config.headless ? 0 : 1 + app->config.output_count;
+    submitInfo.pWaitSemaphores = waitSemaphores;
+    submitInfo.pWaitDstStageMask = waitStages;
+    submitInfo.commandBufferCount = commandBufferCount;
+    submitInfo.pCommandBuffers = commandBuffers;
+
+    VkSemaphore signalSemaphores[] = {app->renderFinishedSemaphore};
+    submitInfo.signalSemaphoreCount = app->config.headless ? 0 : 1;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+
+    if (vkQueueSubmit(app->graphics_queue, 1, &submitInfo, app->inFlightFence) != VK_SUCCESS)
+    {
+        printf("failed to submit draw command buffer!\n");
+        exit(20);
+    }
+
+    app->profiler.pending_image = (int)imageIndex;
+    app->query_stats.pending[imageIndex] = app->query_stats.enabled;
+
+    if (app->config.headless)
+    {
+        atomic_store(&app->host_memory.in_frame, false);
+        app->frame_number++;
+        return;
+    }
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = signalSemaphores;
+
+    // Every window flips in the same present
+    VkSwapchainKHR swapChains[1 + MAX_OUTPUTS] = {app->swap_chain};
+    uint32_t imageIndices[1 + MAX_OUTPUTS] = {imageIndex};
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        swapChains[1 + i] = app->outputs[i].swap_chain;
+        imageIndices[1 + i] = app->outputs[i].image_index;
+    }
+
+    presentInfo.swapchainCount = 1 + app->config.output_count;
+    presentInfo.pSwapchains = swapChains;
+    presentInfo.pImageIndices = imageIndices;
+
+    presentInfo.pResults = NULL; // Optional
+
+    vkQueuePresentKHR(app->present_queue, &presentInfo);
+
+    atomic_store(&app->host_memory.in_frame, false);
+    app->frame_number++;
+}
+
+void main_loop(App *app)
 {
-    while(!glfwWindowShouldClose(app->window))
+    bool on_demand = app->config.on_demand && !app->config.headless;
+    double last_frame_time = 0.0;
+
+    atomic_store(&app->dirty, true);
+
+    while(app->config.headless || !windows_should_close(app))
     {
-        glfwPollEvents();
+        if (app->config.headless)
+        {
+            // Nothing to wait for
+        }
+        else if (!on_demand || atomic_load(&app->dirty) || atomic_load(&app->animating) > 0)
+        {
+            glfwPollEvents();
+        }
+        else if (app->config.heartbeat_ms <= 0.0)
+        {
+            glfwWaitEvents();
+        }
+        else
+        {
+            double timeout = app->config.heartbeat_ms / 1000.0 - (glfwGetTime() - last_frame_time);
+
+            if (timeout > 0.0)
+                glfwWaitEventsTimeout(timeout);
+            else
+                glfwPollEvents();
+        }
+
+        if (on_demand)
+        {
+            bool heartbeat = app->config.heartbeat_ms > 0.0 &&
+                             (glfwGetTime() - last_frame_time) * 1000.0 >= app->config.heartbeat_ms;
+
+            if (!atomic_exchange(&app->dirty, false) && atomic_load(&app->animating) == 0 && !heartbeat)
+            {
+                app->idle_wakeups++;
+                continue;
+            }
+
+            last_frame_time = glfwGetTime();
+        }
+
         draw_frame(app);
+
+        if (app->config.frame_limit != 0 && app->frame_number >= app->config.frame_limit)
+        {
+            break;
+        }
     }
 
     vkDeviceWaitIdle(app->device);
+    readback_collect(app);
+    profiler_collect(app);
+    query_stats_collect(app);
+
+    if (on_demand)
+    {
+        printf("Render on demand: %" PRIu64 " frames, %" PRIu64 " idle wakeups\n", app->frame_number, app->idle_wakeups);
+    }
+}
+
+// Marks the image as out of date. Safe to call from any thread, it also wakes the event loop.
+void request_redraw(App *app)
+{
+    atomic_store(&app->dirty, true);
+
+    if (!app->config.headless)
+    {
+        glfwPostEmptyEvent();
+    }
+}
+
+// Frames render continuously between begin_animation and the matching end_animation
+void begin_animation(App *app)
+{
+    atomic_fetch_add(&app->animating, 1);
+    request_redraw(app);
+}
+
+void end_animation(App *app)
+{
+    atomic_fetch_sub(&app->animating, 1);
+    request_redraw(app);
+}
+
+void install_input_callbacks(App *app)
+{
+    for (uint32_t i = 0; i <= app->config.output_count; i++)
+    {
+        GLFWwindow *window = i == 0 ? app->window : app->outputs[i - 1].window;
+
+        glfwSetWindowUserPointer(window, app);
+        glfwSetKeyCallback(window, on_key);
+        glfwSetCursorPosCallback(window, on_cursor_pos);
+        glfwSetMouseButtonCallback(window, on_mouse_button);
+        glfwSetScrollCallback(window, on_scroll);
+        glfwSetWindowRefreshCallback(window, on_window_refresh);
+        glfwSetWindowFocusCallback(window, on_window_focus);
+    }
+}
+
+void on_key(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    App *app = (App*)glfwGetWindowUserPointer(window);
+
+    // Switching shading asks for a permutation that may not be compiled yet
+    if (key == GLFW_KEY_M && action == GLFW_PRESS)
+    {
+        app->config.shading = (app->config.shading + 1) % SHADING_MODE_COUNT;
+        invalidate_command_buffers(app);
+    }
+
+    if (key == GLFW_KEY_T && action == GLFW_PRESS)
+    {
+        app->textures.cycle_requested = true;
+    }
+
+    request_redraw(app);
+}
+
+void on_cursor_pos(GLFWwindow *window, double x, double y)
+{
+    request_redraw((App*)glfwGetWindowUserPointer(window));
+}
+
+void on_mouse_button(GLFWwindow *window, int button, int action, int mods)
+{
+    request_redraw((App*)glfwGetWindowUserPointer(window));
+}
+
+void on_scroll(GLFWwindow *window, double x, double y)
+{
+    request_redraw((App*)glfwGetWindowUserPointer(window));
+}
+
+void on_window_refresh(GLFWwindow *window)
+{
+    request_redraw((App*)glfwGetWindowUserPointer(window));
+}
+
+void on_window_focus(GLFWwindow *window, int focused)
+{
+    request_redraw((App*)glfwGetWindowUserPointer(window));
 }
 
 void clean_up(App *app)
 {
-    vkDestroySemaphore(app->device, app->imageAvailableSemaphore, NULL);
-    vkDestroySemaphore(app->device, app->renderFinishedSemaphore, NULL);
-    vkDestroyFence(app->device, app->inFlightFence, NULL);
+    destroy_readback(app);
+    profiler_report(app);
+    destroy_profiler(app);
+    query_stats_report(app);
+    destroy_query_stats(app);
 
-    vkDestroyCommandPool(app->device, app->commandPool, NULL);
+    vkDestroySemaphore(app->device, app->imageAvailableSemaphore, &app->host_memory.callbacks);
+    vkDestroySemaphore(app->device, app->renderFinishedSemaphore, &app->host_memory.callbacks);
+    vkDestroyFence(app->device, app->inFlightFence, &app->host_memory.callbacks);
+
+    printf("Command buffer cache: %" PRIu64 " reused, %" PRIu64 " recorded\n", app->command_cache.hits, app->command_cache.misses);
+    vkDestroyCommandPool(app->device, app->commandPool, &app->host_memory.callbacks);
+    destroy_outputs(app);
 
     for(uint32_t i = 0; i < app->swap_chain_image_count; i++)
     {
-        vkDestroyFramebuffer(app->device, app->swapchain_framebuffers[i], NULL);
+        vkDestroyFramebuffer(app->device, app->swapchain_framebuffers[i], &app->host_memory.callbacks);
     }
 
-    vkDestroyPipeline(app->device, app->graphics_pipeline, NULL);
-    vkDestroyPipelineLayout(app->device, app->pipeline_layout, NULL);
-    vkDestroyRenderPass(app->device, app->render_pass, NULL);
+    destroy_color_resources(app);
+    destroy_depth_resources(app);
+    destroy_dynamic_resolution(app);
+    destroy_texture_streamer(app);
+    destroy_particle_system(app);
+    destroy_mesh(app);
+    destroy_draw_batcher(app);
+
+    destroy_pipeline_cache(app);
+    vkDestroyPipelineLayout(app->device, app->pipeline_layout, &app->host_memory.callbacks);
+    vkDestroyRenderPass(app->device, app->render_pass, &app->host_memory.callbacks);
     
     for (uint32_t i = 0; i < app->swap_chain_image_count; i++)
     {
-        vkDestroyImageView(app->device, app->swap_chain_image_views[i], NULL);
+        vkDestroyImageView(app->device, app->swap_chain_image_views[i], &app->host_memory.callbacks);
+    }
+
+    if (app->config.headless)
+    {
+        destroy_headless_targets(app);
+        vkDestroyDevice(app->device, &app->host_memory.callbacks);
+        vkDestroyInstance(app->instance, &app->host_memory.callbacks);
+        destroy_host_memory(app);
+        return;
+    }
+
+    vkDestroySwapchainKHR(app->device, app->swap_chain, &app->host_memory.callbacks);
+    vkDestroyDevice(app->device, &app->host_memory.callbacks);
+    vkDestroySurfaceKHR(app->instance, app->surface, &app->host_memory.callbacks);
+
+    for (uint32_t i = 0; i < app->config.output_count; i++)
+    {
+        vkDestroySurfaceKHR(app->instance, app->outputs[i].surface, &app->host_memory.callbacks);
+        glfwDestroyWindow(app->outputs[i].window);
     }
 
-    vkDestroySwapchainKHR(app->device, app->swap_chain, NULL);
-    vkDestroyDevice(app->device, NULL);
-    vkDestroySurfaceKHR(app->instance, app->surface, NULL);
-    vkDestroyInstance(app->instance, NULL);
+    vkDestroyInstance(app->instance, &app->host_memory.callbacks);
+    destroy_host_memory(app);
     glfwDestroyWindow(app->window);
     glfwTerminate();
 }
 
-int main()
+int main(int argc, char **argv)
 {
     App app = {0};
 
+    parse_args(&app, argc, argv);
     init_window(&app);
     init_vulkan(&app);
     main_loop(&app);
@@ -0,0 +1,83 @@
+#ifndef MESH_FORMAT_H
+#define MESH_FORMAT_H
+
+#include <stdint.h>
+
+// Binary mesh files, written by tools/meshconv and mapped as is by the renderer.
+// Little endian, every section starts on a MESH_SECTION_ALIGNMENT boundary and the
+// index section directly follows the vertex section, so both upload as one copy.
+
+#define MESH_MAGIC 0x4853454D // "MESH"
+#define MESH_VERSION 2
+#define MESH_SECTION_ALIGNMENT 16
+
+// Limits the converter clusters triangles under
+#define MESH_MESHLET_MAX_VERTICES 64
+#define MESH_MESHLET_MAX_TRIANGLES 124
+
+// Longest LOD chain, level 0 is the full detail mesh
+#define MESH_MAX_LODS 8
+
+typedef enum MeshFlags
+{
+    MESH_FLAG_INDEX32 = 1, // Indices are uint32_t, uint16_t otherwise
+} MeshFlags;
+
+typedef struct MeshHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;          // MeshFlags
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t meshlet_count;
+    float bounds_min[3];     // Positions are quantized over these
+    float bounds_max[3];
+    float center[3];         // Bounding sphere
+    float radius;
+    uint64_t vertex_offset;  // MeshVertex[vertex_count]
+    uint64_t index_offset;   // uint16_t or uint32_t[index_count]
+    uint64_t meshlet_offset; // MeshMeshlet[meshlet_count]
+    uint64_t lod_offset;     // MeshLod[lod_count]
+    uint32_t lod_count;
+    uint32_t reserved;
+} MeshHeader;
+
+typedef struct MeshVertex
+{
+    uint16_t position[3];    // 0 is bounds_min, 65535 bounds_max
+    uint16_t normal;         // Octahedral, snorm8 x in the low byte and y in the high byte
+} MeshVertex;
+
+// A run of at most MESH_MESHLET_MAX_TRIANGLES triangles over at most MESH_MESHLET_MAX_VERTICES
+// vertices. Meshlets partition the index section in order, LOD by LOD.
+typedef struct MeshMeshlet
+{
+    float center[3];         // Bounding sphere
+    float radius;
+    float cone_axis[3];      // Average facing of the triangles
+    float cone_cutoff;       // Sine of the cone's half angle, 1 when the meshlet can't be cone culled
+    uint32_t first_index;
+    uint32_t triangle_count;
+    uint32_t vertex_count;   // Distinct vertices referenced
+    uint32_t reserved;
+} MeshMeshlet;
+
+// A simplified copy of the mesh over the shared vertex section. Levels follow each other in
+// the index section and the meshlet table, each coarser than the one before.
+typedef struct MeshLod
+{
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t first_meshlet;
+    uint32_t meshlet_count;
+    float error;             // Estimated distance the surface moved from level 0, in object units
+    uint32_t reserved;
+} MeshLod;
+
+_Static_assert(sizeof(MeshHeader) == 104, "MeshHeader is part of the file format");
+_Static_assert(sizeof(MeshVertex) == 8, "MeshVertex is part of the file format");
+_Static_assert(sizeof(MeshMeshlet) == 48, "MeshMeshlet is part of the file format");
+_Static_assert(sizeof(MeshLod) == 24, "MeshLod is part of the file format");
+
+#endif
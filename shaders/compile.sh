@@ -1,4 +1,9 @@
 #/bin/bash
 
 /usr/bin/glslc shader.vert -o vert.spv
-/usr/bin/glslc shader.frag -o frag.spv
\ No newline at end of file
+/usr/bin/glslc shader.frag -o frag.spv
+/usr/bin/glslc particle.vert -o particle_vert.spv
+/usr/bin/glslc particle.frag -o particle_frag.spv
+/usr/bin/glslc particle.comp -o particle_comp.spv
+/usr/bin/glslc mesh.vert -o mesh_vert.spv
+/usr/bin/glslc yuv.comp -o yuv_comp.spv
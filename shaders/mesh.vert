@@ -0,0 +1,30 @@
+#version 450
+
+// MeshVertex: xyz quantized over the mesh bounds, w an octahedral normal as two snorm8
+layout(location = 0) in uvec4 inVertex;
+
+layout(push_constant) uniform MeshTransform {
+    vec4 scale;
+    vec4 offset;
+} transform;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+
+vec3 decode_normal(uint packed) {
+    vec2 e = vec2(int(packed << 24) >> 24, int(packed << 16) >> 24) / 127.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+
+    // Unfold the lower half of the octahedron
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+void main() {
+    vec3 position = vec3(inVertex.xyz) * transform.scale.xyz + transform.offset.xyz;
+    gl_Position = vec4(position, 1.0);
+    fragColor = decode_normal(inVertex.w) * 0.5 + 0.5;
+    fragTexCoord = position.xy * 0.5 + 0.5;
+}
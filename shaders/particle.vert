@@ -0,0 +1,34 @@
+#version 450
+
+struct Particle
+{
+    vec4 position_life;
+    vec4 velocity_size;
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Particles { Particle particles[]; };
+layout(std430, set = 1, binding = 1) readonly buffer DrawList { uint draw_indices[]; };
+
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragOffset;
+
+vec2 corners[6] = vec2[](
+    vec2(-1.0, -1.0),
+    vec2(1.0, -1.0),
+    vec2(1.0, 1.0),
+    vec2(-1.0, -1.0),
+    vec2(1.0, 1.0),
+    vec2(-1.0, 1.0)
+);
+
+void main() {
+    // One quad per live particle, the instance picks it from the compacted draw list
+    Particle particle = particles[draw_indices[gl_InstanceIndex]];
+    vec2 corner = corners[gl_VertexIndex];
+
+    gl_Position = vec4(particle.position_life.xy + corner * particle.velocity_size.w, particle.position_life.z, 1.0);
+
+    float fade = clamp(particle.position_life.w, 0.0, 1.0);
+    fragColor = vec4(mix(vec3(1.0, 0.3, 0.1), vec3(1.0, 0.9, 0.5), fade), fade);
+    fragOffset = corner;
+}
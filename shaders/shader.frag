@@ -1,9 +1,22 @@
 #version 450
 
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+
+layout(binding = 0) uniform sampler2D texSampler;
 
 layout(location = 0) out vec4 outColor;
 
+// ShadingMode: 0 modulates the vertex color with the texture, 1 is the vertex color, 2 the texture
+layout(constant_id = 0) const uint SHADING = 0;
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec4 texel = texture(texSampler, fragTexCoord);
+
+    if (SHADING == 1)
+        outColor = vec4(fragColor, 1.0);
+    else if (SHADING == 2)
+        outColor = texel;
+    else
+        outColor = vec4(fragColor, 1.0) * texel;
 }
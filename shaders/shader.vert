@@ -1,6 +1,11 @@
 #version 450
 
+// The pre-pass and the EQUAL color pass run this shader in different pipelines, and
+// the EQUAL test only passes when both compute bit-identical depth
+invariant gl_Position;
+
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
 
 vec2 positions[3] = vec2[](
     vec2(0.0, -0.5),
@@ -15,6 +20,11 @@ vec3 colors[3] = vec3[](
 );
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
+    // Instances are fanned out on a 4x4 grid, each one further back than the last,
+    // instance 0 is the original triangle
+    vec2 offset = vec2(gl_InstanceIndex % 4, gl_InstanceIndex / 4) * 0.1;
+    float depth = float(gl_InstanceIndex) * 0.05;
+    gl_Position = vec4(positions[gl_VertexIndex] + offset, depth, 1.0);
     fragColor = colors[gl_VertexIndex];
+    fragTexCoord = positions[gl_VertexIndex] + 0.5;
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+// Compares two binary PPM images. Exits 0 when they match within tolerance,
+// 1 when they differ and 2 when an image can't be read.
+
+typedef struct Image
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t *pixels; // Packed RGB
+} Image;
+
+bool read_ppm(const char *filename, Image *image);
+
+bool read_ppm(const char *filename, Image *image)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        printf("Failed to open image: %s\n", filename);
+        return false;
+    }
+
+    unsigned int max_value;
+
+    if (fscanf(file, "P6 %u %u %u", &image->width, &image->height, &max_value) != 3 || max_value != 255)
+    {
+        printf("Not an 8-bit binary PPM: %s\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    fgetc(file); // Single whitespace before the pixel data
+
+    size_t size = (size_t)image->width * image->height * 3;
+    image->pixels = (uint8_t*)malloc(size);
+
+    if (fread(image->pixels, 1, size, file) != size)
+    {
+        printf("Truncated image: %s\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5)
+    {
+        printf("Usage: %s ACTUAL.ppm GOLDEN.ppm [MAX_RMSE] [MAX_BAD_PIXEL_PERCENT]\n", argv[0]);
+        return 2;
+    }
+
+    // RMSE over all channels on a 0-255 scale, and the share of pixels with
+    // any channel more than BAD_PIXEL_DELTA off
+    const int bad_pixel_delta = 16;
+    double max_rmse = argc > 3 ? atof(argv[3]) : 1.0;
+    double max_bad_percent = argc > 4 ? atof(argv[4]) : 0.1;
+
+    Image actual = {0};
+    Image golden = {0};
+
+    if (!read_ppm(argv[1], &actual) || !read_ppm(argv[2], &golden))
+    {
+        return 2;
+    }
+
+    if (actual.width != golden.width || actual.height != golden.height)
+    {
+        printf("FAIL %s: size %ux%u, golden is %ux%u\n", argv[1], actual.width, actual.height, golden.width, golden.height);
+        return 1;
+    }
+
+    size_t pixel_count = (size_t)actual.width * actual.height;
+    double squared_error = 0.0;
+    size_t bad_pixels = 0;
+
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+        int worst = 0;
+
+        for (int c = 0; c < 3; c++)
+        {
+            int delta = abs((int)actual.pixels[i * 3 + c] - (int)golden.pixels[i * 3 + c]);
+            squared_error += (double)delta * delta;
+            if (delta > worst)
+                worst = delta;
+        }
+
+        if (worst > bad_pixel_delta)
+            bad_pixels++;
+    }
+
+    double rmse = sqrt(squared_error / (double)(pixel_count * 3));
+    double bad_percent = 100.0 * (double)bad_pixels / (double)pixel_count;
+    bool pass = rmse <= max_rmse && bad_percent <= max_bad_percent;
+
+    printf("%s %s: rmse %.4f (max %.4f), bad pixels %.4f%% (max %.4f%%)\n", pass ? "PASS" : "FAIL",
+           argv[1], rmse, max_rmse, bad_percent, max_bad_percent);
+
+    free(actual.pixels);
+    free(golden.pixels);
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../mesh_format.h"
+
+// Reads a mesh written by tools/meshconv back and checks its LOD chain: level 0 has the
+// source's triangles, there are enough levels, each has at most half the triangles of the
+// one before, errors grow so the renderer picks every level past the first at some size,
+// and every level's meshlets cover exactly its indices within the meshlet limits. Exits 0
+// when the mesh passes, 1 when it doesn't and 2 when it can't be read.
+
+bool read_file(const char *filename, uint8_t **data, size_t *size);
+
+bool read_file(const char *filename, uint8_t **data, size_t *size)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        printf("Failed to open mesh: %s\n", filename);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    *size = length > 0 ? (size_t)length : 0;
+    *data = (uint8_t*)malloc(*size + 1);
+
+    if (*data == NULL || fread(*data, 1, *size, file) != *size)
+    {
+        printf("Failed to read mesh: %s\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static bool section_fits(uint64_t offset, uint64_t count, uint64_t size, size_t file_size)
+{
+    return offset <= file_size && count <= (file_size - offset) / size;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        printf("Usage: %s FILE.mesh SOURCE_TRIANGLES MIN_LODS\n", argv[0]);
+        return 2;
+    }
+
+    uint32_t source_triangles = (uint32_t)strtoul(argv[2], NULL, 10);
+    uint32_t min_lods = (uint32_t)strtoul(argv[3], NULL, 10);
+    uint8_t *data;
+    size_t size;
+
+    if (!read_file(argv[1], &data, &size))
+    {
+        return 2;
+    }
+
+    const MeshHeader *header = (const MeshHeader*)data;
+    uint64_t index_size = size >= sizeof(MeshHeader) && header->flags & MESH_FLAG_INDEX32 ? sizeof(uint32_t) : sizeof(uint16_t);
+
+    if (size < sizeof(MeshHeader) || header->magic != MESH_MAGIC || header->version != MESH_VERSION ||
+        header->lod_count == 0 || header->lod_count > MESH_MAX_LODS ||
+        !section_fits(header->index_offset, header->index_count, index_size, size) ||
+        !section_fits(header->meshlet_offset, header->meshlet_count, sizeof(MeshMeshlet), size) ||
+        !section_fits(header->lod_offset, header->lod_count, sizeof(MeshLod), size))
+    {
+        printf("Not a version %u mesh or truncated: %s\n", MESH_VERSION, argv[1]);
+        free(data);
+        return 2;
+    }
+
+    const uint8_t *indices = data + header->index_offset;
+    const MeshMeshlet *meshlets = (const MeshMeshlet*)(data + header->meshlet_offset);
+    const MeshLod *lods = (const MeshLod*)(data + header->lod_offset);
+    const char *failure = NULL;
+    uint32_t failed_lod = 0;
+
+    if (header->lod_count < min_lods)
+    {
+        printf("FAIL %s: %u LODs, expected at least %u\n", argv[1], header->lod_count, min_lods);
+        free(data);
+        return 1;
+    }
+
+    if (lods[0].index_count != source_triangles * 3 || lods[0].error != 0.0f)
+    {
+        failure = "not the source mesh";
+    }
+
+    for (uint32_t l = 0; l < header->lod_count && failure == NULL; l++)
+    {
+        const MeshLod *lod = &lods[l];
+        uint32_t covered = 0;
+        failed_lod = l;
+
+        if (lod->index_count == 0 || lod->index_count % 3 != 0 || lod->first_index > header->index_count ||
+            lod->index_count > header->index_count - lod->first_index ||
+            lod->first_meshlet > header->meshlet_count || lod->meshlet_count > header->meshlet_count - lod->first_meshlet)
+        {
+            failure = "index or meshlet range outside the file";
+            break;
+        }
+
+        if (l > 0 && lod->index_count / 3 > (lods[l - 1].index_count / 3 + 1) / 2)
+        {
+            failure = "more than half the triangles of the level before";
+            break;
+        }
+
+        // Level 1 may be lossless, equal to level 0
+        if (l > 0 && !(l == 1 ? lod->error >= 0.0f : lod->error > lods[l - 1].error))
+        {
+            failure = "error no larger than the level before";
+            break;
+        }
+
+        for (uint32_t i = lod->first_index; i < lod->first_index + lod->index_count; i++)
+        {
+            uint32_t index = index_size == sizeof(uint32_t) ? ((const uint32_t*)indices)[i] : ((const uint16_t*)indices)[i];
+
+            if (index >= header->vertex_count)
+            {
+                failure = "index past the vertices";
+                break;
+            }
+        }
+
+        // Meshlets are cut from the level's indices in order, back to back
+        for (uint32_t m = lod->first_meshlet; m < lod->first_meshlet + lod->meshlet_count && failure == NULL; m++)
+        {
+            const MeshMeshlet *meshlet = &meshlets[m];
+
+            if (meshlet->first_index != lod->first_index + covered || meshlet->triangle_count == 0 ||
+                meshlet->triangle_count > MESH_MESHLET_MAX_TRIANGLES || meshlet->vertex_count > MESH_MESHLET_MAX_VERTICES)
+            {
+                failure = "meshlet out of order or over the limits";
+            }
+            covered += meshlet->triangle_count * 3;
+        }
+
+        if (failure == NULL && covered != lod->index_count)
+        {
+            failure = "meshlets don't cover the level";
+        }
+    }
+
+    if (failure != NULL)
+    {
+        printf("FAIL %s: LOD %u, %s\n", argv[1], failed_lod, failure);
+        free(data);
+        return 1;
+    }
+
+    printf("PASS %s: %u LODs,", argv[1], header->lod_count);
+    for (uint32_t l = 0; l < header->lod_count; l++)
+    {
+        printf(" %u triangles at error %g%s", lods[l].index_count / 3, lods[l].error, l + 1 < header->lod_count ? "," : "\n");
+    }
+
+    free(data);
+    return 0;
+}
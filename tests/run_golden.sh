@@ -0,0 +1,269 @@
+#!/bin/sh
+# Renders every regression scene headlessly and checks it against the stored
+# golden image and GPU frame time baseline. Run from the repository root,
+# pass --update to regenerate the goldens and baselines instead.
+#
+# Use a deterministic driver, e.g. VK_ICD_FILENAMES pointing at lavapipe. The
+# baselines record the device the goldens were rendered on, a run on any other
+# device fails without comparing images.
+# Tunables (environment): RENDER_SIZE, FRAMES, MAX_RMSE, MAX_BAD_PERCENT, PERF_TOLERANCE
+
+# One case per line: name, scene, extra renderer arguments
+CASES="
+triangle triangle
+clear clear
+overlap overlap
+overlap_msaa4 overlap --msaa 4
+overlap_prepass overlap --depth-prepass
+overlap_dynres_half overlap --dynres 0.5,0.5
+materials materials
+materials_prepass materials --depth-prepass
+particles triangle --particles 4096
+mesh triangle --mesh tests/out/sphere.mesh
+mesh_grid triangle --mesh tests/out/sphere.mesh --mesh-grid 4
+mesh_budget triangle --mesh tests/out/sphere.mesh --mesh-grid 4 --triangle-budget 2000
+"
+RENDER_SIZE=${RENDER_SIZE:-256x256}
+FRAMES=${FRAMES:-120}
+MAX_RMSE=${MAX_RMSE:-1.0}
+MAX_BAD_PERCENT=${MAX_BAD_PERCENT:-0.1}
+PERF_TOLERANCE=${PERF_TOLERANCE:-25}   # Percent slower than baseline before failing
+
+GOLDEN_DIR=tests/golden
+OUT_DIR=tests/out
+BASELINES=$GOLDEN_DIR/baselines.txt
+
+update=false
+if [ "$1" = "--update" ]; then
+    update=true
+fi
+
+mkdir -p $OUT_DIR
+if $update; then
+    : > $BASELINES.new
+fi
+
+# The first line of the baselines is "# device NAME"
+golden_device=$(sed -n '1s/^# device //p' $BASELINES 2>/dev/null)
+
+failures=0
+last_frame=$((FRAMES - 1))
+capture_name=$(printf "%06d" $last_frame)
+
+# Mesh cases draw the fixture as converted by this tree's meshconv
+if ! tools/meshconv tests/data/sphere.obj $OUT_DIR/sphere.mesh > $OUT_DIR/meshconv.log 2>&1; then
+    echo "FAIL meshconv: could not convert tests/data/sphere.obj, see $OUT_DIR/meshconv.log"
+    exit 1
+fi
+
+# Read from a file rather than a pipe so the loop can update failures
+echo "$CASES" > $OUT_DIR/cases.txt
+
+while read name scene args; do
+    [ -z "$name" ] && continue
+    log=$OUT_DIR/$name.log
+
+    if ! ./a.out --headless $RENDER_SIZE --scene $scene --frames $FRAMES $args \
+            --capture $OUT_DIR/$name --capture-format ppm --capture-frame $last_frame > $log 2>&1 < /dev/null; then
+        echo "FAIL $name: renderer exited with an error, see $log"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    image=$OUT_DIR/${name}_$capture_name.ppm
+    device=$(sed -n 's/^Physical Device: //p' $log)
+    median=$(sed -n 's/^GPU frame time: median \([0-9.]*\) ms.*/\1/p' $log)
+
+    if $update; then
+        [ -s $BASELINES.new ] || echo "# device $device" >> $BASELINES.new
+        cp $image $GOLDEN_DIR/$name.ppm
+
+        # Without timestamp queries there is nothing to compare against later, leave the scene out
+        if [ -z "$median" ]; then
+            echo "UPDATED $name: image only, no GPU timing available"
+        else
+            echo "$name $median" >> $BASELINES.new
+            echo "UPDATED $name: median $median ms"
+        fi
+        continue
+    fi
+
+    if [ ! -f $GOLDEN_DIR/$name.ppm ]; then
+        echo "FAIL $name: no golden image, run 'make golden' on the reference driver"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    if [ -n "$golden_device" ] && [ "$device" != "$golden_device" ]; then
+        echo "FAIL $name: rendered on $device, the goldens are from $golden_device"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    if ! tests/imgdiff $image $GOLDEN_DIR/$name.ppm $MAX_RMSE $MAX_BAD_PERCENT; then
+        failures=$((failures + 1))
+    fi
+
+    baseline=$(awk -v s=$name '$1 == s { print $2 }' $BASELINES 2>/dev/null)
+
+    if [ -z "$median" ] || [ -z "$baseline" ]; then
+        echo "SKIP $name: no GPU timing or baseline available"
+        continue
+    fi
+
+    if awk -v m=$median -v b=$baseline -v t=$PERF_TOLERANCE 'BEGIN { exit !(m > b * (1 + t / 100)) }'; then
+        echo "FAIL $name: median $median ms, baseline $baseline ms (+$PERF_TOLERANCE% allowed)"
+        failures=$((failures + 1))
+    else
+        echo "PASS $name: median $median ms, baseline $baseline ms"
+    fi
+done < $OUT_DIR/cases.txt
+
+if $update; then
+    mv $BASELINES.new $BASELINES
+    exit 0
+fi
+
+# Checks below compare against the renderer's own output or log, they have no goldens
+
+# Dynamic resolution: no driver meets a 0.001 ms target, so the controller has to shrink the
+# scale all the way to the lower bound. It only runs with GPU timestamps.
+log=$OUT_DIR/dynres.log
+if ! ./a.out --headless $RENDER_SIZE --scene overlap --frames 60 --dynres 0.5,1.0 --target-ms 0.001 \
+        > $log 2>&1 < /dev/null; then
+    echo "FAIL dynres: renderer exited with an error, see $log"
+    failures=$((failures + 1))
+elif ! grep -q "^GPU frame time: median" $log; then
+    echo "SKIP dynres: no GPU timing available"
+elif ! grep -q "^Dynamic resolution: final scale 0.500 " $log; then
+    echo "FAIL dynres: $(grep '^Dynamic resolution' $log || echo 'no final scale'), expected the 0.5 bound"
+    failures=$((failures + 1))
+else
+    echo "PASS dynres: $(sed -n 's/^Dynamic resolution: //p' $log)"
+fi
+
+# Host memory: once every swap chain image's command buffer is recorded, frames may not make
+# the driver allocate
+log=$OUT_DIR/host_memory.log
+if ! ./a.out --headless $RENDER_SIZE --scene overlap --frames 60 > $log 2>&1 < /dev/null; then
+    echo "FAIL host_memory: renderer exited with an error, see $log"
+    failures=$((failures + 1))
+else
+    steady=$(sed -n 's/^Host memory: .*, \([0-9]*\) during steady state frames$/\1/p' $log)
+
+    if [ "$steady" != "0" ]; then
+        echo "FAIL host_memory: ${steady:-unknown} driver allocations during steady state frames, see $log"
+        failures=$((failures + 1))
+    else
+        echo "PASS host_memory: no driver allocations during steady state frames"
+    fi
+fi
+
+# Command buffer cache: nothing in a static scene changes, so each of the two headless images
+# records its command buffer once and every later frame reuses it
+log=$OUT_DIR/command_cache.log
+if ! ./a.out --headless $RENDER_SIZE --scene triangle --frames 60 > $log 2>&1 < /dev/null; then
+    echo "FAIL command_cache: renderer exited with an error, see $log"
+    failures=$((failures + 1))
+else
+    counts=$(sed -n 's/^Command buffer cache: \([0-9]*\) reused, \([0-9]*\) recorded$/\1 \2/p' $log)
+    reused=${counts% *}
+    recorded=${counts#* }
+
+    if [ -z "$counts" ] || [ $recorded -gt 2 ] || [ $((reused + recorded)) -lt 60 ]; then
+        echo "FAIL command_cache: ${counts:-no counts} reused and recorded over 60 frames, expected at most 2 recorded"
+        failures=$((failures + 1))
+    else
+        echo "PASS command_cache: $reused reused, $recorded recorded"
+    fi
+fi
+
+# Pipeline cache: the first run writes the cache file and the second reads it back. The list's
+# first line is the triangle scene's own permutation, compiled already, and the last repeats
+# the second, so each run precompiles 3.
+cat > $OUT_DIR/pipelines.txt << EOF
+depth=less
+depth=less cull=none
+depth=less blend=additive
+depth=test # the particle permutation, which the scene doesn't compile itself
+depth=less cull=none
+EOF
+rm -f $OUT_DIR/pipelines.cache
+for run in 1 2; do
+    log=$OUT_DIR/pipeline_cache_$run.log
+    if ! ./a.out --headless $RENDER_SIZE --scene triangle --frames 10 --pipeline-cache $OUT_DIR/pipelines.cache \
+            --pipeline-list $OUT_DIR/pipelines.txt > $log 2>&1 < /dev/null; then
+        echo "FAIL pipeline_cache run $run: renderer exited with an error, see $log"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    loaded=$(sed -n 's/^Pipeline cache: .*, \([0-9]*\) bytes loaded, [0-9]* saved$/\1/p' $log)
+
+    if ! grep -q "^Pipeline cache: precompiled 3 permutations " $log; then
+        echo "FAIL pipeline_cache run $run: $(grep '^Pipeline cache: precompiled' $log || echo 'nothing precompiled'), expected 3"
+        failures=$((failures + 1))
+    elif [ $run -eq 2 ] && grep -q "^Pipeline cache: ignoring" $log; then
+        echo "FAIL pipeline_cache run 2: $(grep '^Pipeline cache: ignoring' $log)"
+        failures=$((failures + 1))
+    elif [ $run -eq 2 ] && ! [ "${loaded:-0}" -gt 0 ]; then
+        echo "FAIL pipeline_cache run 2: nothing loaded from the file the first run saved"
+        failures=$((failures + 1))
+    else
+        echo "PASS pipeline_cache run $run: 3 precompiled, ${loaded:-0} bytes loaded"
+    fi
+done
+
+# Eviction: three 512x512 textures with generated mips against a 2 MiB budget, a different one
+# bound every 10 frames, so binding keeps streaming evicted textures back in
+for value in 100 200 300; do
+    head -c 1048576 /dev/zero | tr '\000' "\\$value" > $OUT_DIR/texture_$value.raw
+done
+
+log=$OUT_DIR/eviction.log
+if ! ./a.out --headless $RENDER_SIZE --scene triangle --frames 60 --texture-size 512x512 --texture-budget-mb 2 \
+        --texture $OUT_DIR/texture_100.raw --texture $OUT_DIR/texture_200.raw --texture $OUT_DIR/texture_300.raw \
+        --texture-cycle 10 > $log 2>&1 < /dev/null; then
+    echo "FAIL eviction: renderer exited with an error, see $log"
+    failures=$((failures + 1))
+elif ! grep -q "^Memory pressure: evicting texture" $log; then
+    echo "FAIL eviction: nothing was evicted, see $log"
+    failures=$((failures + 1))
+else
+    echo "PASS eviction: $(grep -c '^Memory pressure: evicting texture' $log) evictions"
+fi
+
+# LOD chain: the fixture's 720 triangles at level 0, halved at least three times
+tests/meshcheck $OUT_DIR/sphere.mesh 720 4 || failures=$((failures + 1))
+
+# YUV: the same frame as PPM and as both 4:2:0 layouts, the planes against a CPU conversion of the PPM
+yuv_ok=true
+for format in ppm nv12 i420; do
+    if ! ./a.out --headless $RENDER_SIZE --scene materials --frames 3 --capture $OUT_DIR/yuv_$format \
+            --capture-format $format --capture-frame 2 > $OUT_DIR/yuv_$format.log 2>&1 < /dev/null; then
+        echo "FAIL yuv: renderer exited with an error, see $OUT_DIR/yuv_$format.log"
+        failures=$((failures + 1))
+        yuv_ok=false
+    fi
+done
+
+if $yuv_ok; then
+    tests/yuvcheck $OUT_DIR/yuv_ppm_000002.ppm $OUT_DIR/yuv_nv12_000002.nv12 nv12 || failures=$((failures + 1))
+    tests/yuvcheck $OUT_DIR/yuv_ppm_000002.ppm $OUT_DIR/yuv_i420_000002.yuv i420 || failures=$((failures + 1))
+fi
+
+# Draw sort: generated lists on both sides of the parallel threshold against qsort
+log=$OUT_DIR/sort_check.log
+if ! ./a.out --headless $RENDER_SIZE --scene triangle --frames 1 --sort-check > $log 2>&1 < /dev/null; then
+    echo "FAIL sort_check: renderer exited with an error, see $log"
+    failures=$((failures + 1))
+else
+    echo "PASS sort_check: $(sed -n 's/^Draw sort check: //p' $log)"
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+
+echo "All scenes passed"
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+// Converts a binary PPM capture to 4:2:0 planes on the CPU, BT.601 limited range with
+// chroma from the average of each 2x2 block like shaders/yuv.comp, and compares them with
+// an NV12 or I420 capture of the same frame. Exits 0 when every sample is within
+// tolerance, 1 when one isn't and 2 when a file can't be read.
+
+typedef struct Image
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t *pixels; // Packed RGB
+} Image;
+
+bool read_ppm(const char *filename, Image *image);
+
+bool read_ppm(const char *filename, Image *image)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        printf("Failed to open image: %s\n", filename);
+        return false;
+    }
+
+    unsigned int max_value;
+
+    if (fscanf(file, "P6 %u %u %u", &image->width, &image->height, &max_value) != 3 || max_value != 255)
+    {
+        printf("Not an 8-bit binary PPM: %s\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    fgetc(file); // Single whitespace before the pixel data
+
+    size_t size = (size_t)image->width * image->height * 3;
+    image->pixels = (uint8_t*)malloc(size);
+
+    if (image->pixels == NULL || fread(image->pixels, 1, size, file) != size)
+    {
+        printf("Truncated image: %s\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static uint8_t to_byte(double value)
+{
+    value = round(value);
+    return (uint8_t)(value < 0.0 ? 0.0 : value > 255.0 ? 255.0 : value);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || argc > 5 || (strcmp(argv[3], "nv12") != 0 && strcmp(argv[3], "i420") != 0))
+    {
+        printf("Usage: %s REFERENCE.ppm PLANES nv12|i420 [MAX_DELTA]\n", argv[0]);
+        return 2;
+    }
+
+    bool nv12 = strcmp(argv[3], "nv12") == 0;
+    int max_delta = argc > 4 ? atoi(argv[4]) : 1;
+    Image image = {0};
+
+    if (!read_ppm(argv[1], &image))
+    {
+        return 2;
+    }
+
+    // The renderer crops YUV captures to a multiple of 8 wide and 2 high
+    uint32_t width = image.width & ~7u;
+    uint32_t height = image.height & ~1u;
+    size_t luma_size = (size_t)width * height;
+    size_t size = luma_size * 3 / 2;
+
+    uint8_t *planes = (uint8_t*)malloc(size);
+    uint8_t *expected = (uint8_t*)malloc(size);
+    FILE *file = fopen(argv[2], "rb");
+
+    if (planes == NULL || expected == NULL || file == NULL || fread(planes, 1, size, file) != size || fgetc(file) != EOF)
+    {
+        printf("Failed to read %ux%u %s planes: %s\n", width, height, argv[3], argv[2]);
+        return 2;
+    }
+    fclose(file);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const uint8_t *p = &image.pixels[((size_t)y * image.width + x) * 3];
+            expected[(size_t)y * width + x] = to_byte(16.0 + 219.0 / 255.0 * (0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]));
+        }
+    }
+
+    for (uint32_t y = 0; y < height; y += 2)
+    {
+        for (uint32_t x = 0; x < width; x += 2)
+        {
+            double c[3] = { 0.0, 0.0, 0.0 };
+
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                const uint8_t *p = &image.pixels[((size_t)(y + i / 2) * image.width + x + i % 2) * 3];
+
+                for (uint32_t channel = 0; channel < 3; channel++)
+                    c[channel] += p[channel] * 0.25;
+            }
+
+            uint8_t u = to_byte(128.0 + 224.0 / 255.0 * (-0.168736 * c[0] - 0.331264 * c[1] + 0.5 * c[2]));
+            uint8_t v = to_byte(128.0 + 224.0 / 255.0 * (0.5 * c[0] - 0.418688 * c[1] - 0.081312 * c[2]));
+            size_t sample = (size_t)(y / 2) * (width / 2) + x / 2;
+
+            if (nv12)
+            {
+                expected[luma_size + sample * 2] = u;
+                expected[luma_size + sample * 2 + 1] = v;
+            }
+            else
+            {
+                expected[luma_size + sample] = u;
+                expected[luma_size + luma_size / 4 + sample] = v;
+            }
+        }
+    }
+
+    // Worst sample per plane, NV12's interleaved chroma counts as U and V by position
+    int worst[3] = { 0, 0, 0 };
+
+    for (size_t i = 0; i < size; i++)
+    {
+        int plane = i < luma_size ? 0 : nv12 ? 1 + (int)((i - luma_size) % 2) : i < luma_size + luma_size / 4 ? 1 : 2;
+        int delta = abs((int)planes[i] - (int)expected[i]);
+
+        if (delta > worst[plane])
+            worst[plane] = delta;
+    }
+
+    bool pass = worst[0] <= max_delta && worst[1] <= max_delta && worst[2] <= max_delta;
+
+    printf("%s %s: largest difference from the CPU conversion Y %d, U %d, V %d (max %d)\n", pass ? "PASS" : "FAIL",
+           argv[2], worst[0], worst[1], worst[2], max_delta);
+
+    free(expected);
+    free(planes);
+    free(image.pixels);
+    return pass ? 0 : 1;
+}
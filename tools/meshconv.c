@@ -0,0 +1,1281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "../mesh_format.h"
+
+// Converts a Wavefront OBJ file into the renderer's binary mesh format: quantized
+// positions, octahedral normals, 16 or 32-bit indices, bounds, an LOD chain and meshlets.
+// Exits 0 on success, 1 on bad input and 2 when a file can't be read or written.
+
+// Meshlet cones are built from unquantized normals, this covers the difference
+#define CONE_MARGIN 0.02f
+
+// The LOD chain ends below this many triangles, or when a level keeps more than
+// LOD_MIN_REDUCTION of the one before
+#define LOD_MIN_TRIANGLES 64
+#define LOD_MIN_REDUCTION 0.8f
+
+// Planes through border edges count this much more than faces of the same size
+#define BORDER_WEIGHT 10.0
+
+// Collapses may turn a neighbouring triangle by at most acos of this
+#define FLIP_COSINE 0.2f
+
+typedef struct ObjCorner
+{
+    int32_t position;        // 0 based
+    int32_t normal;          // -1 when the face has no normal
+} ObjCorner;
+
+typedef struct ObjMesh
+{
+    float *positions;        // xyz
+    uint32_t position_count;
+    float *normals;          // xyz
+    uint32_t normal_count;
+    ObjCorner *corners;      // Three per triangle
+    uint32_t corner_count;
+} ObjMesh;
+
+typedef struct Mesh
+{
+    float *positions;        // xyz per vertex
+    float *normals;
+    uint32_t vertex_count;
+    uint32_t *indices;
+    uint32_t index_count;
+    MeshMeshlet *meshlets;
+    uint32_t meshlet_count;
+    MeshLod lods[MESH_MAX_LODS];
+    uint32_t lod_count;
+} Mesh;
+
+typedef struct Quadric Quadric;
+
+typedef struct Simplifier
+{
+    uint32_t *canonical;     // Lowest numbered vertex at the same position
+    uint32_t *variant_first; // Vertices at each canonical position are variants[variant_first[c]..variant_first[c + 1]]
+    uint32_t *variants;
+    uint32_t *collapsed;     // Position each canonical position moved onto during the current pass
+    bool *border;
+    Quadric *quadrics;       // Per canonical position
+    uint32_t *plane_first;   // Level 0 face planes around each canonical position are planes[plane_first[c]..plane_first[c + 1]]
+    double *planes;          // Normal and offset, 4 per plane
+} Simplifier;
+
+void *grow(void *array, uint32_t needed, uint32_t *capacity, size_t element_size);
+char *read_text(const char *filename);
+bool parse_corner(const char *token, const ObjMesh *obj, ObjCorner *corner);
+bool parse_obj(char *text, ObjMesh *obj);
+void weld_vertices(const ObjMesh *obj, Mesh *mesh);
+void reorder_vertices(Mesh *mesh);
+void create_simplifier(const Mesh *mesh, Simplifier *s);
+void destroy_simplifier(Simplifier *s);
+float measure_error(const Mesh *mesh, const Simplifier *s);
+uint32_t simplify(const Mesh *mesh, Simplifier *s, uint32_t *indices, uint32_t index_count, uint32_t target_count);
+void build_lods(Mesh *mesh);
+void build_meshlets(Mesh *mesh, MeshLod *lod);
+uint16_t encode_normal(const float *normal);
+bool write_mesh(const char *filename, const Mesh *mesh);
+
+// Makes room for needed elements
+void *grow(void *array, uint32_t needed, uint32_t *capacity, size_t element_size)
+{
+    if (needed <= *capacity)
+    {
+        return array;
+    }
+
+    while (*capacity < needed)
+    {
+        *capacity = *capacity > 0 ? *capacity * 2 : 1024;
+    }
+
+    array = realloc(array, (size_t)*capacity * element_size);
+
+    if (array == NULL)
+    {
+        printf("Out of memory\n");
+        exit(2);
+    }
+
+    return array;
+}
+
+// Wraps malloc and calloc, running out of memory ends the conversion like it does in grow
+void *check_alloc(void *pointer)
+{
+    if (pointer == NULL)
+    {
+        printf("Out of memory\n");
+        exit(2);
+    }
+
+    return pointer;
+}
+
+char *read_text(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        printf("Failed to open: %s\n", filename);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = malloc((size_t)size + 1);
+
+    if (text == NULL || fread(text, 1, (size_t)size, file) != (size_t)size)
+    {
+        printf("Failed to read: %s\n", filename);
+        free(text);
+        fclose(file);
+        return NULL;
+    }
+
+    text[size] = '\0';
+    fclose(file);
+    return text;
+}
+
+// "v", "v/vt", "v//vn" or "v/vt/vn", indices are 1 based or negative for relative ones
+bool parse_corner(const char *token, const ObjMesh *obj, ObjCorner *corner)
+{
+    char *end;
+    long position = strtol(token, &end, 10);
+    long normal = 0;
+
+    if (*end == '/')
+    {
+        const char *texcoord = end + 1;
+        strtol(texcoord, &end, 10);
+
+        if (*end == '/')
+        {
+            normal = strtol(end + 1, &end, 10);
+        }
+    }
+
+    position = position < 0 ? (long)obj->position_count + position : position - 1;
+    normal = normal < 0 ? (long)obj->normal_count + normal : normal - 1;
+
+    if (position < 0 || position >= (long)obj->position_count || normal >= (long)obj->normal_count)
+    {
+        return false;
+    }
+
+    corner->position = (int32_t)position;
+    corner->normal = normal >= 0 ? (int32_t)normal : -1;
+    return true;
+}
+
+// Positions, normals and faces, polygons are fanned into triangles. Everything else is skipped.
+bool parse_obj(char *text, ObjMesh *obj)
+{
+    uint32_t position_capacity = 0;
+    uint32_t normal_capacity = 0;
+    uint32_t corner_capacity = 0;
+    uint32_t line_number = 0;
+
+    for (char *line = text; line != NULL; )
+    {
+        char *next = strchr(line, '\n');
+
+        if (next != NULL)
+        {
+            *next++ = '\0';
+        }
+
+        line_number++;
+
+        char *cursor = line;
+        line = next;
+
+        while (*cursor == ' ' || *cursor == '\t')
+        {
+            cursor++;
+        }
+
+        if (cursor[0] == 'v' && (cursor[1] == ' ' || cursor[1] == '\t'))
+        {
+            obj->positions = grow(obj->positions, (obj->position_count + 1) * 3, &position_capacity, sizeof(float));
+            float *p = &obj->positions[obj->position_count * 3];
+
+            if (sscanf(cursor + 2, "%f %f %f", &p[0], &p[1], &p[2]) != 3)
+            {
+                printf("Bad position on line %u\n", line_number);
+                return false;
+            }
+            obj->position_count++;
+        }
+        else if (cursor[0] == 'v' && cursor[1] == 'n')
+        {
+            obj->normals = grow(obj->normals, (obj->normal_count + 1) * 3, &normal_capacity, sizeof(float));
+            float *n = &obj->normals[obj->normal_count * 3];
+
+            if (sscanf(cursor + 3, "%f %f %f", &n[0], &n[1], &n[2]) != 3)
+            {
+                printf("Bad normal on line %u\n", line_number);
+                return false;
+            }
+            obj->normal_count++;
+        }
+        else if (cursor[0] == 'f' && (cursor[1] == ' ' || cursor[1] == '\t'))
+        {
+            ObjCorner first = {0};
+            ObjCorner previous = {0};
+            uint32_t count = 0;
+            char *save;
+
+            for (char *token = strtok_r(cursor + 2, " \t\r", &save); token != NULL; token = strtok_r(NULL, " \t\r", &save))
+            {
+                ObjCorner corner;
+
+                if (!parse_corner(token, obj, &corner))
+                {
+                    printf("Bad face on line %u\n", line_number);
+                    return false;
+                }
+
+                if (count >= 2)
+                {
+                    obj->corners = grow(obj->corners, obj->corner_count + 3, &corner_capacity, sizeof(ObjCorner));
+                    obj->corners[obj->corner_count++] = first;
+                    obj->corners[obj->corner_count++] = previous;
+                    obj->corners[obj->corner_count++] = corner;
+                }
+
+                first = count == 0 ? corner : first;
+                previous = corner;
+                count++;
+            }
+        }
+    }
+
+    if (obj->corner_count == 0)
+    {
+        printf("No faces\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void triangle_normal(const float *a, const float *b, const float *c, float *normal)
+{
+    float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+    float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+
+    normal[0] = u[1] * v[2] - u[2] * v[1];
+    normal[1] = u[2] * v[0] - u[0] * v[2];
+    normal[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static bool normalize(float *v)
+{
+    float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+
+    if (length < 1e-12f)
+    {
+        return false;
+    }
+
+    v[0] /= length;
+    v[1] /= length;
+    v[2] /= length;
+    return true;
+}
+
+static uint64_t corner_hash(ObjCorner corner)
+{
+    uint64_t key = (uint64_t)(uint32_t)corner.position << 32 | (uint32_t)corner.normal;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// One vertex per distinct position and normal pair. Corners without a normal get the
+// area weighted average of the faces around their position.
+void weld_vertices(const ObjMesh *obj, Mesh *mesh)
+{
+    float *smooth = check_alloc(calloc((size_t)obj->position_count * 3, sizeof(float)));
+
+    for (uint32_t i = 0; i < obj->corner_count; i += 3)
+    {
+        float normal[3];
+        triangle_normal(&obj->positions[obj->corners[i].position * 3], &obj->positions[obj->corners[i + 1].position * 3],
+                        &obj->positions[obj->corners[i + 2].position * 3], normal);
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            for (uint32_t axis = 0; axis < 3; axis++)
+            {
+                smooth[obj->corners[i + k].position * 3 + axis] += normal[axis];
+            }
+        }
+    }
+
+    // Open addressed, a power of two at least twice the corner count
+    uint32_t table_size = 1;
+    while (table_size < obj->corner_count * 2)
+    {
+        table_size <<= 1;
+    }
+
+    uint32_t *table = check_alloc(malloc(table_size * sizeof(uint32_t)));
+    memset(table, 0xff, table_size * sizeof(uint32_t));
+
+    ObjCorner *unique = check_alloc(malloc(obj->corner_count * sizeof(ObjCorner)));
+    mesh->indices = check_alloc(malloc(obj->corner_count * sizeof(uint32_t)));
+    mesh->index_count = obj->corner_count;
+    mesh->vertex_count = 0;
+
+    for (uint32_t i = 0; i < obj->corner_count; i++)
+    {
+        ObjCorner corner = obj->corners[i];
+        uint32_t slot = (uint32_t)corner_hash(corner) & (table_size - 1);
+
+        while (table[slot] != UINT32_MAX &&
+               (unique[table[slot]].position != corner.position || unique[table[slot]].normal != corner.normal))
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == UINT32_MAX)
+        {
+            table[slot] = mesh->vertex_count;
+            unique[mesh->vertex_count++] = corner;
+        }
+
+        mesh->indices[i] = table[slot];
+    }
+
+    mesh->positions = check_alloc(malloc((size_t)mesh->vertex_count * 3 * sizeof(float)));
+    mesh->normals = check_alloc(malloc((size_t)mesh->vertex_count * 3 * sizeof(float)));
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        const float *source = unique[v].normal >= 0 ? &obj->normals[unique[v].normal * 3] : &smooth[unique[v].position * 3];
+        float *normal = &mesh->normals[v * 3];
+
+        memcpy(&mesh->positions[v * 3], &obj->positions[unique[v].position * 3], 3 * sizeof(float));
+        memcpy(normal, source, 3 * sizeof(float));
+
+        if (!normalize(normal))
+        {
+            normal[0] = 0.0f;
+            normal[1] = 0.0f;
+            normal[2] = 1.0f;
+        }
+    }
+
+    free(unique);
+    free(table);
+    free(smooth);
+}
+
+// Numbers vertices in the order the index buffer first uses them, so meshlets read
+// mostly contiguous vertex data
+void reorder_vertices(Mesh *mesh)
+{
+    uint32_t *remap = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    memset(remap, 0xff, mesh->vertex_count * sizeof(uint32_t));
+
+    float *positions = check_alloc(malloc((size_t)mesh->vertex_count * 3 * sizeof(float)));
+    float *normals = check_alloc(malloc((size_t)mesh->vertex_count * 3 * sizeof(float)));
+    uint32_t next = 0;
+
+    for (uint32_t i = 0; i < mesh->index_count; i++)
+    {
+        uint32_t old = mesh->indices[i];
+
+        if (remap[old] == UINT32_MAX)
+        {
+            remap[old] = next;
+            memcpy(&positions[next * 3], &mesh->positions[old * 3], 3 * sizeof(float));
+            memcpy(&normals[next * 3], &mesh->normals[old * 3], 3 * sizeof(float));
+            next++;
+        }
+
+        mesh->indices[i] = remap[old];
+    }
+
+    free(mesh->positions);
+    free(mesh->normals);
+    free(remap);
+    mesh->positions = positions;
+    mesh->normals = normals;
+    mesh->vertex_count = next;
+}
+
+// Sum of squared distances to a set of planes, a symmetric 4x4 matrix stored as its upper half
+typedef struct Quadric
+{
+    double a2, ab, ac, ad;
+    double b2, bc, bd;
+    double c2, cd;
+    double d2;
+    double weight;           // Total plane weight, the error is divided by it
+} Quadric;
+
+typedef struct Collapse
+{
+    uint32_t from;           // Canonical vertices
+    uint32_t to;
+    double cost;
+} Collapse;
+
+static void quadric_add_plane(Quadric *q, const double *n, double d, double weight)
+{
+    q->a2 += weight * n[0] * n[0];
+    q->ab += weight * n[0] * n[1];
+    q->ac += weight * n[0] * n[2];
+    q->ad += weight * n[0] * d;
+    q->b2 += weight * n[1] * n[1];
+    q->bc += weight * n[1] * n[2];
+    q->bd += weight * n[1] * d;
+    q->c2 += weight * n[2] * n[2];
+    q->cd += weight * n[2] * d;
+    q->d2 += weight * d * d;
+    q->weight += weight;
+}
+
+static void quadric_add(Quadric *q, const Quadric *other)
+{
+    double *a = &q->a2;
+    const double *b = &other->a2;
+
+    for (uint32_t i = 0; i < sizeof(Quadric) / sizeof(double); i++)
+    {
+        a[i] += b[i];
+    }
+}
+
+// Mean squared distance from p to the planes
+static double quadric_error(const Quadric *q, const float *p)
+{
+    double x = p[0];
+    double y = p[1];
+    double z = p[2];
+    double error = q->a2 * x * x + q->b2 * y * y + q->c2 * z * z + q->d2 +
+                   2.0 * (q->ab * x * y + q->ac * x * z + q->bc * y * z + q->ad * x + q->bd * y + q->cd * z);
+
+    return q->weight > 0.0 ? fabs(error) / q->weight : 0.0;
+}
+
+static uint64_t edge_hash(uint32_t a, uint32_t b)
+{
+    uint64_t key = (uint64_t)a << 32 | b;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static int compare_collapses(const void *a, const void *b)
+{
+    double left = ((const Collapse *)a)->cost;
+    double right = ((const Collapse *)b)->cost;
+    return (left > right) - (left < right);
+}
+
+// Vertices that only differ in their normal are simplified as one position, the lowest
+// numbered of them stands for the rest. Quadrics hold the planes of the faces around each
+// position, plus a plane through every border edge that keeps open borders from shrinking.
+void create_simplifier(const Mesh *mesh, Simplifier *s)
+{
+    uint32_t table_size = 1;
+    while (table_size < mesh->vertex_count * 2)
+    {
+        table_size <<= 1;
+    }
+
+    uint32_t *table = check_alloc(malloc(table_size * sizeof(uint32_t)));
+    memset(table, 0xff, table_size * sizeof(uint32_t));
+
+    s->canonical = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    s->variant_first = check_alloc(calloc(mesh->vertex_count + 1, sizeof(uint32_t)));
+    s->variants = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    s->collapsed = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    s->border = check_alloc(calloc(mesh->vertex_count, sizeof(bool)));
+    s->quadrics = check_alloc(calloc(mesh->vertex_count, sizeof(Quadric)));
+    s->plane_first = check_alloc(calloc(mesh->vertex_count + 1, sizeof(uint32_t)));
+    s->planes = check_alloc(calloc((size_t)mesh->index_count * 4, sizeof(double)));
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        const float *p = &mesh->positions[v * 3];
+        uint32_t bits[3];
+        memcpy(bits, p, sizeof(bits));
+
+        uint32_t slot = (uint32_t)edge_hash(bits[0] ^ bits[2], bits[1]) & (table_size - 1);
+
+        while (table[slot] != UINT32_MAX && memcmp(&mesh->positions[table[slot] * 3], p, 3 * sizeof(float)) != 0)
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == UINT32_MAX)
+        {
+            table[slot] = v;
+        }
+
+        s->canonical[v] = table[slot];
+        s->collapsed[v] = v;
+        s->variant_first[table[slot] + 1]++;
+    }
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        s->variant_first[v + 1] += s->variant_first[v];
+    }
+
+    uint32_t *fill = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    memcpy(fill, s->variant_first, mesh->vertex_count * sizeof(uint32_t));
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        s->variants[fill[s->canonical[v]]++] = v;
+    }
+
+    // Room for a plane per corner, the first edge pass fills them through fill. Degenerate faces
+    // leave theirs zeroed, which measures as no distance.
+    for (uint32_t i = 0; i < mesh->index_count; i++)
+    {
+        s->plane_first[s->canonical[mesh->indices[i]] + 1]++;
+    }
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        s->plane_first[v + 1] += s->plane_first[v];
+    }
+
+    memcpy(fill, s->plane_first, mesh->vertex_count * sizeof(uint32_t));
+
+    // Directed edges between positions, an edge whose reverse is missing lies on a border
+    uint32_t edge_table_size = 1;
+    while (edge_table_size < mesh->index_count * 2)
+    {
+        edge_table_size <<= 1;
+    }
+
+    uint64_t *edges = check_alloc(malloc(edge_table_size * sizeof(uint64_t)));
+    memset(edges, 0xff, edge_table_size * sizeof(uint64_t));
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint32_t i = 0; i < mesh->index_count; i += 3)
+        {
+            uint32_t c[3] = { s->canonical[mesh->indices[i]], s->canonical[mesh->indices[i + 1]], s->canonical[mesh->indices[i + 2]] };
+            const float *p[3] = { &mesh->positions[c[0] * 3], &mesh->positions[c[1] * 3], &mesh->positions[c[2] * 3] };
+            float face[3];
+
+            triangle_normal(p[0], p[1], p[2], face);
+            double area = 0.5 * sqrt((double)face[0] * face[0] + (double)face[1] * face[1] + (double)face[2] * face[2]);
+
+            if (!normalize(face))
+            {
+                continue;
+            }
+
+            double n[3] = { face[0], face[1], face[2] };
+
+            if (pass == 0)
+            {
+                double d = -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]);
+
+                for (uint32_t k = 0; k < 3; k++)
+                {
+                    quadric_add_plane(&s->quadrics[c[k]], n, d, area);
+
+                    double *plane = &s->planes[(size_t)(fill[c[k]]++) * 4];
+                    plane[0] = n[0];
+                    plane[1] = n[1];
+                    plane[2] = n[2];
+                    plane[3] = d;
+                }
+            }
+
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t a = c[k];
+                uint32_t b = c[(k + 1) % 3];
+                uint32_t slot = (uint32_t)edge_hash(pass == 0 ? a : b, pass == 0 ? b : a) & (edge_table_size - 1);
+                uint64_t key = pass == 0 ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+
+                while (edges[slot] != UINT64_MAX && edges[slot] != key)
+                {
+                    slot = (slot + 1) & (edge_table_size - 1);
+                }
+
+                if (pass == 0)
+                {
+                    edges[slot] = key;
+                    continue;
+                }
+
+                if (edges[slot] == key)
+                {
+                    continue;
+                }
+
+                // The plane holds the edge and stands perpendicular to the face
+                const float *pa = &mesh->positions[a * 3];
+                const float *pb = &mesh->positions[b * 3];
+                double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+                double m[3] = { e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0] };
+                double length = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+
+                if (length < 1e-12)
+                {
+                    continue;
+                }
+
+                m[0] /= length;
+                m[1] /= length;
+                m[2] /= length;
+
+                double d = -(m[0] * pa[0] + m[1] * pa[1] + m[2] * pa[2]);
+                double weight = BORDER_WEIGHT * (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+
+                quadric_add_plane(&s->quadrics[a], m, d, weight);
+                quadric_add_plane(&s->quadrics[b], m, d, weight);
+                s->border[a] = true;
+                s->border[b] = true;
+            }
+        }
+    }
+
+    free(edges);
+    free(fill);
+    free(table);
+}
+
+void destroy_simplifier(Simplifier *s)
+{
+    free(s->canonical);
+    free(s->variant_first);
+    free(s->variants);
+    free(s->collapsed);
+    free(s->border);
+    free(s->quadrics);
+    free(s->plane_first);
+    free(s->planes);
+}
+
+// How far the level moved from level 0: the largest distance from where a collapsed position
+// ended up to the planes of the faces that were around it. Unlike the quadric costs, which are
+// weighted means, this doesn't shrink as more planes pile up in a quadric.
+float measure_error(const Mesh *mesh, const Simplifier *s)
+{
+    double error = 0.0;
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        uint32_t target = v;
+
+        if (s->canonical[v] != v)
+        {
+            continue;
+        }
+
+        // Collapsed positions are dead, so following the targets always ends
+        while (s->collapsed[target] != target)
+        {
+            target = s->collapsed[target];
+        }
+
+        if (target == v)
+        {
+            continue;
+        }
+
+        const float *p = &mesh->positions[target * 3];
+
+        for (uint32_t i = s->plane_first[v]; i < s->plane_first[v + 1]; i++)
+        {
+            const double *plane = &s->planes[(size_t)i * 4];
+            error = fmax(error, fabs(plane[0] * p[0] + plane[1] * p[1] + plane[2] * p[2] + plane[3]));
+        }
+    }
+
+    return (float)error;
+}
+
+// Whether moving from onto to turns any remaining triangle around from over
+static bool collapse_flips(const Mesh *mesh, const Simplifier *s, const uint32_t *indices, const uint32_t *triangle_first,
+                           const uint32_t *triangles, uint32_t from, uint32_t to)
+{
+    for (uint32_t t = triangle_first[from]; t < triangle_first[from + 1]; t++)
+    {
+        const uint32_t *corners = &indices[triangles[t] * 3];
+        uint32_t c[3] = { s->canonical[corners[0]], s->canonical[corners[1]], s->canonical[corners[2]] };
+
+        // Triangles on the edge disappear
+        if (c[0] == to || c[1] == to || c[2] == to)
+        {
+            continue;
+        }
+
+        const float *before[3];
+        const float *after[3];
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            before[k] = &mesh->positions[c[k] * 3];
+            after[k] = c[k] == from ? &mesh->positions[to * 3] : before[k];
+        }
+
+        float n0[3];
+        float n1[3];
+        triangle_normal(before[0], before[1], before[2], n0);
+        triangle_normal(after[0], after[1], after[2], n1);
+
+        if (!normalize(n0))
+        {
+            continue;
+        }
+
+        if (!normalize(n1) || n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] < FLIP_COSINE)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Collapses edges onto one of their endpoints, cheapest first, until at most target_count
+// indices are left or nothing can collapse. Each pass collapses an independent set of edges,
+// then rewrites the indices; vertices only move onto existing positions, so every level
+// shares the vertex section. Returns the index count left in indices.
+uint32_t simplify(const Mesh *mesh, Simplifier *s, uint32_t *indices, uint32_t index_count, uint32_t target_count)
+{
+    uint32_t *triangle_first = check_alloc(malloc((mesh->vertex_count + 1) * sizeof(uint32_t)));
+    uint32_t *triangles = check_alloc(malloc(index_count * sizeof(uint32_t)));
+    Collapse *collapses = check_alloc(malloc(index_count * sizeof(Collapse)));
+    bool *locked = check_alloc(malloc(mesh->vertex_count * sizeof(bool)));
+
+    while (index_count > target_count)
+    {
+        // Triangles around each position
+        memset(triangle_first, 0, (mesh->vertex_count + 1) * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < index_count; i++)
+        {
+            triangle_first[s->canonical[indices[i]] + 1]++;
+        }
+
+        for (uint32_t v = 0; v < mesh->vertex_count; v++)
+        {
+            triangle_first[v + 1] += triangle_first[v];
+        }
+
+        for (uint32_t i = 0; i < index_count; i++)
+        {
+            triangles[triangle_first[s->canonical[indices[i]]]++] = i / 3;
+        }
+
+        // Filling advanced every start to the next range's, shift them back
+        memmove(triangle_first + 1, triangle_first, mesh->vertex_count * sizeof(uint32_t));
+        triangle_first[0] = 0;
+
+        uint32_t collapse_count = 0;
+
+        for (uint32_t i = 0; i < index_count; i += 3)
+        {
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t a = s->canonical[indices[i + k]];
+                uint32_t b = s->canonical[indices[i + (k + 1) % 3]];
+
+                // Each interior edge shows up once from either side, border edges only once
+                if (a == b || (a > b && !s->border[a] && !s->border[b]))
+                {
+                    continue;
+                }
+
+                Quadric q = s->quadrics[a];
+                quadric_add(&q, &s->quadrics[b]);
+
+                // Border positions only move along the border
+                bool a_movable = !s->border[a] || s->border[b];
+                bool b_movable = !s->border[b] || s->border[a];
+                double a_cost = a_movable ? quadric_error(&q, &mesh->positions[b * 3]) : INFINITY;
+                double b_cost = b_movable ? quadric_error(&q, &mesh->positions[a * 3]) : INFINITY;
+
+                if (!a_movable && !b_movable)
+                {
+                    continue;
+                }
+
+                collapses[collapse_count++] = a_cost <= b_cost ? (Collapse){ a, b, a_cost } : (Collapse){ b, a, b_cost };
+            }
+        }
+
+        qsort(collapses, collapse_count, sizeof(Collapse), compare_collapses);
+        memset(locked, 0, mesh->vertex_count * sizeof(bool));
+
+        uint32_t needed = (index_count - target_count) / 3;
+        uint32_t removed = 0;
+        uint32_t applied = 0;
+
+        for (uint32_t i = 0; i < collapse_count && removed < needed; i++)
+        {
+            Collapse collapse = collapses[i];
+
+            if (locked[collapse.from] || locked[collapse.to] ||
+                collapse_flips(mesh, s, indices, triangle_first, triangles, collapse.from, collapse.to))
+            {
+                continue;
+            }
+
+            // Everything around from changes shape, keep it out of the rest of this pass
+            for (uint32_t t = triangle_first[collapse.from]; t < triangle_first[collapse.from + 1]; t++)
+            {
+                const uint32_t *corners = &indices[triangles[t] * 3];
+                uint32_t shared = 0;
+
+                for (uint32_t k = 0; k < 3; k++)
+                {
+                    locked[s->canonical[corners[k]]] = true;
+                    shared += s->canonical[corners[k]] == collapse.to;
+                }
+
+                removed += shared > 0;
+            }
+
+            s->collapsed[collapse.from] = collapse.to;
+            quadric_add(&s->quadrics[collapse.to], &s->quadrics[collapse.from]);
+            applied++;
+        }
+
+        if (applied == 0)
+        {
+            break;
+        }
+
+        // Corners of a collapsed position take the variant of the new position whose normal is closest
+        uint32_t kept = 0;
+
+        for (uint32_t i = 0; i < index_count; i += 3)
+        {
+            uint32_t corners[3];
+
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t v = indices[i + k];
+                uint32_t target = s->collapsed[s->canonical[v]];
+
+                if (target != s->canonical[v])
+                {
+                    const float *normal = &mesh->normals[v * 3];
+                    float best = -INFINITY;
+
+                    for (uint32_t j = s->variant_first[target]; j < s->variant_first[target + 1]; j++)
+                    {
+                        const float *candidate = &mesh->normals[s->variants[j] * 3];
+                        float similarity = normal[0] * candidate[0] + normal[1] * candidate[1] + normal[2] * candidate[2];
+
+                        if (similarity > best)
+                        {
+                            best = similarity;
+                            v = s->variants[j];
+                        }
+                    }
+                }
+
+                corners[k] = v;
+            }
+
+            if (s->canonical[corners[0]] != s->canonical[corners[1]] && s->canonical[corners[1]] != s->canonical[corners[2]] &&
+                s->canonical[corners[2]] != s->canonical[corners[0]])
+            {
+                memcpy(&indices[kept], corners, sizeof(corners));
+                kept += 3;
+            }
+        }
+
+        index_count = kept;
+    }
+
+    free(locked);
+    free(collapses);
+    free(triangles);
+    free(triangle_first);
+    return index_count;
+}
+
+// Level 0 is the welded mesh, each further level halves the triangles of the one before,
+// carrying the quadrics over so collapses are ordered by their cost against level 0. The chain
+// ends when a level gets small, simplification stalls, or a level's error doesn't grow: the
+// renderer picks the coarsest level under its threshold, so the finer one could never be drawn.
+void build_lods(Mesh *mesh)
+{
+    Simplifier simplifier;
+    create_simplifier(mesh, &simplifier);
+
+    uint32_t *current = check_alloc(malloc(mesh->index_count * sizeof(uint32_t)));
+    uint32_t current_count = mesh->index_count;
+    uint32_t capacity = mesh->index_count;
+
+    memcpy(current, mesh->indices, mesh->index_count * sizeof(uint32_t));
+    mesh->lods[0] = (MeshLod){ .first_index = 0, .index_count = mesh->index_count };
+    mesh->lod_count = 1;
+
+    while (mesh->lod_count < MESH_MAX_LODS && current_count / 3 >= LOD_MIN_TRIANGLES * 2)
+    {
+        uint32_t count = simplify(mesh, &simplifier, current, current_count, current_count / 6 * 3);
+
+        float error = measure_error(mesh, &simplifier);
+
+        // Level 1 may be lossless, level 0 is then simply never drawn
+        if (count > current_count * LOD_MIN_REDUCTION ||
+            (mesh->lod_count > 1 && !(error > mesh->lods[mesh->lod_count - 1].error)))
+        {
+            break;
+        }
+
+        mesh->indices = grow(mesh->indices, mesh->index_count + count, &capacity, sizeof(uint32_t));
+        memcpy(&mesh->indices[mesh->index_count], current, count * sizeof(uint32_t));
+        mesh->lods[mesh->lod_count++] = (MeshLod){
+            .first_index = mesh->index_count,
+            .index_count = count,
+            .error = error,
+        };
+        mesh->index_count += count;
+        current_count = count;
+    }
+
+    free(current);
+    destroy_simplifier(&simplifier);
+}
+
+static void finish_meshlet(const Mesh *mesh, MeshMeshlet *meshlet)
+{
+    const uint32_t *indices = &mesh->indices[meshlet->first_index];
+    uint32_t index_count = meshlet->triangle_count * 3;
+    float min[3] = { INFINITY, INFINITY, INFINITY };
+    float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        const float *p = &mesh->positions[indices[i] * 3];
+
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            min[axis] = fminf(min[axis], p[axis]);
+            max[axis] = fmaxf(max[axis], p[axis]);
+        }
+    }
+
+    float radius = 0.0f;
+
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        meshlet->center[axis] = (min[axis] + max[axis]) * 0.5f;
+    }
+
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        const float *p = &mesh->positions[indices[i] * 3];
+        float dx = p[0] - meshlet->center[0];
+        float dy = p[1] - meshlet->center[1];
+        float dz = p[2] - meshlet->center[2];
+        radius = fmaxf(radius, sqrtf(dx * dx + dy * dy + dz * dz));
+    }
+
+    meshlet->radius = radius;
+
+    // The cone holds every triangle's facing, degenerate triangles face nowhere
+    float normals[MESH_MESHLET_MAX_TRIANGLES][3];
+    bool valid[MESH_MESHLET_MAX_TRIANGLES];
+    float axis[3] = { 0.0f, 0.0f, 0.0f };
+
+    for (uint32_t t = 0; t < meshlet->triangle_count; t++)
+    {
+        triangle_normal(&mesh->positions[indices[t * 3] * 3], &mesh->positions[indices[t * 3 + 1] * 3],
+                        &mesh->positions[indices[t * 3 + 2] * 3], normals[t]);
+        valid[t] = normalize(normals[t]);
+
+        if (valid[t])
+        {
+            axis[0] += normals[t][0];
+            axis[1] += normals[t][1];
+            axis[2] += normals[t][2];
+        }
+    }
+
+    meshlet->cone_cutoff = 1.0f;
+
+    if (!normalize(axis))
+    {
+        return;
+    }
+
+    float min_dot = 1.0f;
+
+    for (uint32_t t = 0; t < meshlet->triangle_count; t++)
+    {
+        if (valid[t])
+        {
+            min_dot = fminf(min_dot, axis[0] * normals[t][0] + axis[1] * normals[t][1] + axis[2] * normals[t][2]);
+        }
+    }
+
+    memcpy(meshlet->cone_axis, axis, sizeof(axis));
+
+    // A cone of 90 degrees or wider always has a triangle facing the viewer
+    if (min_dot > 0.0f)
+    {
+        meshlet->cone_cutoff = fminf(1.0f, sqrtf(1.0f - min_dot * min_dot) + CONE_MARGIN);
+    }
+}
+
+// Cuts one level's indices, in order, into runs under the meshlet limits
+void build_meshlets(Mesh *mesh, MeshLod *lod)
+{
+    uint32_t *last_meshlet = check_alloc(malloc(mesh->vertex_count * sizeof(uint32_t)));
+    memset(last_meshlet, 0xff, mesh->vertex_count * sizeof(uint32_t));
+
+    uint32_t capacity = mesh->meshlet_count;
+    MeshMeshlet current = { .first_index = lod->first_index };
+
+    lod->first_meshlet = mesh->meshlet_count;
+
+    for (uint32_t i = lod->first_index; i < lod->first_index + lod->index_count; i += 3)
+    {
+        uint32_t added = 0;
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            added += last_meshlet[mesh->indices[i + k]] != mesh->meshlet_count;
+        }
+
+        if (current.vertex_count + added > MESH_MESHLET_MAX_VERTICES || current.triangle_count == MESH_MESHLET_MAX_TRIANGLES)
+        {
+            finish_meshlet(mesh, &current);
+            mesh->meshlets = grow(mesh->meshlets, mesh->meshlet_count + 1, &capacity, sizeof(MeshMeshlet));
+            mesh->meshlets[mesh->meshlet_count++] = current;
+            current = (MeshMeshlet){ .first_index = i };
+        }
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            if (last_meshlet[mesh->indices[i + k]] != mesh->meshlet_count)
+            {
+                last_meshlet[mesh->indices[i + k]] = mesh->meshlet_count;
+                current.vertex_count++;
+            }
+        }
+
+        current.triangle_count++;
+    }
+
+    finish_meshlet(mesh, &current);
+    mesh->meshlets = grow(mesh->meshlets, mesh->meshlet_count + 1, &capacity, sizeof(MeshMeshlet));
+    mesh->meshlets[mesh->meshlet_count++] = current;
+    lod->meshlet_count = mesh->meshlet_count - lod->first_meshlet;
+
+    free(last_meshlet);
+}
+
+// Projects onto the octahedron |x| + |y| + |z| = 1 and folds the lower half over the upper
+uint16_t encode_normal(const float *normal)
+{
+    float sum = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+    float x = normal[0] / sum;
+    float y = normal[1] / sum;
+
+    if (normal[2] < 0.0f)
+    {
+        float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    int8_t qx = (int8_t)lroundf(fmaxf(-1.0f, fminf(1.0f, x)) * 127.0f);
+    int8_t qy = (int8_t)lroundf(fmaxf(-1.0f, fminf(1.0f, y)) * 127.0f);
+
+    return (uint16_t)((uint8_t)qx | (uint16_t)(uint8_t)qy << 8);
+}
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + MESH_SECTION_ALIGNMENT - 1) & ~(uint64_t)(MESH_SECTION_ALIGNMENT - 1);
+}
+
+static bool write_padded(FILE *file, const void *data, size_t size, uint64_t *offset)
+{
+    static const uint8_t zeros[MESH_SECTION_ALIGNMENT] = {0};
+    uint64_t padded = align_offset(*offset + size);
+
+    if (fwrite(data, 1, size, file) != size || fwrite(zeros, 1, padded - *offset - size, file) != padded - *offset - size)
+    {
+        return false;
+    }
+
+    *offset = padded;
+    return true;
+}
+
+bool write_mesh(const char *filename, const Mesh *mesh)
+{
+    MeshHeader header = {
+        .magic = MESH_MAGIC,
+        .version = MESH_VERSION,
+        .flags = mesh->vertex_count > 65536 ? MESH_FLAG_INDEX32 : 0,
+        .vertex_count = mesh->vertex_count,
+        .index_count = mesh->index_count,
+        .meshlet_count = mesh->meshlet_count,
+        .bounds_min = { INFINITY, INFINITY, INFINITY },
+        .bounds_max = { -INFINITY, -INFINITY, -INFINITY },
+    };
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            header.bounds_min[axis] = fminf(header.bounds_min[axis], mesh->positions[v * 3 + axis]);
+            header.bounds_max[axis] = fmaxf(header.bounds_max[axis], mesh->positions[v * 3 + axis]);
+        }
+    }
+
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        header.center[axis] = (header.bounds_min[axis] + header.bounds_max[axis]) * 0.5f;
+    }
+
+    MeshVertex *vertices = check_alloc(malloc(mesh->vertex_count * sizeof(MeshVertex)));
+
+    for (uint32_t v = 0; v < mesh->vertex_count; v++)
+    {
+        const float *p = &mesh->positions[v * 3];
+        float dx = p[0] - header.center[0];
+        float dy = p[1] - header.center[1];
+        float dz = p[2] - header.center[2];
+        header.radius = fmaxf(header.radius, sqrtf(dx * dx + dy * dy + dz * dz));
+
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            float extent = header.bounds_max[axis] - header.bounds_min[axis];
+            float t = extent > 0.0f ? (p[axis] - header.bounds_min[axis]) / extent : 0.0f;
+            vertices[v].position[axis] = (uint16_t)lroundf(t * 65535.0f);
+        }
+
+        vertices[v].normal = encode_normal(&mesh->normals[v * 3]);
+    }
+
+    bool index32 = header.flags & MESH_FLAG_INDEX32;
+    size_t index_size = index32 ? sizeof(uint32_t) : sizeof(uint16_t);
+    uint8_t *indices = check_alloc(malloc(mesh->index_count * index_size));
+
+    for (uint32_t i = 0; i < mesh->index_count; i++)
+    {
+        if (index32)
+        {
+            ((uint32_t *)indices)[i] = mesh->indices[i];
+        }
+        else
+        {
+            ((uint16_t *)indices)[i] = (uint16_t)mesh->indices[i];
+        }
+    }
+
+    header.vertex_offset = align_offset(sizeof(MeshHeader));
+    header.index_offset = align_offset(header.vertex_offset + mesh->vertex_count * sizeof(MeshVertex));
+    header.meshlet_offset = align_offset(header.index_offset + mesh->index_count * index_size);
+    header.lod_offset = align_offset(header.meshlet_offset + mesh->meshlet_count * sizeof(MeshMeshlet));
+    header.lod_count = mesh->lod_count;
+
+    FILE *file = fopen(filename, "wb");
+    uint64_t offset = 0;
+    bool written = file != NULL &&
+                   write_padded(file, &header, sizeof(header), &offset) &&
+                   write_padded(file, vertices, mesh->vertex_count * sizeof(MeshVertex), &offset) &&
+                   write_padded(file, indices, mesh->index_count * index_size, &offset) &&
+                   write_padded(file, mesh->meshlets, mesh->meshlet_count * sizeof(MeshMeshlet), &offset) &&
+                   write_padded(file, mesh->lods, mesh->lod_count * sizeof(MeshLod), &offset);
+
+    if (file != NULL && fclose(file) != 0)
+    {
+        written = false;
+    }
+
+    if (!written)
+    {
+        printf("Failed to write: %s\n", filename);
+    }
+    else
+    {
+        // Level 0 is the source mesh, the totals cover every level
+        printf("%s: %u vertices, %u triangles, %u LODs with %u triangles and %u meshlets in total, %u-bit indices, %lu bytes\n",
+               filename, mesh->vertex_count, mesh->lods[0].index_count / 3, mesh->lod_count, mesh->index_count / 3,
+               mesh->meshlet_count, index32 ? 32 : 16, (unsigned long)offset);
+
+        for (uint32_t i = 0; i < mesh->lod_count; i++)
+        {
+            printf("  LOD %u: %u triangles, %u meshlets, error %g\n", i, mesh->lods[i].index_count / 3,
+                   mesh->lods[i].meshlet_count, mesh->lods[i].error);
+        }
+    }
+
+    free(indices);
+    free(vertices);
+    return written;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: %s input.obj output.mesh\n", argv[0]);
+        return 2;
+    }
+
+    const char *extension = strrchr(argv[1], '.');
+
+    if (extension != NULL && (strcmp(extension, ".gltf") == 0 || strcmp(extension, ".glb") == 0))
+    {
+        printf("glTF input is not supported, export the model as OBJ first\n");
+        return 1;
+    }
+
+    char *text = read_text(argv[1]);
+
+    if (text == NULL)
+    {
+        return 2;
+    }
+
+    ObjMesh obj = {0};
+    Mesh mesh = {0};
+
+    if (!parse_obj(text, &obj))
+    {
+        return 1;
+    }
+
+    weld_vertices(&obj, &mesh);
+    reorder_vertices(&mesh);
+    build_lods(&mesh);
+
+    for (uint32_t i = 0; i < mesh.lod_count; i++)
+    {
+        build_meshlets(&mesh, &mesh.lods[i]);
+    }
+
+    return write_mesh(argv[2], &mesh) ? 0 : 2;
+}